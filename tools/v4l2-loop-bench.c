@@ -0,0 +1,1099 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * v4l2-loop-bench.c
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+
+/*
+ * Throughput and latency benchmark of v4l2-loop devices.
+ *
+ * One producer and N consumers are run on a loop device for every
+ * combination of producer/consumer memory type (MMAP, USERPTR, DMABUF
+ * backed by udmabuf), consumer API (single/multi planar), format and
+ * resolution. Every case is reported as one JSON object per line.
+ *
+ * Producer stamps every frame (first 8 bytes of the first plane) with
+ * CLOCK_MONOTONIC, consumers compute latency out of it.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <linux/memfd.h>
+#include <linux/udmabuf.h>
+
+#include "../v4l2-loop.h"
+
+#define BENCH_MAX_CONSUMERS 64
+#define BENCH_MAX_FORMATS 64
+#define BENCH_MAX_SIZES 16
+#define BENCH_MAX_DEVICES 2
+#define BENCH_MAX_SAMPLES (1U << 22) /* latency samples kept per consumer */
+
+#define BENCH_ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+struct bench_plane {
+	void *addr;		/* where the frame can be read/written */
+	size_t length;
+	int dmabuf_fd;		/* -1 if not a DMABUF */
+	bool mapped;		/* 'addr' comes from mmap() */
+};
+
+struct bench_buffer {
+	struct bench_plane planes[VIDEO_MAX_PLANES];
+};
+
+struct bench_queue {
+	int fd;
+	enum v4l2_buf_type type;
+	enum v4l2_memory memory;
+	unsigned int count;
+	unsigned int num_planes;
+	__u32 bytesused[VIDEO_MAX_PLANES];	/* payload of producer planes */
+	struct bench_buffer *buffers;
+};
+
+struct bench_consumer {
+	pthread_t thread;
+	struct bench_queue queue;
+	uint64_t frames;
+	uint64_t bytes;
+	uint64_t *samples;	/* latencies in ns */
+	size_t nsamples;
+};
+
+struct bench_device {
+	char path[32];
+	bool mplane;		/* producer uses multi planar API */
+	bool capture_mplane;	/* consumers can use multi planar API */
+	int nr;			/* created by us (removed at exit), -1 otherwise */
+};
+
+struct bench_case {
+	const struct bench_device *device;
+	__u32 pixelformat;
+	__u32 width;
+	__u32 height;
+	enum v4l2_memory producer_memory;
+	enum v4l2_memory consumer_memory;
+	bool consumer_mplane;
+};
+
+static struct {
+	const char *device;
+	unsigned int consumers;
+	unsigned int seconds;
+	unsigned int buffers;
+	unsigned int fps;	/* 0 - as fast as possible */
+	unsigned int memories;	/* bitmask of (1 << V4L2_MEMORY_*) */
+	unsigned int consumer_memories;
+	unsigned int apis;	/* bit 0 - single planar, bit 1 - multi planar consumers */
+	__u32 formats[BENCH_MAX_FORMATS];
+	unsigned int nformats;	/* 0 - all uncompressed ones the device supports */
+	__u32 widths[BENCH_MAX_SIZES];
+	__u32 heights[BENCH_MAX_SIZES];
+	unsigned int nsizes;
+} bench_options = {
+	.consumers = 1,
+	.seconds = 2,
+	.buffers = 4,
+	.memories = (1 << V4L2_MEMORY_MMAP) | (1 << V4L2_MEMORY_USERPTR) | (1 << V4L2_MEMORY_DMABUF),
+	.consumer_memories = (1 << V4L2_MEMORY_MMAP) | (1 << V4L2_MEMORY_USERPTR) | (1 << V4L2_MEMORY_DMABUF),
+	.apis = 3,
+};
+
+static const struct {
+	__u32 width;
+	__u32 height;
+} bench_default_sizes[] = {
+	{  640,  480 },
+	{ 1280,  720 },
+	{ 1920, 1080 },
+	{ 3840, 2160 },
+	{ 7680, 4320 },
+	{ 8192, 8192 },
+};
+
+static atomic_bool bench_stop;
+static int bench_udmabuf_fd = -1;
+static long bench_page_size;
+
+static uint64_t bench_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t bench_page_align(size_t size)
+{
+	return (size + bench_page_size - 1) & ~(size_t)(bench_page_size - 1);
+}
+
+static const char *bench_memory_name(enum v4l2_memory memory)
+{
+	switch (memory) {
+	case V4L2_MEMORY_MMAP:
+		return "mmap";
+	case V4L2_MEMORY_USERPTR:
+		return "userptr";
+	case V4L2_MEMORY_DMABUF:
+		return "dmabuf";
+	default:
+		return "unknown";
+	}
+}
+
+static const char *bench_fourcc(__u32 pixelformat, char *buf)
+{
+	buf[0] = pixelformat & 0xff;
+	buf[1] = (pixelformat >> 8) & 0xff;
+	buf[2] = (pixelformat >> 16) & 0xff;
+	buf[3] = (pixelformat >> 24) & 0xff;
+	buf[4] = '\0';
+
+	return buf;
+}
+
+static int bench_ioctl(int fd, unsigned long request, void *arg)
+{
+	int status;
+
+	do {
+		status = ioctl(fd, request, arg);
+	} while (status < 0 && errno == EINTR);
+
+	return status < 0 ? -errno : 0;
+}
+
+/* DMABUF backed by a memfd, 'addr' maps the memfd itself */
+static int bench_udmabuf_alloc(struct bench_plane *plane, size_t length)
+{
+	struct udmabuf_create create;
+	int memfd;
+	int status;
+
+	if (bench_udmabuf_fd < 0) {
+		bench_udmabuf_fd = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+		if (bench_udmabuf_fd < 0)
+			return -errno;
+	}
+
+	memfd = memfd_create("v4l2-loop-bench", MFD_ALLOW_SEALING | MFD_CLOEXEC);
+	if (memfd < 0)
+		return -errno;
+
+	if (ftruncate(memfd, length) < 0 ||
+		fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) < 0) {
+		status = -errno;
+		close(memfd);
+		return status;
+	}
+
+	memset(&create, 0, sizeof(create));
+	create.memfd = memfd;
+	create.flags = UDMABUF_FLAGS_CLOEXEC;
+	create.offset = 0;
+	create.size = length;
+
+	status = ioctl(bench_udmabuf_fd, UDMABUF_CREATE, &create);
+	if (status < 0) {
+		status = -errno;
+		close(memfd);
+		return status;
+	}
+	plane->dmabuf_fd = status;
+
+	plane->addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+	close(memfd);
+	if (plane->addr == MAP_FAILED) {
+		plane->addr = NULL;
+		return -errno;
+	}
+	plane->mapped = true;
+	plane->length = length;
+
+	return 0;
+}
+
+static void bench_plane_free(struct bench_plane *plane)
+{
+	if (plane->addr) {
+		if (plane->mapped)
+			munmap(plane->addr, plane->length);
+		else
+			free(plane->addr);
+	}
+	if (plane->dmabuf_fd >= 0)
+		close(plane->dmabuf_fd);
+
+	memset(plane, 0, sizeof(*plane));
+	plane->dmabuf_fd = -1;
+}
+
+static void bench_buffer_init(struct bench_queue *q, unsigned int index, struct v4l2_buffer *buffer,
+	struct v4l2_plane *planes)
+{
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->type = q->type;
+	buffer->memory = q->memory;
+	buffer->index = index;
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(q->type)) {
+		memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+		buffer->m.planes = planes;
+		buffer->length = q->num_planes ? q->num_planes : VIDEO_MAX_PLANES;
+	}
+}
+
+/* requests buffers and gets them mapped or allocated, depending on memory type */
+static int bench_queue_setup(struct bench_queue *q, unsigned int count)
+{
+	struct v4l2_requestbuffers reqbufs;
+	unsigned int i;
+	unsigned int p;
+	int status;
+
+	memset(&reqbufs, 0, sizeof(reqbufs));
+	reqbufs.count = count;
+	reqbufs.type = q->type;
+	reqbufs.memory = q->memory;
+
+	status = bench_ioctl(q->fd, VIDIOC_REQBUFS, &reqbufs);
+	if (status)
+		return status;
+
+	if (reqbufs.count == 0)
+		return -ENOMEM;
+
+	q->count = reqbufs.count;
+	q->buffers = calloc(q->count, sizeof(*q->buffers));
+	if (!q->buffers)
+		return -ENOMEM;
+
+	for (i = 0; i < q->count; i++)
+		for (p = 0; p < VIDEO_MAX_PLANES; p++)
+			q->buffers[i].planes[p].dmabuf_fd = -1;
+
+	for (i = 0; i < q->count; i++) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
+		struct v4l2_buffer buffer;
+
+		bench_buffer_init(q, i, &buffer, planes);
+		status = bench_ioctl(q->fd, VIDIOC_QUERYBUF, &buffer);
+		if (status)
+			return status;
+
+		q->num_planes = V4L2_TYPE_IS_MULTIPLANAR(q->type) ? buffer.length : 1;
+
+		for (p = 0; p < q->num_planes; p++) {
+			struct bench_plane *plane = &q->buffers[i].planes[p];
+			size_t length = V4L2_TYPE_IS_MULTIPLANAR(q->type) ?
+				planes[p].length : buffer.length;
+			off_t offset = V4L2_TYPE_IS_MULTIPLANAR(q->type) ?
+				planes[p].m.mem_offset : buffer.m.offset;
+
+			switch (q->memory) {
+			case V4L2_MEMORY_MMAP:
+				plane->addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, offset);
+				if (plane->addr == MAP_FAILED) {
+					plane->addr = NULL;
+					return -errno;
+				}
+				plane->mapped = true;
+				plane->length = length;
+				break;
+
+			case V4L2_MEMORY_USERPTR:
+				length = bench_page_align(length);
+				plane->addr = aligned_alloc(bench_page_size, length);
+				if (!plane->addr)
+					return -ENOMEM;
+				memset(plane->addr, 0, length);
+				plane->length = length;
+				break;
+
+			case V4L2_MEMORY_DMABUF:
+				status = bench_udmabuf_alloc(plane, bench_page_align(length));
+				if (status)
+					return status;
+				break;
+
+			default:
+				return -EINVAL;
+			}
+		}
+	}
+
+	return 0;
+}
+
+static void bench_queue_release(struct bench_queue *q)
+{
+	struct v4l2_requestbuffers reqbufs;
+	unsigned int i;
+	unsigned int p;
+
+	if (q->buffers) {
+		for (i = 0; i < q->count; i++)
+			for (p = 0; p < VIDEO_MAX_PLANES; p++)
+				bench_plane_free(&q->buffers[i].planes[p]);
+		free(q->buffers);
+		q->buffers = NULL;
+	}
+
+	if (q->fd >= 0) {
+		memset(&reqbufs, 0, sizeof(reqbufs));
+		reqbufs.type = q->type;
+		reqbufs.memory = q->memory;
+		bench_ioctl(q->fd, VIDIOC_REQBUFS, &reqbufs);
+		close(q->fd);
+		q->fd = -1;
+	}
+}
+
+static int bench_qbuf(struct bench_queue *q, unsigned int index)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	unsigned int p;
+
+	bench_buffer_init(q, index, &buffer, planes);
+
+	for (p = 0; p < q->num_planes; p++) {
+		const struct bench_plane *plane = &q->buffers[index].planes[p];
+
+		if (V4L2_TYPE_IS_MULTIPLANAR(q->type)) {
+			planes[p].bytesused = q->bytesused[p];
+			planes[p].length = plane->length;
+			if (q->memory == V4L2_MEMORY_USERPTR)
+				planes[p].m.userptr = (unsigned long)plane->addr;
+			else
+			if (q->memory == V4L2_MEMORY_DMABUF)
+				planes[p].m.fd = plane->dmabuf_fd;
+		} else {
+			buffer.bytesused = q->bytesused[0];
+			if (q->memory == V4L2_MEMORY_USERPTR) {
+				buffer.m.userptr = (unsigned long)plane->addr;
+				buffer.length = plane->length;
+			} else
+			if (q->memory == V4L2_MEMORY_DMABUF) {
+				buffer.m.fd = plane->dmabuf_fd;
+				buffer.length = plane->length;
+			}
+		}
+	}
+
+	return bench_ioctl(q->fd, VIDIOC_QBUF, &buffer);
+}
+
+/* returns index of the dequeued buffer, 'data_offset' and 'bytes' describe its payload */
+static int bench_dqbuf(struct bench_queue *q, __u32 *data_offset, uint64_t *bytes)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	unsigned int p;
+	int status;
+
+	bench_buffer_init(q, 0, &buffer, planes);
+
+	status = bench_ioctl(q->fd, VIDIOC_DQBUF, &buffer);
+	if (status)
+		return status;
+
+	*data_offset = 0;
+	*bytes = 0;
+	if (V4L2_TYPE_IS_MULTIPLANAR(q->type)) {
+		*data_offset = planes[0].data_offset;
+		for (p = 0; p < buffer.length; p++)
+			*bytes += planes[p].bytesused - planes[p].data_offset;
+	} else
+		*bytes = buffer.bytesused;
+
+	return buffer.index;
+}
+
+static void bench_stamp(struct bench_queue *q, unsigned int index)
+{
+	uint64_t now_ns = bench_now_ns();
+
+	memcpy(q->buffers[index].planes[0].addr, &now_ns, sizeof(now_ns));
+}
+
+static void *bench_consumer_run(void *arg)
+{
+	struct bench_consumer *c = arg;
+
+	for (;;) {
+		__u32 data_offset;
+		uint64_t bytes;
+		uint64_t stamp_ns;
+		int index;
+
+		index = bench_dqbuf(&c->queue, &data_offset, &bytes);
+		if (index < 0)
+			break; /* producer stopped streaming */
+
+		if (!atomic_load(&bench_stop)) {
+			const struct bench_plane *plane = &c->queue.buffers[index].planes[0];
+
+			if (data_offset + sizeof(stamp_ns) <= plane->length) {
+				memcpy(&stamp_ns, (const char *)plane->addr + data_offset, sizeof(stamp_ns));
+				if (c->nsamples < BENCH_MAX_SAMPLES)
+					c->samples[c->nsamples++] = bench_now_ns() - stamp_ns;
+			}
+			c->frames++;
+			c->bytes += bytes;
+		}
+
+		if (bench_qbuf(&c->queue, index))
+			break;
+	}
+
+	return NULL;
+}
+
+static int bench_compare_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static double bench_percentile_us(const uint64_t *samples, size_t n, double percentile)
+{
+	size_t i;
+
+	if (n == 0)
+		return 0;
+
+	i = (size_t)(percentile * (n - 1) / 100.0 + 0.5);
+
+	return samples[i] / 1000.0;
+}
+
+static double bench_timeval_ms(const struct timeval *tv)
+{
+	return tv->tv_sec * 1000.0 + tv->tv_usec / 1000.0;
+}
+
+static void bench_report(const struct bench_case *bc, const char *status, const char *error,
+	const struct bench_consumer *consumers, unsigned int nconsumers,
+	uint64_t produced, uint64_t elapsed_ns, const struct rusage *usage)
+{
+	char fourcc[5];
+	uint64_t frames = 0;
+	uint64_t bytes = 0;
+	uint64_t *samples = NULL;
+	size_t nsamples = 0;
+	double seconds = elapsed_ns / 1e9;
+	unsigned int i;
+
+	printf("{\"device\":\"%s\",\"producer_api\":\"%s\",\"consumer_api\":\"%s\","
+		"\"format\":\"%s\",\"width\":%u,\"height\":%u,"
+		"\"producer_memory\":\"%s\",\"consumer_memory\":\"%s\",\"consumers\":%u,\"status\":\"%s\"",
+		bc->device->path, bc->device->mplane ? "mplane" : "splane",
+		bc->consumer_mplane ? "mplane" : "splane",
+		bench_fourcc(bc->pixelformat, fourcc), bc->width, bc->height,
+		bench_memory_name(bc->producer_memory), bench_memory_name(bc->consumer_memory),
+		bench_options.consumers, status);
+
+	if (error) {
+		printf(",\"error\":\"%s\"}\n", error);
+		fflush(stdout);
+		return;
+	}
+
+	for (i = 0; i < nconsumers; i++) {
+		frames += consumers[i].frames;
+		bytes += consumers[i].bytes;
+		nsamples += consumers[i].nsamples;
+	}
+
+	samples = malloc(sizeof(*samples) * (nsamples ? nsamples : 1));
+	if (samples) {
+		size_t n = 0;
+
+		for (i = 0; i < nconsumers; i++) {
+			memcpy(samples + n, consumers[i].samples, sizeof(*samples) * consumers[i].nsamples);
+			n += consumers[i].nsamples;
+		}
+		qsort(samples, nsamples, sizeof(*samples), bench_compare_u64);
+	} else
+		nsamples = 0;
+
+	printf(",\"seconds\":%.3f,\"frames_produced\":%llu,\"frames_consumed\":%llu,"
+		"\"producer_fps\":%.2f,\"consumer_fps\":%.2f,\"bandwidth_mbps\":%.2f,"
+		"\"cpu_user_ms\":%.1f,\"cpu_sys_ms\":%.1f,"
+		"\"latency_p50_us\":%.1f,\"latency_p99_us\":%.1f,\"latency_p999_us\":%.1f}\n",
+		seconds, (unsigned long long)produced, (unsigned long long)frames,
+		produced / seconds, nconsumers ? frames / seconds / nconsumers : 0.0,
+		bytes / seconds / 1e6,
+		bench_timeval_ms(&usage->ru_utime), bench_timeval_ms(&usage->ru_stime),
+		bench_percentile_us(samples, nsamples, 50.0),
+		bench_percentile_us(samples, nsamples, 99.0),
+		bench_percentile_us(samples, nsamples, 99.9));
+	fflush(stdout);
+
+	free(samples);
+}
+
+static void bench_rusage_diff(struct rusage *end, const struct rusage *start)
+{
+	timersub(&end->ru_utime, &start->ru_utime, &end->ru_utime);
+	timersub(&end->ru_stime, &start->ru_stime, &end->ru_stime);
+}
+
+static int bench_set_format(const struct bench_case *bc, struct bench_queue *producer)
+{
+	struct v4l2_format format;
+	unsigned int p;
+	int status;
+
+	memset(&format, 0, sizeof(format));
+	format.type = producer->type;
+	if (bc->device->mplane) {
+		format.fmt.pix_mp.pixelformat = bc->pixelformat;
+		format.fmt.pix_mp.width = bc->width;
+		format.fmt.pix_mp.height = bc->height;
+		format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	} else {
+		format.fmt.pix.pixelformat = bc->pixelformat;
+		format.fmt.pix.width = bc->width;
+		format.fmt.pix.height = bc->height;
+		format.fmt.pix.field = V4L2_FIELD_NONE;
+	}
+
+	status = bench_ioctl(producer->fd, VIDIOC_S_FMT, &format);
+	if (status)
+		return status;
+
+	if (bc->device->mplane) {
+		for (p = 0; p < format.fmt.pix_mp.num_planes && p < VIDEO_MAX_PLANES; p++)
+			producer->bytesused[p] = format.fmt.pix_mp.plane_fmt[p].sizeimage;
+	} else
+		producer->bytesused[0] = format.fmt.pix.sizeimage;
+
+	if (bench_options.fps) {
+		struct v4l2_streamparm parm;
+
+		memset(&parm, 0, sizeof(parm));
+		parm.type = producer->type;
+		parm.parm.output.timeperframe.numerator = 1;
+		parm.parm.output.timeperframe.denominator = bench_options.fps;
+		bench_ioctl(producer->fd, VIDIOC_S_PARM, &parm);
+	}
+
+	return 0;
+}
+
+static void bench_run_case(const struct bench_case *bc)
+{
+	struct bench_queue producer = { .fd = -1 };
+	struct bench_consumer consumers[BENCH_MAX_CONSUMERS];
+	unsigned int nconsumers = 0;
+	unsigned int nthreads = 0;
+	struct rusage usage_start, usage;
+	uint64_t produced = 0;
+	uint64_t start_ns = 0, end_ns = 0, next_ns;
+	uint64_t interval_ns = bench_options.fps ? 1000000000ULL / bench_options.fps : 0;
+	const char *error = NULL;
+	const char *status = "ok";
+	enum v4l2_buf_type type;
+	unsigned int i;
+	int ret;
+
+	memset(consumers, 0, sizeof(consumers));
+	memset(&usage, 0, sizeof(usage));
+	atomic_store(&bench_stop, false);
+
+	producer.fd = open(bc->device->path, O_RDWR);
+	if (producer.fd < 0) {
+		bench_report(bc, "error", strerror(errno), NULL, 0, 0, 0, NULL);
+		return;
+	}
+	producer.type = bc->device->mplane ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	producer.memory = bc->producer_memory;
+
+	ret = bench_set_format(bc, &producer);
+	if (!ret)
+		ret = bench_queue_setup(&producer, bench_options.buffers);
+	if (ret) {
+		status = "unsupported";
+		error = strerror(-ret);
+		goto out;
+	}
+
+	type = bc->consumer_mplane ?
+		V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+	for (i = 0; i < bench_options.consumers; i++) {
+		struct bench_consumer *c = &consumers[i];
+		unsigned int index;
+
+		c->queue.fd = open(bc->device->path, O_RDWR);
+		if (c->queue.fd < 0) {
+			status = "error";
+			error = strerror(errno);
+			goto out;
+		}
+		c->queue.type = type;
+		c->queue.memory = bc->consumer_memory;
+		nconsumers++;
+
+		c->samples = malloc(sizeof(*c->samples) * BENCH_MAX_SAMPLES);
+		if (!c->samples) {
+			status = "error";
+			error = strerror(ENOMEM);
+			goto out;
+		}
+
+		ret = bench_queue_setup(&c->queue, producer.count);
+		for (index = 0; !ret && index < c->queue.count; index++)
+			ret = bench_qbuf(&c->queue, index);
+		if (ret) {
+			status = "unsupported";
+			error = strerror(-ret);
+			goto out;
+		}
+	}
+
+	getrusage(RUSAGE_SELF, &usage_start);
+
+	for (i = 0; i < nconsumers; i++) {
+		if (pthread_create(&consumers[i].thread, NULL, bench_consumer_run, &consumers[i])) {
+			status = "error";
+			error = "cannot create consumer thread";
+			goto out_stop;
+		}
+		nthreads++;
+	}
+
+	for (i = 0; i < producer.count; i++) {
+		bench_stamp(&producer, i);
+		ret = bench_qbuf(&producer, i);
+		if (ret) {
+			status = "error";
+			error = strerror(-ret);
+			goto out_stop;
+		}
+	}
+
+	ret = bench_ioctl(producer.fd, VIDIOC_STREAMON, &producer.type);
+	if (ret) {
+		status = "error";
+		error = strerror(-ret);
+		goto out_stop;
+	}
+
+	start_ns = bench_now_ns();
+	end_ns = start_ns + bench_options.seconds * 1000000000ULL;
+	next_ns = start_ns;
+
+	while (bench_now_ns() < end_ns) {
+		struct pollfd pfd = { .fd = producer.fd, .events = POLLOUT };
+		__u32 data_offset;
+		uint64_t bytes;
+		int index;
+
+		ret = poll(&pfd, 1, 1000);
+		if (ret <= 0) {
+			status = "error";
+			error = ret ? strerror(errno) : "producer stalled";
+			break;
+		}
+
+		index = bench_dqbuf(&producer, &data_offset, &bytes);
+		if (index < 0) {
+			if (index == -EAGAIN)
+				continue;
+			status = "error";
+			error = strerror(-index);
+			break;
+		}
+
+		if (interval_ns) {
+			struct timespec ts;
+
+			next_ns += interval_ns;
+			ts.tv_sec = next_ns / 1000000000ULL;
+			ts.tv_nsec = next_ns % 1000000000ULL;
+			clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+		}
+
+		bench_stamp(&producer, index);
+		ret = bench_qbuf(&producer, index);
+		if (ret) {
+			status = "error";
+			error = strerror(-ret);
+			break;
+		}
+		produced++;
+	}
+	end_ns = bench_now_ns();
+
+out_stop:
+	atomic_store(&bench_stop, true);
+	bench_ioctl(producer.fd, VIDIOC_STREAMOFF, &producer.type);
+
+	for (i = 0; i < nthreads; i++)
+		pthread_join(consumers[i].thread, NULL);
+
+	if (nthreads) {
+		getrusage(RUSAGE_SELF, &usage);
+		bench_rusage_diff(&usage, &usage_start);
+	}
+
+	if (!error)
+		bench_report(bc, status, NULL, consumers, nconsumers, produced, end_ns - start_ns, &usage);
+
+out:
+	if (error)
+		bench_report(bc, status, error, NULL, 0, 0, 0, NULL);
+
+	for (i = 0; i < nconsumers; i++) {
+		bench_queue_release(&consumers[i].queue);
+		free(consumers[i].samples);
+	}
+	bench_queue_release(&producer);
+}
+
+static unsigned int bench_enum_formats(const struct bench_device *device, __u32 *formats)
+{
+	struct v4l2_fmtdesc fmtdesc;
+	unsigned int n = 0;
+	int fd;
+
+	fd = open(device->path, O_RDWR);
+	if (fd < 0)
+		return 0;
+
+	memset(&fmtdesc, 0, sizeof(fmtdesc));
+	fmtdesc.type = device->mplane ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+	while (n < BENCH_MAX_FORMATS && !bench_ioctl(fd, VIDIOC_ENUM_FMT, &fmtdesc)) {
+		if (!(fmtdesc.flags & V4L2_FMT_FLAG_COMPRESSED))
+			formats[n++] = fmtdesc.pixelformat;
+		fmtdesc.index++;
+	}
+
+	close(fd);
+
+	return n;
+}
+
+static void bench_run_device(const struct bench_device *device)
+{
+	__u32 formats[BENCH_MAX_FORMATS];
+	unsigned int nformats;
+	unsigned int f, s, pm, cm, api;
+
+	if (bench_options.nformats) {
+		nformats = bench_options.nformats;
+		memcpy(formats, bench_options.formats, sizeof(formats[0]) * nformats);
+	} else
+		nformats = bench_enum_formats(device, formats);
+
+	for (f = 0; f < nformats; f++)
+	for (s = 0; s < bench_options.nsizes; s++)
+	for (pm = V4L2_MEMORY_MMAP; pm <= V4L2_MEMORY_DMABUF; pm++)
+	for (cm = V4L2_MEMORY_MMAP; cm <= V4L2_MEMORY_DMABUF; cm++)
+	for (api = 0; api < 2; api++) {
+		struct bench_case bc = {
+			.device = device,
+			.pixelformat = formats[f],
+			.width = bench_options.widths[s],
+			.height = bench_options.heights[s],
+			.producer_memory = pm,
+			.consumer_memory = cm,
+			.consumer_mplane = api,
+		};
+
+		if (!(bench_options.memories & (1 << pm)) ||
+			!(bench_options.consumer_memories & (1 << cm)) ||
+			!(bench_options.apis & (1 << api)))
+			continue;
+
+		if (bc.consumer_mplane && !device->capture_mplane)
+			continue;
+
+		bench_run_case(&bc);
+	}
+}
+
+static int bench_probe_device(struct bench_device *device)
+{
+	struct v4l2_capability cap;
+	int fd;
+	int status;
+
+	fd = open(device->path, O_RDWR);
+	if (fd < 0)
+		return -errno;
+
+	memset(&cap, 0, sizeof(cap));
+	status = bench_ioctl(fd, VIDIOC_QUERYCAP, &cap);
+	close(fd);
+	if (status)
+		return status;
+
+	if (strncmp((const char *)cap.driver, "v4l2-loop", 9))
+		fprintf(stderr, "warning: %s is not a v4l2-loop device (%s)\n", device->path, cap.driver);
+
+	device->mplane = !!(cap.device_caps & V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+	device->capture_mplane = !!(cap.device_caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE);
+
+	return 0;
+}
+
+/* creates devices (single and multi planar one) with the control device */
+static int bench_add_devices(struct bench_device *devices, unsigned int *ndevices)
+{
+	int control;
+	int status = 0;
+	unsigned int i;
+
+	control = open("/dev/" V4L2_LOOP_CONTROL_NAME, O_RDWR | O_CLOEXEC);
+	if (control < 0)
+		return -errno;
+
+	for (i = 0; i < BENCH_MAX_DEVICES; i++) {
+		struct v4l2_loop_config config;
+
+		memset(&config, 0, sizeof(config));
+		config.nr = -1;
+		config.buffers = 2;
+		config.mplane = i ? V4L2_LOOP_MPLANE_ON : V4L2_LOOP_MPLANE_OFF;
+
+		status = bench_ioctl(control, V4L2_LOOP_CTL_ADD, &config);
+		if (status)
+			break;
+
+		devices[i].nr = config.nr;
+		snprintf(devices[i].path, sizeof(devices[i].path), "/dev/video%d", config.nr);
+		(*ndevices)++;
+	}
+
+	close(control);
+
+	return status;
+}
+
+static void bench_remove_devices(struct bench_device *devices, unsigned int ndevices)
+{
+	int control;
+	unsigned int i;
+
+	control = open("/dev/" V4L2_LOOP_CONTROL_NAME, O_RDWR | O_CLOEXEC);
+	if (control < 0)
+		return;
+
+	for (i = 0; i < ndevices; i++) {
+		__s32 nr = devices[i].nr;
+
+		if (nr >= 0)
+			bench_ioctl(control, V4L2_LOOP_CTL_REMOVE, &nr);
+	}
+
+	close(control);
+}
+
+static unsigned int bench_parse_memories(const char *list)
+{
+	unsigned int memories = 0;
+
+	if (strstr(list, "mmap"))
+		memories |= 1 << V4L2_MEMORY_MMAP;
+	if (strstr(list, "userptr"))
+		memories |= 1 << V4L2_MEMORY_USERPTR;
+	if (strstr(list, "dmabuf"))
+		memories |= 1 << V4L2_MEMORY_DMABUF;
+
+	return memories;
+}
+
+static int bench_parse_formats(char *list)
+{
+	char *token;
+
+	for (token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+		char fourcc[4] = { ' ', ' ', ' ', ' ' };
+
+		if (bench_options.nformats == BENCH_MAX_FORMATS || strlen(token) > 4)
+			return -1;
+
+		memcpy(fourcc, token, strlen(token));
+		bench_options.formats[bench_options.nformats++] =
+			v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+	}
+
+	return 0;
+}
+
+static int bench_parse_sizes(char *list)
+{
+	char *token;
+
+	for (token = strtok(list, ","); token; token = strtok(NULL, ",")) {
+		unsigned int width, height;
+
+		if (bench_options.nsizes == BENCH_MAX_SIZES ||
+			sscanf(token, "%ux%u", &width, &height) != 2 || !width || !height)
+			return -1;
+
+		bench_options.widths[bench_options.nsizes] = width;
+		bench_options.heights[bench_options.nsizes] = height;
+		bench_options.nsizes++;
+	}
+
+	return 0;
+}
+
+static void bench_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options]\n"
+		"  -d <device>   loop device to use (default: a single and a multi planar one\n"
+		"                are created with /dev/" V4L2_LOOP_CONTROL_NAME " and removed at exit)\n"
+		"  -n <count>    number of consumers (1-%u, default: 1)\n"
+		"  -t <seconds>  duration of every case (default: 2)\n"
+		"  -b <count>    number of producer buffers (default: 4)\n"
+		"  -r <fps>      producer frame rate (default: 0 - as fast as possible)\n"
+		"  -p <list>     producer memory types (default: mmap,userptr,dmabuf)\n"
+		"  -c <list>     consumer memory types (default: mmap,userptr,dmabuf)\n"
+		"  -a <list>     consumer APIs (default: splane,mplane)\n"
+		"  -f <list>     formats, e.g. YUYV,NV12 (default: all uncompressed ones)\n"
+		"  -s <list>     resolutions, e.g. 640x480,1920x1080 (default: 640x480 up to 8192x8192)\n",
+		name, BENCH_MAX_CONSUMERS);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_device devices[BENCH_MAX_DEVICES];
+	unsigned int ndevices = 0;
+	unsigned int i;
+	int opt;
+	int status;
+
+	bench_page_size = sysconf(_SC_PAGESIZE);
+
+	while ((opt = getopt(argc, argv, "d:n:t:b:r:p:c:a:f:s:h")) != -1) {
+		switch (opt) {
+		case 'd':
+			bench_options.device = optarg;
+			break;
+		case 'n':
+			bench_options.consumers = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			bench_options.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			bench_options.buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			bench_options.fps = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			bench_options.memories = bench_parse_memories(optarg);
+			break;
+		case 'c':
+			bench_options.consumer_memories = bench_parse_memories(optarg);
+			break;
+		case 'a':
+			bench_options.apis = (strstr(optarg, "splane") ? 1 : 0) | (strstr(optarg, "mplane") ? 2 : 0);
+			break;
+		case 'f':
+			if (bench_parse_formats(optarg)) {
+				bench_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		case 's':
+			if (bench_parse_sizes(optarg)) {
+				bench_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			bench_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (bench_options.consumers < 1 || bench_options.consumers > BENCH_MAX_CONSUMERS ||
+		bench_options.seconds < 1 || bench_options.buffers < 1) {
+		bench_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	if (!bench_options.nsizes) {
+		for (i = 0; i < BENCH_ARRAY_SIZE(bench_default_sizes); i++) {
+			bench_options.widths[i] = bench_default_sizes[i].width;
+			bench_options.heights[i] = bench_default_sizes[i].height;
+		}
+		bench_options.nsizes = BENCH_ARRAY_SIZE(bench_default_sizes);
+	}
+
+	memset(devices, 0, sizeof(devices));
+	for (i = 0; i < BENCH_MAX_DEVICES; i++)
+		devices[i].nr = -1;
+
+	if (bench_options.device) {
+		snprintf(devices[0].path, sizeof(devices[0].path), "%s", bench_options.device);
+		ndevices = 1;
+	} else {
+		status = bench_add_devices(devices, &ndevices);
+		if (status) {
+			fprintf(stderr, "cannot create loop devices: %s (use -d <device>)\n", strerror(-status));
+			bench_remove_devices(devices, ndevices);
+			return EXIT_FAILURE;
+		}
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		status = bench_probe_device(&devices[i]);
+		if (status) {
+			fprintf(stderr, "%s: %s\n", devices[i].path, strerror(-status));
+			continue;
+		}
+		bench_run_device(&devices[i]);
+	}
+
+	bench_remove_devices(devices, ndevices);
+
+	if (bench_udmabuf_fd >= 0)
+		close(bench_udmabuf_fd);
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,828 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * v4l2-loop-stress.c
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+
+/*
+ * Concurrency stress of v4l2-loop devices.
+ *
+ * Every device is fed by one producer running at the maximum rate,
+ * consumers (threads) are spread over the devices and, while streaming,
+ * randomly release their buffers (REQBUFS(0)), stop streaming or close
+ * their handles and start over. Random choices come from a seeded
+ * generator (per thread), so runs with the same seed issue the same
+ * sequence of operations.
+ *
+ * If the kernel has CONFIG_LOCK_STAT, lock contention statistics of the
+ * driver's locks are cleared before and collected after the run.
+ * Results are printed as JSON, one object per line.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "../v4l2-loop.h"
+
+#define STRESS_MAX_DEVICES 16
+#define STRESS_MAX_CONSUMERS 64
+#define STRESS_MAX_BUFFERS 32
+#define STRESS_STALL_MS 1000 /* consumer waiting that long for a frame counts as a stall */
+
+#define STRESS_LOCK_STAT "/proc/lock_stat"
+#define STRESS_LOCK_STAT_ENABLE "/proc/sys/kernel/lock_stat"
+
+#define STRESS_ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+enum stress_op {
+	STRESS_OP_REQBUFS0,
+	STRESS_OP_STREAMOFF,
+	STRESS_OP_CLOSE,
+	STRESS_OP_COUNT
+};
+
+static const char *stress_op_names[STRESS_OP_COUNT] = {
+	"reqbufs0",
+	"streamoff",
+	"close",
+};
+
+struct stress_mapping {
+	void *addr;
+	size_t length;
+};
+
+struct stress_queue {
+	int fd;
+	enum v4l2_buf_type type;
+	unsigned int count;
+	unsigned int num_planes;
+	struct stress_mapping maps[STRESS_MAX_BUFFERS][VIDEO_MAX_PLANES];
+};
+
+struct stress_device {
+	char path[32];
+	int nr;				/* created by us (removed at exit), -1 otherwise */
+	bool mplane;
+	pthread_t producer;
+	struct stress_queue queue;	/* producer's one */
+	atomic_uint_fast64_t produced;
+	atomic_uint_fast64_t producer_errors;
+};
+
+struct stress_consumer {
+	pthread_t thread;
+	unsigned int index;
+	struct stress_device *device;
+	struct stress_queue queue;
+	unsigned int seed;
+	uint64_t frames;
+	uint64_t stalls;
+	uint64_t errors;
+	uint64_t ops[STRESS_OP_COUNT];
+	uint64_t dqbuf_wait_max_ns;
+	uint64_t dqbuf_wait_total_ns;
+};
+
+static struct {
+	unsigned int ndevices;
+	unsigned int consumers;
+	unsigned int seconds;
+	unsigned int seed;
+	unsigned int buffers;
+	unsigned int rate;	/* 1 out of 'rate' frames is followed by a random disruption */
+	__u32 pixelformat;
+	__u32 width;
+	__u32 height;
+} stress_options = {
+	.ndevices = 2,
+	.consumers = 16,
+	.seconds = 10,
+	.seed = 1,
+	.buffers = 4,
+	.rate = 100,
+	.pixelformat = V4L2_PIX_FMT_YUYV,
+	.width = 640,
+	.height = 480,
+};
+
+/* lock classes (as named by lockdep) reported from lock_stat */
+static const char *const stress_lock_classes[] = {
+	"&dev->vb_queue_lock",
+	"&dev->queued_bufs_lock",
+	"&dev->waiting_consumers",
+	"&dev->xforms_lock",
+	"&dev->timeout_image_lock",
+	"&xform->lock",
+	"&vdev->fh_lock",
+	"&q->done_wq",
+	"&q->done_lock",
+	"&q->mmap_lock",
+	"v4l2_loop_devices_lock",
+};
+
+static atomic_bool stress_stop;
+
+static uint64_t stress_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int stress_ioctl(int fd, unsigned long request, void *arg)
+{
+	int status;
+
+	do {
+		status = ioctl(fd, request, arg);
+	} while (status < 0 && errno == EINTR);
+
+	return status < 0 ? -errno : 0;
+}
+
+static void stress_buffer_init(struct stress_queue *q, unsigned int index, struct v4l2_buffer *buffer,
+	struct v4l2_plane *planes)
+{
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->type = q->type;
+	buffer->memory = V4L2_MEMORY_MMAP;
+	buffer->index = index;
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(q->type)) {
+		memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+		buffer->m.planes = planes;
+		buffer->length = VIDEO_MAX_PLANES;
+	}
+}
+
+static void stress_unmap(struct stress_queue *q)
+{
+	unsigned int i;
+	unsigned int p;
+
+	for (i = 0; i < STRESS_MAX_BUFFERS; i++)
+		for (p = 0; p < VIDEO_MAX_PLANES; p++)
+			if (q->maps[i][p].addr) {
+				munmap(q->maps[i][p].addr, q->maps[i][p].length);
+				q->maps[i][p].addr = NULL;
+			}
+	q->count = 0;
+}
+
+static int stress_reqbufs(struct stress_queue *q, unsigned int count)
+{
+	struct v4l2_requestbuffers reqbufs;
+	int status;
+
+	memset(&reqbufs, 0, sizeof(reqbufs));
+	reqbufs.count = count;
+	reqbufs.type = q->type;
+	reqbufs.memory = V4L2_MEMORY_MMAP;
+
+	status = stress_ioctl(q->fd, VIDIOC_REQBUFS, &reqbufs);
+	if (status)
+		return status;
+
+	q->count = reqbufs.count < STRESS_MAX_BUFFERS ? reqbufs.count : STRESS_MAX_BUFFERS;
+
+	return 0;
+}
+
+static int stress_qbuf(struct stress_queue *q, unsigned int index)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	unsigned int p;
+
+	stress_buffer_init(q, index, &buffer, planes);
+	if (V4L2_TYPE_IS_MULTIPLANAR(q->type)) {
+		buffer.length = q->num_planes;
+		for (p = 0; p < q->num_planes; p++)
+			planes[p].bytesused = q->maps[index][p].length;
+	} else
+		buffer.bytesused = q->maps[index][0].length;
+
+	return stress_ioctl(q->fd, VIDIOC_QBUF, &buffer);
+}
+
+static int stress_dqbuf(struct stress_queue *q)
+{
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	int status;
+
+	stress_buffer_init(q, 0, &buffer, planes);
+
+	status = stress_ioctl(q->fd, VIDIOC_DQBUF, &buffer);
+	if (status)
+		return status;
+
+	return buffer.index;
+}
+
+/* requests, maps and queues (all of) 'count' buffers */
+static int stress_queue_start(struct stress_queue *q, unsigned int count)
+{
+	unsigned int i;
+	unsigned int p;
+	int status;
+
+	status = stress_reqbufs(q, count);
+	if (status)
+		return status;
+
+	for (i = 0; i < q->count; i++) {
+		struct v4l2_plane planes[VIDEO_MAX_PLANES];
+		struct v4l2_buffer buffer;
+
+		stress_buffer_init(q, i, &buffer, planes);
+		status = stress_ioctl(q->fd, VIDIOC_QUERYBUF, &buffer);
+		if (status)
+			return status;
+
+		q->num_planes = V4L2_TYPE_IS_MULTIPLANAR(q->type) ? buffer.length : 1;
+		for (p = 0; p < q->num_planes; p++) {
+			struct stress_mapping *map = &q->maps[i][p];
+			size_t length = V4L2_TYPE_IS_MULTIPLANAR(q->type) ?
+				planes[p].length : buffer.length;
+			off_t offset = V4L2_TYPE_IS_MULTIPLANAR(q->type) ?
+				planes[p].m.mem_offset : buffer.m.offset;
+
+			map->addr = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_SHARED, q->fd, offset);
+			if (map->addr == MAP_FAILED) {
+				map->addr = NULL;
+				return -errno;
+			}
+			map->length = length;
+		}
+	}
+
+	for (i = 0; i < q->count; i++) {
+		status = stress_qbuf(q, i);
+		if (status)
+			return status;
+	}
+
+	return 0;
+}
+
+static void stress_queue_stop(struct stress_queue *q)
+{
+	stress_unmap(q);
+	stress_reqbufs(q, 0);
+}
+
+static void *stress_producer_run(void *arg)
+{
+	struct stress_device *device = arg;
+	struct stress_queue *q = &device->queue;
+
+	while (!atomic_load(&stress_stop)) {
+		struct pollfd pfd = { .fd = q->fd, .events = POLLOUT };
+		int index;
+
+		if (poll(&pfd, 1, 100) <= 0)
+			continue;
+
+		index = stress_dqbuf(q);
+		if (index < 0) {
+			if (index != -EAGAIN)
+				atomic_fetch_add(&device->producer_errors, 1);
+			continue;
+		}
+
+		if (stress_qbuf(q, index))
+			atomic_fetch_add(&device->producer_errors, 1);
+		else
+			atomic_fetch_add(&device->produced, 1);
+	}
+
+	return NULL;
+}
+
+static int stress_consumer_open(struct stress_consumer *c)
+{
+	c->queue.fd = open(c->device->path, O_RDWR | O_NONBLOCK);
+	if (c->queue.fd < 0)
+		return -errno;
+
+	return 0;
+}
+
+static void stress_consumer_disrupt(struct stress_consumer *c)
+{
+	enum stress_op op = rand_r(&c->seed) % STRESS_OP_COUNT;
+	enum v4l2_buf_type type = c->queue.type;
+
+	c->ops[op]++;
+
+	switch (op) {
+	case STRESS_OP_REQBUFS0:
+		stress_queue_stop(&c->queue);
+		break;
+
+	case STRESS_OP_STREAMOFF:
+		stress_ioctl(c->queue.fd, VIDIOC_STREAMOFF, &type);
+		stress_queue_stop(&c->queue);
+		break;
+
+	case STRESS_OP_CLOSE:
+		stress_unmap(&c->queue);
+		close(c->queue.fd);
+		if (stress_consumer_open(c))
+			c->errors++;
+		break;
+
+	default:
+		break;
+	}
+}
+
+static void *stress_consumer_run(void *arg)
+{
+	struct stress_consumer *c = arg;
+	bool started = false;
+
+	while (!atomic_load(&stress_stop)) {
+		struct pollfd pfd = { .fd = c->queue.fd, .events = POLLIN };
+		enum v4l2_buf_type type = c->queue.type;
+		uint64_t wait_ns;
+		int index;
+		int status;
+
+		if (c->queue.fd < 0 && stress_consumer_open(c)) {
+			c->errors++;
+			usleep(1000);
+			continue;
+		}
+
+		if (!started) {
+			status = stress_queue_start(&c->queue, c->device->queue.count);
+			if (!status)
+				status = stress_ioctl(c->queue.fd, VIDIOC_STREAMON, &type);
+			if (status) {
+				c->errors++;
+				stress_queue_stop(&c->queue);
+				usleep(1000);
+				continue;
+			}
+			started = true;
+		}
+
+		wait_ns = stress_now_ns();
+		status = poll(&pfd, 1, STRESS_STALL_MS);
+		wait_ns = stress_now_ns() - wait_ns;
+
+		c->dqbuf_wait_total_ns += wait_ns;
+		if (wait_ns > c->dqbuf_wait_max_ns)
+			c->dqbuf_wait_max_ns = wait_ns;
+
+		if (status == 0) {
+			c->stalls++;
+			continue;
+		}
+
+		index = stress_dqbuf(&c->queue);
+		if (index < 0) {
+			if (index != -EAGAIN)
+				c->errors++;
+			continue;
+		}
+		c->frames++;
+
+		if (rand_r(&c->seed) % stress_options.rate == 0) {
+			stress_consumer_disrupt(c);
+			started = false;
+			continue;
+		}
+
+		if (stress_qbuf(&c->queue, index))
+			c->errors++;
+	}
+
+	stress_queue_stop(&c->queue);
+	if (c->queue.fd >= 0)
+		close(c->queue.fd);
+
+	return NULL;
+}
+
+static int stress_producer_setup(struct stress_device *device)
+{
+	struct v4l2_capability cap;
+	struct v4l2_format format;
+	int status;
+
+	device->queue.fd = open(device->path, O_RDWR | O_NONBLOCK);
+	if (device->queue.fd < 0)
+		return -errno;
+
+	memset(&cap, 0, sizeof(cap));
+	status = stress_ioctl(device->queue.fd, VIDIOC_QUERYCAP, &cap);
+	if (status)
+		return status;
+
+	device->mplane = !!(cap.device_caps & V4L2_CAP_VIDEO_OUTPUT_MPLANE);
+	device->queue.type = device->mplane ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+
+	memset(&format, 0, sizeof(format));
+	format.type = device->queue.type;
+	if (device->mplane) {
+		format.fmt.pix_mp.pixelformat = stress_options.pixelformat;
+		format.fmt.pix_mp.width = stress_options.width;
+		format.fmt.pix_mp.height = stress_options.height;
+		format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+	} else {
+		format.fmt.pix.pixelformat = stress_options.pixelformat;
+		format.fmt.pix.width = stress_options.width;
+		format.fmt.pix.height = stress_options.height;
+		format.fmt.pix.field = V4L2_FIELD_NONE;
+	}
+
+	status = stress_ioctl(device->queue.fd, VIDIOC_S_FMT, &format);
+	if (status)
+		return status;
+
+	status = stress_queue_start(&device->queue, stress_options.buffers);
+	if (status)
+		return status;
+
+	return stress_ioctl(device->queue.fd, VIDIOC_STREAMON, &device->queue.type);
+}
+
+static void stress_producer_release(struct stress_device *device)
+{
+	if (device->queue.fd < 0)
+		return;
+
+	stress_ioctl(device->queue.fd, VIDIOC_STREAMOFF, &device->queue.type);
+	stress_queue_stop(&device->queue);
+	close(device->queue.fd);
+	device->queue.fd = -1;
+}
+
+static int stress_add_devices(struct stress_device *devices, unsigned int *ndevices)
+{
+	int control;
+	int status = 0;
+	unsigned int i;
+
+	control = open("/dev/" V4L2_LOOP_CONTROL_NAME, O_RDWR | O_CLOEXEC);
+	if (control < 0)
+		return -errno;
+
+	for (i = 0; i < stress_options.ndevices; i++) {
+		struct v4l2_loop_config config;
+
+		memset(&config, 0, sizeof(config));
+		config.nr = -1;
+		config.buffers = 2;
+		config.mplane = i % 2 ? V4L2_LOOP_MPLANE_ON : V4L2_LOOP_MPLANE_OFF;
+
+		status = stress_ioctl(control, V4L2_LOOP_CTL_ADD, &config);
+		if (status)
+			break;
+
+		devices[i].nr = config.nr;
+		snprintf(devices[i].path, sizeof(devices[i].path), "/dev/video%d", config.nr);
+		(*ndevices)++;
+	}
+
+	close(control);
+
+	return status;
+}
+
+static void stress_remove_devices(struct stress_device *devices, unsigned int ndevices)
+{
+	int control;
+	unsigned int i;
+
+	control = open("/dev/" V4L2_LOOP_CONTROL_NAME, O_RDWR | O_CLOEXEC);
+	if (control < 0)
+		return;
+
+	for (i = 0; i < ndevices; i++) {
+		__s32 nr = devices[i].nr;
+
+		if (nr >= 0)
+			stress_ioctl(control, V4L2_LOOP_CTL_REMOVE, &nr);
+	}
+
+	close(control);
+}
+
+static bool stress_write_file(const char *path, const char *value)
+{
+	int fd;
+	bool ok;
+
+	fd = open(path, O_WRONLY | O_CLOEXEC);
+	if (fd < 0)
+		return false;
+
+	ok = write(fd, value, strlen(value)) == (ssize_t)strlen(value);
+	close(fd);
+
+	return ok;
+}
+
+/* enables and clears lock statistics, returns false if they are not available */
+static bool stress_lock_stat_start(void)
+{
+	if (access(STRESS_LOCK_STAT, R_OK))
+		return false;
+
+	stress_write_file(STRESS_LOCK_STAT_ENABLE, "1");
+
+	return stress_write_file(STRESS_LOCK_STAT, "0");
+}
+
+static bool stress_lock_class_is_reported(const char *name)
+{
+	unsigned int i;
+
+	for (i = 0; i < STRESS_ARRAY_SIZE(stress_lock_classes); i++)
+		if (!strcmp(name, stress_lock_classes[i]))
+			return true;
+
+	return false;
+}
+
+/*
+ * Reports class lines of /proc/lock_stat (version 0.4) of the driver's
+ * locks, times are in microseconds.
+ */
+static void stress_lock_stat_report(void)
+{
+	FILE *file;
+	char line[512];
+
+	file = fopen(STRESS_LOCK_STAT, "r");
+	if (!file)
+		return;
+
+	while (fgets(line, sizeof(line), file)) {
+		char name[256];
+		char *colon;
+		char *start = line;
+		unsigned long long con_bounces, contentions, acq_bounces, acquisitions;
+		double wait_min, wait_max, wait_total, wait_avg;
+		double hold_min, hold_max, hold_total, hold_avg;
+
+		if (strchr(line, '[')) /* call site lines */
+			continue;
+
+		colon = strrchr(line, ':');
+		if (!colon)
+			continue;
+
+		while (*start == ' ')
+			start++;
+		if (colon <= start || (size_t)(colon - start) >= sizeof(name))
+			continue;
+		memcpy(name, start, colon - start);
+		name[colon - start] = '\0';
+
+		if (!stress_lock_class_is_reported(name))
+			continue;
+
+		if (sscanf(colon + 1, "%llu %llu %lf %lf %lf %lf %llu %llu %lf %lf %lf %lf",
+			&con_bounces, &contentions, &wait_min, &wait_max, &wait_total, &wait_avg,
+			&acq_bounces, &acquisitions, &hold_min, &hold_max, &hold_total, &hold_avg) != 12)
+			continue;
+
+		printf("{\"lock\":\"%s\",\"contentions\":%llu,\"con_bounces\":%llu,"
+			"\"waittime_max_us\":%.2f,\"waittime_total_us\":%.2f,\"waittime_avg_us\":%.2f,"
+			"\"acquisitions\":%llu,\"holdtime_max_us\":%.2f,\"holdtime_total_us\":%.2f}\n",
+			name, contentions, con_bounces, wait_max, wait_total, wait_avg,
+			acquisitions, hold_max, hold_total);
+	}
+
+	fclose(file);
+}
+
+static void stress_report(struct stress_device *devices, unsigned int ndevices,
+	struct stress_consumer *consumers, unsigned int nconsumers, double seconds)
+{
+	unsigned int i;
+	unsigned int op;
+
+	for (i = 0; i < ndevices; i++)
+		printf("{\"device\":\"%s\",\"api\":\"%s\",\"seconds\":%.3f,"
+			"\"frames_produced\":%llu,\"producer_fps\":%.2f,\"producer_errors\":%llu}\n",
+			devices[i].path, devices[i].mplane ? "mplane" : "splane", seconds,
+			(unsigned long long)atomic_load(&devices[i].produced),
+			atomic_load(&devices[i].produced) / seconds,
+			(unsigned long long)atomic_load(&devices[i].producer_errors));
+
+	for (i = 0; i < nconsumers; i++) {
+		const struct stress_consumer *c = &consumers[i];
+
+		printf("{\"consumer\":%u,\"device\":\"%s\",\"frames\":%llu,\"fps\":%.2f,"
+			"\"stalls\":%llu,\"errors\":%llu,\"dqbuf_wait_max_us\":%.1f,\"dqbuf_wait_total_ms\":%.1f",
+			c->index, c->device->path, (unsigned long long)c->frames, c->frames / seconds,
+			(unsigned long long)c->stalls, (unsigned long long)c->errors,
+			c->dqbuf_wait_max_ns / 1e3, c->dqbuf_wait_total_ns / 1e6);
+		for (op = 0; op < STRESS_OP_COUNT; op++)
+			printf(",\"%s\":%llu", stress_op_names[op], (unsigned long long)c->ops[op]);
+		printf("}\n");
+	}
+}
+
+static void stress_usage(const char *name)
+{
+	fprintf(stderr,
+		"usage: %s [options] [device...]\n"
+		"  -D <count>    number of loop devices created with /dev/" V4L2_LOOP_CONTROL_NAME "\n"
+		"                (1-%u, default: 2), unless devices are given\n"
+		"  -n <count>    number of consumers (1-%u, default: 16)\n"
+		"  -t <seconds>  duration of the run (default: 10)\n"
+		"  -s <seed>     seed of the random disruptions (default: 1)\n"
+		"  -r <rate>     1 out of <rate> dequeued frames is followed by a disruption\n"
+		"                (REQBUFS(0), STREAMOFF or close, default: 100)\n"
+		"  -b <count>    number of producer buffers (default: 4)\n"
+		"  -f <fourcc>   producer format (default: YUYV)\n"
+		"  -S <WxH>      producer resolution (default: 640x480)\n",
+		name, STRESS_MAX_DEVICES, STRESS_MAX_CONSUMERS);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct stress_device devices[STRESS_MAX_DEVICES];
+	static struct stress_consumer consumers[STRESS_MAX_CONSUMERS];
+	unsigned int ndevices = 0;
+	unsigned int nproducers = 0;
+	unsigned int nconsumers = 0;
+	uint64_t start_ns;
+	bool lock_stat;
+	int exit_code = EXIT_FAILURE;
+	unsigned int i;
+	int opt;
+	int status;
+
+	while ((opt = getopt(argc, argv, "D:n:t:s:r:b:f:S:h")) != -1) {
+		switch (opt) {
+		case 'D':
+			stress_options.ndevices = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			stress_options.consumers = strtoul(optarg, NULL, 0);
+			break;
+		case 't':
+			stress_options.seconds = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			stress_options.seed = strtoul(optarg, NULL, 0);
+			break;
+		case 'r':
+			stress_options.rate = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			stress_options.buffers = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			if (strlen(optarg) != 4) {
+				stress_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			stress_options.pixelformat = v4l2_fourcc(optarg[0], optarg[1], optarg[2], optarg[3]);
+			break;
+		case 'S':
+			if (sscanf(optarg, "%ux%u", &stress_options.width, &stress_options.height) != 2) {
+				stress_usage(argv[0]);
+				return EXIT_FAILURE;
+			}
+			break;
+		default:
+			stress_usage(argv[0]);
+			return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+		}
+	}
+
+	if (argc - optind > STRESS_MAX_DEVICES ||
+		stress_options.ndevices < 1 || stress_options.ndevices > STRESS_MAX_DEVICES ||
+		stress_options.consumers < 1 || stress_options.consumers > STRESS_MAX_CONSUMERS ||
+		stress_options.seconds < 1 || stress_options.rate < 1 ||
+		stress_options.buffers < 1 || stress_options.buffers > STRESS_MAX_BUFFERS) {
+		stress_usage(argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	for (i = 0; i < STRESS_MAX_DEVICES; i++) {
+		devices[i].nr = -1;
+		devices[i].queue.fd = -1;
+	}
+
+	if (optind < argc) {
+		for (i = 0; optind < argc; i++, optind++)
+			snprintf(devices[i].path, sizeof(devices[i].path), "%s", argv[optind]);
+		ndevices = i;
+	} else {
+		status = stress_add_devices(devices, &ndevices);
+		if (status) {
+			fprintf(stderr, "cannot create loop devices: %s (give devices explicitly)\n",
+				strerror(-status));
+			goto out;
+		}
+	}
+
+	for (i = 0; i < ndevices; i++) {
+		status = stress_producer_setup(&devices[i]);
+		if (status) {
+			fprintf(stderr, "%s: cannot start producer: %s\n", devices[i].path, strerror(-status));
+			goto out;
+		}
+	}
+
+	lock_stat = stress_lock_stat_start();
+	if (!lock_stat)
+		fprintf(stderr, "warning: lock statistics are not available (CONFIG_LOCK_STAT, root)\n");
+
+	printf("{\"seed\":%u,\"devices\":%u,\"consumers\":%u,\"seconds\":%u,\"rate\":%u,"
+		"\"width\":%u,\"height\":%u,\"buffers\":%u,\"lock_stat\":%s}\n",
+		stress_options.seed, ndevices, stress_options.consumers, stress_options.seconds,
+		stress_options.rate, stress_options.width, stress_options.height,
+		stress_options.buffers, lock_stat ? "true" : "false");
+
+	start_ns = stress_now_ns();
+
+	for (i = 0; i < ndevices; i++) {
+		if (pthread_create(&devices[i].producer, NULL, stress_producer_run, &devices[i])) {
+			fprintf(stderr, "cannot create producer thread\n");
+			goto out_stop;
+		}
+		nproducers++;
+	}
+
+	for (i = 0; i < stress_options.consumers; i++) {
+		struct stress_consumer *c = &consumers[i];
+
+		c->index = i;
+		c->device = &devices[i % ndevices];
+		c->seed = stress_options.seed + i;
+		c->queue.fd = -1;
+		c->queue.type = c->device->mplane ?
+			V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+
+		if (pthread_create(&c->thread, NULL, stress_consumer_run, c)) {
+			fprintf(stderr, "cannot create consumer thread\n");
+			goto out_stop;
+		}
+		nconsumers++;
+	}
+
+	sleep(stress_options.seconds);
+	exit_code = EXIT_SUCCESS;
+
+out_stop:
+	atomic_store(&stress_stop, true);
+
+	for (i = 0; i < nconsumers; i++)
+		pthread_join(consumers[i].thread, NULL);
+	for (i = 0; i < nproducers; i++)
+		pthread_join(devices[i].producer, NULL);
+
+	if (exit_code == EXIT_SUCCESS) {
+		stress_report(devices, ndevices, consumers, nconsumers, (stress_now_ns() - start_ns) / 1e9);
+		if (lock_stat)
+			stress_lock_stat_report();
+	}
+
+out:
+	for (i = 0; i < ndevices; i++)
+		stress_producer_release(&devices[i]);
+
+	stress_remove_devices(devices, ndevices);
+
+	return exit_code;
+}
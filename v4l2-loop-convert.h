@@ -0,0 +1,522 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * v4l2-loop-convert.h
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+#ifndef V4L2_LOOP_CONVERT
+#define V4L2_LOOP_CONVERT
+
+#include <linux/types.h>
+#include <linux/kernel.h>
+#include <linux/string.h>
+#include <linux/videodev2.h>
+#include <asm/unaligned.h>
+
+/*
+ * Pixel format conversion kernels used to serve consumers which asked
+ * for a different pixel format than the one set by the producer.
+ *
+ * Kernel code cannot freely use FPU/SIMD registers, so instead of
+ * vector instructions the hot paths work on whole machine words
+ * (YUYV <-> UYVY, NV12 <-> NV21 and plane copies) and the remaining
+ * ones use integer only BT.601 (limited range) arithmetic.
+ */
+
+/* pixel formats which can be both read and written */
+static const __u32 v4l2_loop_cvt_formats[] = {
+	V4L2_PIX_FMT_YUYV,
+	V4L2_PIX_FMT_UYVY,
+	V4L2_PIX_FMT_NV12,
+	V4L2_PIX_FMT_NV21,
+	V4L2_PIX_FMT_YUV420,
+	V4L2_PIX_FMT_RGB24,
+	V4L2_PIX_FMT_BGR32,
+};
+
+struct v4l2_loop_yuv_image {
+	u8 *y, *u, *v;		/* first samples of each component */
+	unsigned y_step;	/* bytes between horizontally adjacent luma samples */
+	unsigned c_step;	/* bytes between horizontally adjacent chroma samples */
+	unsigned y_stride;	/* bytes between luma rows */
+	unsigned c_stride;	/* bytes between chroma rows */
+	unsigned c_vsub;	/* vertical chroma subsampling (1 - 4:2:2, 2 - 4:2:0) */
+};
+
+struct v4l2_loop_rgb_image {
+	u8 *p;			/* first pixel */
+	unsigned step;		/* bytes per pixel */
+	unsigned stride;	/* bytes between rows */
+	unsigned r, g, b;	/* offsets of components within a pixel */
+	int a;			/* offset of alpha/padding byte (-1 - none) */
+};
+
+struct v4l2_loop_image {
+	__u32 pixelformat;
+	unsigned width;
+	unsigned height;
+	bool is_rgb;
+	union {
+		struct v4l2_loop_yuv_image yuv;
+		struct v4l2_loop_rgb_image rgb;
+	};
+};
+
+static inline bool v4l2_loop_cvt_is_supported(__u32 pixelformat)
+{
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE(v4l2_loop_cvt_formats); ++i)
+		if (v4l2_loop_cvt_formats[i] == pixelformat)
+			return true;
+
+	return false;
+}
+
+static inline bool v4l2_loop_cvt_is_420(__u32 pixelformat)
+{
+	return pixelformat == V4L2_PIX_FMT_NV12 ||
+		pixelformat == V4L2_PIX_FMT_NV21 ||
+		pixelformat == V4L2_PIX_FMT_YUV420;
+}
+
+/* bytes per line of packed formats or of the luma plane of (semi)planar ones */
+static inline unsigned v4l2_loop_cvt_bytesperline(__u32 pixelformat, unsigned width)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		return width * 2;
+	case V4L2_PIX_FMT_RGB24:
+		return width * 3;
+	case V4L2_PIX_FMT_BGR32:
+		return width * 4;
+	default:
+		return width;
+	}
+}
+
+static inline u64 v4l2_loop_cvt_sizeimage(__u32 pixelformat,
+	unsigned height, unsigned bytesperline)
+{
+	u64 size = (u64)bytesperline * height;
+
+	if (v4l2_loop_cvt_is_420(pixelformat))
+		return size + size / 2;
+	else
+		return size;
+}
+
+static inline int v4l2_loop_image_init(struct v4l2_loop_image *img, __u32 pixelformat,
+	void *base, unsigned width, unsigned height, unsigned bytesperline)
+{
+	u8 *p = base;
+
+	if (!bytesperline)
+		bytesperline = v4l2_loop_cvt_bytesperline(pixelformat, width);
+
+	if ((width & 1) || (v4l2_loop_cvt_is_420(pixelformat) && (height & 1)))
+		return -EINVAL;
+
+	img->pixelformat = pixelformat;
+	img->width = width;
+	img->height = height;
+	img->is_rgb = false;
+
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_YUYV:
+	case V4L2_PIX_FMT_UYVY:
+		img->yuv.y = p + (pixelformat == V4L2_PIX_FMT_YUYV ? 0 : 1);
+		img->yuv.u = p + (pixelformat == V4L2_PIX_FMT_YUYV ? 1 : 0);
+		img->yuv.v = p + (pixelformat == V4L2_PIX_FMT_YUYV ? 3 : 2);
+		img->yuv.y_step = 2;
+		img->yuv.c_step = 4;
+		img->yuv.y_stride = bytesperline;
+		img->yuv.c_stride = bytesperline;
+		img->yuv.c_vsub = 1;
+		break;
+
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+		img->yuv.y = p;
+		img->yuv.u = p + bytesperline * height + (pixelformat == V4L2_PIX_FMT_NV12 ? 0 : 1);
+		img->yuv.v = p + bytesperline * height + (pixelformat == V4L2_PIX_FMT_NV12 ? 1 : 0);
+		img->yuv.y_step = 1;
+		img->yuv.c_step = 2;
+		img->yuv.y_stride = bytesperline;
+		img->yuv.c_stride = bytesperline;
+		img->yuv.c_vsub = 2;
+		break;
+
+	case V4L2_PIX_FMT_YUV420:
+		img->yuv.y = p;
+		img->yuv.u = p + bytesperline * height;
+		img->yuv.v = img->yuv.u + (bytesperline / 2) * (height / 2);
+		img->yuv.y_step = 1;
+		img->yuv.c_step = 1;
+		img->yuv.y_stride = bytesperline;
+		img->yuv.c_stride = bytesperline / 2;
+		img->yuv.c_vsub = 2;
+		break;
+
+	case V4L2_PIX_FMT_RGB24:
+		img->is_rgb = true;
+		img->rgb.p = p;
+		img->rgb.step = 3;
+		img->rgb.stride = bytesperline;
+		img->rgb.r = 0;
+		img->rgb.g = 1;
+		img->rgb.b = 2;
+		img->rgb.a = -1;
+		break;
+
+	case V4L2_PIX_FMT_BGR32:
+		img->is_rgb = true;
+		img->rgb.p = p;
+		img->rgb.step = 4;
+		img->rgb.stride = bytesperline;
+		img->rgb.b = 0;
+		img->rgb.g = 1;
+		img->rgb.r = 2;
+		img->rgb.a = 3;
+		break;
+
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* narrows the image down to the rectangle (left, top, width and height have to be even) */
+static inline void v4l2_loop_image_crop(struct v4l2_loop_image *img,
+	unsigned left, unsigned top, unsigned width, unsigned height)
+{
+	if (img->is_rgb) {
+		img->rgb.p += top * img->rgb.stride + left * img->rgb.step;
+	} else {
+		struct v4l2_loop_yuv_image *yuv = &img->yuv;
+		unsigned c_offset = (top / yuv->c_vsub) * yuv->c_stride + (left / 2) * yuv->c_step;
+
+		yuv->y += top * yuv->y_stride + left * yuv->y_step;
+		yuv->u += c_offset;
+		yuv->v += c_offset;
+	}
+
+	img->width = width;
+	img->height = height;
+}
+
+/* swaps bytes within every pair of bytes, a machine word at a time */
+static inline void v4l2_loop_cvt_swap_pairs(u8 *dst, const u8 *src, unsigned bytes)
+{
+	unsigned i;
+
+	for (i = 0; i + 8 <= bytes; i += 8) {
+		u64 w = get_unaligned((const u64 *)(src + i));
+		put_unaligned(((w & 0x00ff00ff00ff00ffULL) << 8) |
+			((w >> 8) & 0x00ff00ff00ff00ffULL), (u64 *)(dst + i));
+	}
+
+	for (; i + 2 <= bytes; i += 2) {
+		u8 t = src[i];
+		dst[i] = src[i + 1];
+		dst[i + 1] = t;
+	}
+}
+
+static inline void v4l2_loop_cvt_copy_samples(u8 *dst, unsigned dst_step,
+	const u8 *src, unsigned src_step, unsigned n)
+{
+	if (dst_step == 1 && src_step == 1) {
+		memcpy(dst, src, n);
+		return;
+	}
+
+	while (n--) {
+		*dst = *src;
+		dst += dst_step;
+		src += src_step;
+	}
+}
+
+static inline void v4l2_loop_cvt_avg_samples(u8 *dst, unsigned dst_step,
+	const u8 *a, const u8 *b, unsigned src_step, unsigned n)
+{
+	while (n--) {
+		*dst = (*a + *b + 1) >> 1;
+		dst += dst_step;
+		a += src_step;
+		b += src_step;
+	}
+}
+
+/*
+ * Downscales a single component with a box filter, every destination
+ * sample is the average of the source samples it covers.
+ */
+static inline void v4l2_loop_cvt_scale_samples(
+	u8 *dst, unsigned dst_step, unsigned dst_stride, unsigned dst_width, unsigned dst_height,
+	const u8 *src, unsigned src_step, unsigned src_stride, unsigned src_width, unsigned src_height)
+{
+	unsigned x, y, i, j;
+
+	for (y = 0; y < dst_height; y++) {
+		unsigned y0 = y * src_height / dst_height;
+		unsigned y1 = max((y + 1) * src_height / dst_height, y0 + 1);
+		u8 *d = dst + y * dst_stride;
+
+		for (x = 0; x < dst_width; x++) {
+			unsigned x0 = x * src_width / dst_width;
+			unsigned x1 = max((x + 1) * src_width / dst_width, x0 + 1);
+			unsigned n = (x1 - x0) * (y1 - y0);
+			unsigned sum = 0;
+
+			for (j = y0; j < y1; j++) {
+				const u8 *s = src + j * src_stride + x0 * src_step;
+				for (i = x0; i < x1; i++) {
+					sum += *s;
+					s += src_step;
+				}
+			}
+
+			*d = (sum + n / 2) / n;
+			d += dst_step;
+		}
+	}
+}
+
+/* both images have to be of the same pixel format, destination one not bigger than the source one */
+static inline void v4l2_loop_scale(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	if (src->is_rgb) {
+		const struct v4l2_loop_rgb_image *s = &src->rgb;
+		struct v4l2_loop_rgb_image *d = &dst->rgb;
+		unsigned c;
+		unsigned components[4] = { s->r, s->g, s->b, s->a };
+
+		for (c = 0; c < (s->a >= 0 ? 4 : 3); c++)
+			v4l2_loop_cvt_scale_samples(
+				d->p + components[c], d->step, d->stride, dst->width, dst->height,
+				s->p + components[c], s->step, s->stride, src->width, src->height);
+	} else {
+		const struct v4l2_loop_yuv_image *s = &src->yuv;
+		struct v4l2_loop_yuv_image *d = &dst->yuv;
+
+		v4l2_loop_cvt_scale_samples(
+			d->y, d->y_step, d->y_stride, dst->width, dst->height,
+			s->y, s->y_step, s->y_stride, src->width, src->height);
+		v4l2_loop_cvt_scale_samples(
+			d->u, d->c_step, d->c_stride, dst->width / 2, dst->height / d->c_vsub,
+			s->u, s->c_step, s->c_stride, src->width / 2, src->height / s->c_vsub);
+		v4l2_loop_cvt_scale_samples(
+			d->v, d->c_step, d->c_stride, dst->width / 2, dst->height / d->c_vsub,
+			s->v, s->c_step, s->c_stride, src->width / 2, src->height / s->c_vsub);
+	}
+}
+
+static inline void v4l2_loop_cvt_yuv_to_yuv(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	const struct v4l2_loop_yuv_image *s = &src->yuv;
+	struct v4l2_loop_yuv_image *d = &dst->yuv;
+	unsigned y;
+
+	for (y = 0; y < dst->height; y++)
+		v4l2_loop_cvt_copy_samples(d->y + y * d->y_stride, d->y_step,
+			s->y + y * s->y_stride, s->y_step, dst->width);
+
+	for (y = 0; y < dst->height; y += d->c_vsub) {
+		unsigned cy = y / s->c_vsub; /* source chroma row */
+		u8 *du = d->u + (y / d->c_vsub) * d->c_stride;
+		u8 *dv = d->v + (y / d->c_vsub) * d->c_stride;
+
+		if (d->c_vsub > s->c_vsub) { /* 4:2:2 -> 4:2:0, average two rows */
+			v4l2_loop_cvt_avg_samples(du, d->c_step, s->u + cy * s->c_stride,
+				s->u + (cy + 1) * s->c_stride, s->c_step, dst->width / 2);
+			v4l2_loop_cvt_avg_samples(dv, d->c_step, s->v + cy * s->c_stride,
+				s->v + (cy + 1) * s->c_stride, s->c_step, dst->width / 2);
+		} else {
+			v4l2_loop_cvt_copy_samples(du, d->c_step,
+				s->u + cy * s->c_stride, s->c_step, dst->width / 2);
+			v4l2_loop_cvt_copy_samples(dv, d->c_step,
+				s->v + cy * s->c_stride, s->c_step, dst->width / 2);
+		}
+	}
+}
+
+static inline u8 v4l2_loop_cvt_clip(int v)
+{
+	return clamp_val(v, 0, 255);
+}
+
+static inline void v4l2_loop_cvt_yuv_to_rgb(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	const struct v4l2_loop_yuv_image *s = &src->yuv;
+	struct v4l2_loop_rgb_image *d = &dst->rgb;
+	unsigned x, y;
+
+	for (y = 0; y < dst->height; y++) {
+		const u8 *sy = s->y + y * s->y_stride;
+		const u8 *su = s->u + (y / s->c_vsub) * s->c_stride;
+		const u8 *sv = s->v + (y / s->c_vsub) * s->c_stride;
+		u8 *p = d->p + y * d->stride;
+
+		for (x = 0; x < dst->width; x++) {
+			int c = 298 * (sy[x * s->y_step] - 16);
+			int du = su[(x / 2) * s->c_step] - 128;
+			int dv = sv[(x / 2) * s->c_step] - 128;
+
+			p[d->r] = v4l2_loop_cvt_clip((c + 409 * dv + 128) >> 8);
+			p[d->g] = v4l2_loop_cvt_clip((c - 100 * du - 208 * dv + 128) >> 8);
+			p[d->b] = v4l2_loop_cvt_clip((c + 516 * du + 128) >> 8);
+			if (d->a >= 0)
+				p[d->a] = 0xff;
+			p += d->step;
+		}
+	}
+}
+
+static inline void v4l2_loop_cvt_rgb_to_yuv(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	const struct v4l2_loop_rgb_image *s = &src->rgb;
+	struct v4l2_loop_yuv_image *d = &dst->yuv;
+	unsigned x, y, i;
+
+	for (y = 0; y < dst->height; y++) {
+		const u8 *p = s->p + y * s->stride;
+		u8 *dy = d->y + y * d->y_stride;
+
+		for (x = 0; x < dst->width; x++) {
+			*dy = ((66 * p[s->r] + 129 * p[s->g] + 25 * p[s->b] + 128) >> 8) + 16;
+			dy += d->y_step;
+			p += s->step;
+		}
+	}
+
+	/* chroma is computed from the average of the pixels it covers */
+	for (y = 0; y < dst->height; y += d->c_vsub) {
+		u8 *du = d->u + (y / d->c_vsub) * d->c_stride;
+		u8 *dv = d->v + (y / d->c_vsub) * d->c_stride;
+
+		for (x = 0; x < dst->width; x += 2) {
+			int r = 0, g = 0, b = 0;
+			int n = 2 * d->c_vsub;
+
+			for (i = 0; i < d->c_vsub; i++) {
+				const u8 *p = s->p + (y + i) * s->stride + x * s->step;
+				r += p[s->r] + p[s->step + s->r];
+				g += p[s->g] + p[s->step + s->g];
+				b += p[s->b] + p[s->step + s->b];
+			}
+
+			r /= n;
+			g /= n;
+			b /= n;
+
+			*du = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+			*dv = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+			du += d->c_step;
+			dv += d->c_step;
+		}
+	}
+}
+
+static inline void v4l2_loop_cvt_rgb_to_rgb(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	const struct v4l2_loop_rgb_image *s = &src->rgb;
+	struct v4l2_loop_rgb_image *d = &dst->rgb;
+	unsigned x, y;
+
+	for (y = 0; y < dst->height; y++) {
+		const u8 *sp = s->p + y * s->stride;
+		u8 *dp = d->p + y * d->stride;
+
+		for (x = 0; x < dst->width; x++) {
+			dp[d->r] = sp[s->r];
+			dp[d->g] = sp[s->g];
+			dp[d->b] = sp[s->b];
+			if (d->a >= 0)
+				dp[d->a] = 0xff;
+			sp += s->step;
+			dp += d->step;
+		}
+	}
+}
+
+static inline bool v4l2_loop_cvt_is_pair(const struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src, __u32 a, __u32 b)
+{
+	return (src->pixelformat == a && dst->pixelformat == b) ||
+		(src->pixelformat == b && dst->pixelformat == a);
+}
+
+/* both images have to be of the same size */
+static inline void v4l2_loop_convert(struct v4l2_loop_image *dst,
+	const struct v4l2_loop_image *src)
+{
+	unsigned y;
+
+	/* same format (e.g. cropped only), rows are copied as they are */
+	if (src->pixelformat == dst->pixelformat && src->is_rgb) {
+		for (y = 0; y < dst->height; y++)
+			memcpy(dst->rgb.p + y * dst->rgb.stride,
+				src->rgb.p + y * src->rgb.stride, dst->width * src->rgb.step);
+	} else
+	if (src->pixelformat == dst->pixelformat && src->yuv.y_step == 2) {
+		for (y = 0; y < dst->height; y++)
+			memcpy(min(dst->yuv.y, dst->yuv.u) + y * dst->yuv.y_stride,
+				min(src->yuv.y, src->yuv.u) + y * src->yuv.y_stride, dst->width * 2);
+	} else
+	if (src->pixelformat == dst->pixelformat && src->yuv.c_step == 2) {
+		for (y = 0; y < dst->height; y++)
+			memcpy(dst->yuv.y + y * dst->yuv.y_stride,
+				src->yuv.y + y * src->yuv.y_stride, dst->width);
+		for (y = 0; y < dst->height / 2; y++)
+			memcpy(min(dst->yuv.u, dst->yuv.v) + y * dst->yuv.c_stride,
+				min(src->yuv.u, src->yuv.v) + y * src->yuv.c_stride, dst->width);
+	} else
+	/* interleaved samples are only swapped, rows start at the lower of the two pointers */
+	if (v4l2_loop_cvt_is_pair(dst, src, V4L2_PIX_FMT_YUYV, V4L2_PIX_FMT_UYVY)) {
+		for (y = 0; y < dst->height; y++)
+			v4l2_loop_cvt_swap_pairs(
+				min(dst->yuv.y, dst->yuv.u) + y * dst->yuv.y_stride,
+				min(src->yuv.y, src->yuv.u) + y * src->yuv.y_stride,
+				dst->width * 2);
+	} else
+	if (v4l2_loop_cvt_is_pair(dst, src, V4L2_PIX_FMT_NV12, V4L2_PIX_FMT_NV21)) {
+		for (y = 0; y < dst->height; y++)
+			memcpy(dst->yuv.y + y * dst->yuv.y_stride,
+				src->yuv.y + y * src->yuv.y_stride, dst->width);
+		for (y = 0; y < dst->height / 2; y++)
+			v4l2_loop_cvt_swap_pairs(
+				min(dst->yuv.u, dst->yuv.v) + y * dst->yuv.c_stride,
+				min(src->yuv.u, src->yuv.v) + y * src->yuv.c_stride,
+				dst->width);
+	} else
+	if (!src->is_rgb && !dst->is_rgb)
+		v4l2_loop_cvt_yuv_to_yuv(dst, src);
+	else
+	if (!src->is_rgb && dst->is_rgb)
+		v4l2_loop_cvt_yuv_to_rgb(dst, src);
+	else
+	if (src->is_rgb && !dst->is_rgb)
+		v4l2_loop_cvt_rgb_to_yuv(dst, src);
+	else
+		v4l2_loop_cvt_rgb_to_rgb(dst, src);
+}
+
+#endif /* V4L2_LOOP_CONVERT */
@@ -19,6 +19,8 @@
 #include <linux/types.h>
 #include <linux/videodev2.h>
 
+#include <media/v4l2-dev.h>
+
 static inline const char* v4l2_loop_buf_type_to_string(enum v4l2_buf_type buf_type)
 {
 	static const char* buf_types[] = {
@@ -89,9 +91,9 @@ static inline const char* v4l2_loop_frmivaltype_to_string(enum v4l2_frmivaltypes
 	return types[type];
 }
 
-static inline void v4l2_loop_print_fmtdesc(const struct v4l2_fmtdesc* fmtdesc)
+static inline void v4l2_loop_print_fmtdesc(struct video_device *vdev, const struct v4l2_fmtdesc* fmtdesc)
 {
-	v4l2_loop_dbg_at4(
+	v4l2_loop_dbg_at4(vdev,
 		"v4l2_fmtdesc:\n"
 		"\tindex       : %u\n"
 		"\ttype        : %s\n"
@@ -109,13 +111,16 @@ static inline void v4l2_loop_print_fmtdesc(const struct v4l2_fmtdesc* fmtdesc)
 	);
 }
 
-static inline void v4l2_loop_print_frmsizeenum(const struct v4l2_frmsizeenum* frmsizeenum)
+static inline void v4l2_loop_print_frmsizeenum(struct video_device *vdev, const struct v4l2_frmsizeenum* frmsizeenum)
 {
 	char buf[512];
 	size_t n = 0;
 	size_t limit = sizeof(buf);
 	int status;
 
+	if (!v4l2_loop_dbg_on(vdev, 4)) /* do not format anything if it is not printed anyway */
+		return;
+
 	memset(buf, 0, sizeof(buf));
 
 	do {
@@ -166,16 +171,19 @@ static inline void v4l2_loop_print_frmsizeenum(const struct v4l2_frmsizeenum* fr
 		}
 	} while (0);
 
-	v4l2_loop_dbg_at4("%s", buf);
+	pr_info("%s", buf);
 }
 
-static inline void v4l2_loop_print_frmivalenum(const struct v4l2_frmivalenum* frmivalenum)
+static inline void v4l2_loop_print_frmivalenum(struct video_device *vdev, const struct v4l2_frmivalenum* frmivalenum)
 {
 	char buf[512];
 	size_t n = 0;
 	size_t limit = sizeof(buf);
 	int status;
 
+	if (!v4l2_loop_dbg_on(vdev, 4)) /* do not format anything if it is not printed anyway */
+		return;
+
 	memset(buf, 0, sizeof(buf));
 
 	do {
@@ -230,16 +238,19 @@ static inline void v4l2_loop_print_frmivalenum(const struct v4l2_frmivalenum* fr
 		}
 	} while (0);
 
-	v4l2_loop_dbg_at4("%s", buf);
+	pr_info("%s", buf);
 }
 
-static inline void v4l2_loop_print_format(const struct v4l2_format* format)
+static inline void v4l2_loop_print_format(struct video_device *vdev, const struct v4l2_format* format)
 {
 	char buf[512];
 	size_t n = 0;
 	size_t limit = sizeof(buf);
 	int status;
 
+	if (!v4l2_loop_dbg_on(vdev, 4)) /* do not format anything if it is not printed anyway */
+		return;
+
 	memset(buf, 0, sizeof(buf));
 
 	do {
@@ -294,12 +305,12 @@ static inline void v4l2_loop_print_format(const struct v4l2_format* format)
 		}
 	} while (0);
 
-	v4l2_loop_dbg_at4("%s", buf);
+	pr_info("%s", buf);
 }
 
-static inline void v4l2_loop_print_requestbuffers(const struct v4l2_requestbuffers* requestbuffers)
+static inline void v4l2_loop_print_requestbuffers(struct video_device *vdev, const struct v4l2_requestbuffers* requestbuffers)
 {
-	v4l2_loop_dbg_at4(
+	v4l2_loop_dbg_at4(vdev,
 		"v4l2_requestbuffers:\n"
 		"\tcount       : %u\n"
 		"\ttype        : %s\n"
@@ -312,13 +323,16 @@ static inline void v4l2_loop_print_requestbuffers(const struct v4l2_requestbuffe
 	);
 }
 
-static inline void v4l2_loop_print_buffer(const struct v4l2_buffer* buffer)
+static inline void v4l2_loop_print_buffer(struct video_device *vdev, const struct v4l2_buffer* buffer)
 {
 	char buf[512];
 	size_t n = 0;
 	size_t limit = sizeof(buf);
 	int status;
 
+	if (!v4l2_loop_dbg_on(vdev, 4)) /* do not format anything if it is not printed anyway */
+		return;
+
 	memset(buf, 0, sizeof(buf));
 
 	do {
@@ -413,7 +427,7 @@ static inline void v4l2_loop_print_buffer(const struct v4l2_buffer* buffer)
 		}
 	} while (0);
 
-	v4l2_loop_dbg_at4("%s", buf);
+	pr_info("%s", buf);
 }
 
 #endif /* V4L2_LOOP_PRINT_FUNCTIONS */
\ No newline at end of file
@@ -0,0 +1,471 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * v4l2-loop-test.c
+ *
+ * KUnit tests (and microbenchmarks) of the frame handoff between
+ * the producer and consumers of a v4l2-loop device.
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+
+/*
+ * The driver is built into this module, so its static functions can be
+ * tested directly. Its module init/exit are left out (the suite works on
+ * devices of its own) and so are its trace events (the driver's module
+ * registers them).
+ */
+#define NOTRACE
+#define V4L2_LOOP_KUNIT
+
+#include "v4l2-loop.c"
+
+#include <kunit/test.h>
+
+#define V4L2_LOOP_TEST_PBUFS 4
+#define V4L2_LOOP_TEST_BENCH_FRAMES 100000
+
+struct v4l2_loop_test {
+	struct v4l2_loop_device *dev;
+	struct v4l2_loop_pbuf *pbufs[V4L2_LOOP_TEST_PBUFS];
+};
+
+/*
+ * Sets up just what the handoff needs: the producer's vb2 queue (without
+ * any buffers allocated by vb2) and producer buffers owned by the test.
+ */
+static int v4l2_loop_test_init(struct kunit *test)
+{
+	struct v4l2_loop_test *t;
+	struct v4l2_loop_device *dev;
+	int i;
+
+	t = kunit_kzalloc(test, sizeof(*t), GFP_KERNEL);
+	if (!t)
+		return -ENOMEM;
+
+	dev = kunit_kzalloc(test, sizeof(*dev), GFP_KERNEL);
+	if (!dev)
+		return -ENOMEM;
+
+	mutex_init(&dev->vb_queue_lock);
+	dev->vb_queue.lock = &dev->vb_queue_lock;
+	dev->vb_queue.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	dev->vb_queue.io_modes = VB2_MMAP;
+	dev->vb_queue.drv_priv = dev;
+	dev->vb_queue.buf_struct_size = sizeof(struct v4l2_loop_pbuf);
+	dev->vb_queue.ops = &v4l2_loop_vb2_ops;
+	dev->vb_queue.mem_ops = &vb2_vmalloc_memops;
+	dev->vb_queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	if (vb2_queue_init(&dev->vb_queue))
+		return -EINVAL;
+
+	spin_lock_init(&dev->queued_bufs_lock);
+	INIT_LIST_HEAD(&dev->queued_bufs);
+	init_waitqueue_head(&dev->waiting_consumers);
+	INIT_DELAYED_WORK(&dev->stall_work, v4l2_loop_stall_work);
+	INIT_LIST_HEAD(&dev->vdev.fh_list);
+	spin_lock_init(&dev->vdev.fh_lock);
+	dev->drop_policy = V4L2_LOOP_DROP_OLDEST;
+
+	for (i = 0; i < V4L2_LOOP_TEST_PBUFS; i++) {
+		struct v4l2_loop_pbuf *pbuf = kunit_kzalloc(test, sizeof(*pbuf), GFP_KERNEL);
+		if (!pbuf)
+			return -ENOMEM;
+
+		pbuf->vbuf.vb2_buf.vb2_queue = &dev->vb_queue;
+		pbuf->vbuf.vb2_buf.type = dev->vb_queue.type;
+		pbuf->vbuf.vb2_buf.memory = VB2_MEMORY_MMAP;
+		pbuf->vbuf.vb2_buf.index = i;
+		pbuf->vbuf.vb2_buf.state = VB2_BUF_STATE_DEQUEUED;
+		t->pbufs[i] = pbuf;
+	}
+
+	t->dev = dev;
+	test->priv = t;
+
+	return 0;
+}
+
+static void v4l2_loop_test_exit(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+
+	if (!t) /* init failed */
+		return;
+
+	/* gives back everything still held, as vb2 expects on release */
+	v4l2_loop_queue_stop_streaming(&t->dev->vb_queue);
+	vb2_queue_release(&t->dev->vb_queue);
+}
+
+/* producer's QBUF, handled the way vb2 does it (minus the memory part) */
+static void v4l2_loop_test_qbuf(struct v4l2_loop_test *t, int index)
+{
+	struct vb2_queue *vq = &t->dev->vb_queue;
+	struct vb2_buffer *vb = &t->pbufs[index]->vbuf.vb2_buf;
+	unsigned long flags;
+
+	if (vb->state == VB2_BUF_STATE_DONE || vb->state == VB2_BUF_STATE_ERROR) {
+		/* producer's DQBUF */
+		spin_lock_irqsave(&vq->done_lock, flags);
+		list_del(&vb->done_entry);
+		spin_unlock_irqrestore(&vq->done_lock, flags);
+	}
+
+	vb->state = VB2_BUF_STATE_ACTIVE;
+	atomic_inc(&vq->owned_by_drv_count);
+	v4l2_loop_queue_buf_queue(vb);
+}
+
+static struct v4l2_loop_handle *v4l2_loop_test_consumer(struct kunit *test, __u32 buffers)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h;
+	unsigned long flags;
+
+	h = kunit_kzalloc(test, sizeof(*h), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, h);
+	h->c.bufs = kunit_kcalloc(test, buffers, sizeof(*h->c.bufs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, h->c.bufs);
+
+	h->htype = V4L2_LOOP_HANDLE_CONSUMER;
+	h->c.buffers = buffers;
+	INIT_LIST_HEAD(&h->c.queued_bufs);
+
+	spin_lock_irqsave(&t->dev->vdev.fh_lock, flags);
+	list_add_tail(&h->fh.list, &t->dev->vdev.fh_list);
+	spin_unlock_irqrestore(&t->dev->vdev.fh_lock, flags);
+
+	return h;
+}
+
+/* consumer's DQBUF into its 'index' buffer (without filling it) */
+static int v4l2_loop_test_dqbuf(struct v4l2_loop_test *t, struct v4l2_loop_handle *h, __u32 index)
+{
+	struct v4l2_buffer buffer = {
+		.index = index,
+		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
+	};
+	struct v4l2_loop_cbuf *cbuf = &h->c.bufs[index];
+	struct v4l2_loop_placeholder *image;
+	struct v4l2_loop_pbuf *pbuf;
+	bool placeholder;
+	int status;
+
+	status = v4l2_loop_take_pbuf(t->dev, &h->c, &buffer, &pbuf, &image, &placeholder);
+	if (!status) {
+		cbuf->pbuf = pbuf;
+		cbuf->image = image;
+	}
+
+	return status;
+}
+
+/* consumer's QBUF of its 'index' buffer */
+static void v4l2_loop_test_qbuf_consumer(struct v4l2_loop_handle *h, __u32 index)
+{
+	v4l2_loop_cbuf_release_image(&h->c.bufs[index]);
+	v4l2_loop_cbuf_release_pbuf(&h->c.bufs[index], VB2_BUF_STATE_DONE);
+}
+
+static enum vb2_buffer_state v4l2_loop_test_state(struct v4l2_loop_test *t, int index)
+{
+	return t->pbufs[index]->vbuf.vb2_buf.state;
+}
+
+static void v4l2_loop_test_drop_oldest(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+
+	v4l2_loop_test_qbuf(t, 0);
+	v4l2_loop_test_qbuf(t, 1);
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 1), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_TRUE(test, list_is_singular(&t->dev->queued_bufs));
+	KUNIT_EXPECT_PTR_EQ(test,
+		list_first_entry(&t->dev->queued_bufs, struct v4l2_loop_pbuf, pnode), t->pbufs[1]);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 1);
+}
+
+static void v4l2_loop_test_drop_newest(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+
+	t->dev->drop_policy = V4L2_LOOP_DROP_NEWEST;
+	v4l2_loop_test_qbuf(t, 0);
+	v4l2_loop_test_qbuf(t, 1);
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 1), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_TRUE(test, list_is_singular(&t->dev->queued_bufs));
+	KUNIT_EXPECT_PTR_EQ(test,
+		list_first_entry(&t->dev->queued_bufs, struct v4l2_loop_pbuf, pnode), t->pbufs[0]);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 1);
+}
+
+static void v4l2_loop_test_drop_none(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 2);
+
+	t->dev->drop_policy = V4L2_LOOP_DROP_NONE;
+	v4l2_loop_test_qbuf(t, 0);
+	v4l2_loop_test_qbuf(t, 1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+
+	/* delivered in order */
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, t->pbufs[0]);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 1), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[1].pbuf, t->pbufs[1]);
+	KUNIT_EXPECT_TRUE(test, list_empty(&t->dev->queued_bufs));
+}
+
+static void v4l2_loop_test_nothing_queued(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 1);
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), -EAGAIN);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, NULL);
+}
+
+/* a frame is held by the consumer buffer till its QBUF and by 'last_pbuf' till the next frame */
+static void v4l2_loop_test_handoff(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 1);
+
+	v4l2_loop_test_qbuf(t, 0);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, t->pbufs[0]);
+	KUNIT_EXPECT_PTR_EQ(test, t->dev->last_pbuf, t->pbufs[0]);
+	KUNIT_EXPECT_EQ(test, refcount_read(&t->pbufs[0]->refs), 2);
+	KUNIT_EXPECT_TRUE(test, list_empty(&t->dev->queued_bufs));
+
+	v4l2_loop_test_qbuf_consumer(h, 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, NULL);
+	KUNIT_EXPECT_EQ(test, refcount_read(&t->pbufs[0]->refs), 1);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+
+	/* the next frame replaces the last one, which goes back to the producer */
+	v4l2_loop_test_qbuf(t, 1);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, t->dev->last_pbuf, t->pbufs[1]);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_DONE);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+}
+
+/* every frame goes to one consumer only */
+static void v4l2_loop_test_two_consumers(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h1 = v4l2_loop_test_consumer(test, 1);
+	struct v4l2_loop_handle *h2 = v4l2_loop_test_consumer(test, 1);
+
+	v4l2_loop_test_qbuf(t, 0);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h1, 0), 0);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_dqbuf(t, h2, 0), -EAGAIN);
+
+	v4l2_loop_test_qbuf(t, 1);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h2, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h1->c.bufs[0].pbuf, t->pbufs[0]);
+	KUNIT_EXPECT_PTR_EQ(test, h2->c.bufs[0].pbuf, t->pbufs[1]);
+
+	/* the first frame is still held by the first consumer */
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+	v4l2_loop_test_qbuf_consumer(h1, 0);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_DONE);
+}
+
+/* a consumer which has just started streaming gets the last frame at once */
+static void v4l2_loop_test_joining(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h1 = v4l2_loop_test_consumer(test, 1);
+	struct v4l2_loop_handle *h2 = v4l2_loop_test_consumer(test, 1);
+
+	v4l2_loop_test_qbuf(t, 0);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h1, 0), 0);
+
+	h2->c.joining = true;
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h2, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h2->c.bufs[0].pbuf, t->pbufs[0]);
+	KUNIT_EXPECT_FALSE(test, h2->c.joining);
+	KUNIT_EXPECT_EQ(test, refcount_read(&t->pbufs[0]->refs), 3);
+
+	/* but only once */
+	v4l2_loop_test_qbuf_consumer(h2, 0);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_dqbuf(t, h2, 0), -EAGAIN);
+}
+
+/* a frame older than consumer's max age is skipped by it and left to others */
+static void v4l2_loop_test_max_age(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h1 = v4l2_loop_test_consumer(test, 1);
+	struct v4l2_loop_handle *h2 = v4l2_loop_test_consumer(test, 1);
+	struct v4l2_loop_consumer_mode mode = {
+		.max_age_ms = 1,
+	};
+
+	KUNIT_ASSERT_EQ(test, v4l2_loop_s_consumer_mode(t->dev, h1, &mode), 0);
+	v4l2_loop_test_qbuf(t, 0);
+	t->pbufs[0]->queued_ns -= 2 * NSEC_PER_MSEC;
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_dqbuf(t, h1, 0), -EAGAIN);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h2, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h2->c.bufs[0].pbuf, t->pbufs[0]);
+
+	/* a fresh one is delivered */
+	v4l2_loop_test_qbuf(t, 1);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h1, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h1->c.bufs[0].pbuf, t->pbufs[1]);
+}
+
+/* max age cannot be set on a lossless device and does not apply there */
+static void v4l2_loop_test_max_age_lossless(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 2);
+	struct v4l2_loop_consumer_mode mode = {
+		.max_age_ms = 1,
+	};
+
+	t->dev->drop_policy = V4L2_LOOP_DROP_NONE;
+	KUNIT_EXPECT_EQ(test, v4l2_loop_s_consumer_mode(t->dev, h, &mode), -EBUSY);
+	KUNIT_EXPECT_EQ(test, h->c.max_age_ns, 0);
+
+	/* set before the policy was switched */
+	h->c.max_age_ns = NSEC_PER_MSEC;
+	v4l2_loop_test_qbuf(t, 0);
+	v4l2_loop_test_qbuf(t, 1);
+	t->pbufs[0]->queued_ns -= 2 * NSEC_PER_MSEC;
+	t->pbufs[1]->queued_ns -= 2 * NSEC_PER_MSEC;
+
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, t->pbufs[0]);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 1), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[1].pbuf, t->pbufs[1]);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+}
+
+/* buffers held by a producer closing with 'keep_format' go back at once, not to consumers */
+static void v4l2_loop_test_detaching(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 1);
+
+	v4l2_loop_test_qbuf(t, 0);
+
+	t->dev->detaching = true;
+	v4l2_loop_test_qbuf(t, 1);
+	t->dev->detaching = false;
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 1), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ACTIVE);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_queued), 1);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, t->pbufs[0]);
+}
+
+/* frames waiting for consumers and the ones they hold go back to the producer */
+static void v4l2_loop_test_stop_streaming(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 1);
+
+	t->dev->drop_policy = V4L2_LOOP_DROP_NONE;
+	v4l2_loop_test_qbuf(t, 0);
+	KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+	v4l2_loop_test_qbuf(t, 1);
+
+	v4l2_loop_queue_stop_streaming(&t->dev->vb_queue);
+
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 0), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_EQ(test, v4l2_loop_test_state(t, 1), VB2_BUF_STATE_ERROR);
+	KUNIT_EXPECT_PTR_EQ(test, h->c.bufs[0].pbuf, NULL);
+	KUNIT_EXPECT_PTR_EQ(test, t->dev->last_pbuf, NULL);
+	KUNIT_EXPECT_TRUE(test, list_empty(&t->dev->queued_bufs));
+	KUNIT_EXPECT_EQ(test, atomic_read(&t->dev->vb_queue.owned_by_drv_count), 0);
+}
+
+static void v4l2_loop_test_bench_report(struct kunit *test, const char *what, u64 start_ns)
+{
+	u64 elapsed_ns = ktime_get_ns() - start_ns;
+
+	kunit_info(test, "%s: %llu ns/frame (%d frames)\n", what,
+		div_u64(elapsed_ns, V4L2_LOOP_TEST_BENCH_FRAMES), V4L2_LOOP_TEST_BENCH_FRAMES);
+}
+
+/* producer's QBUF when nobody takes frames, each new one drops the previous one */
+static void v4l2_loop_test_bench_queue_drop(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	u64 start_ns = ktime_get_ns();
+	int i;
+
+	for (i = 0; i < V4L2_LOOP_TEST_BENCH_FRAMES; i++)
+		v4l2_loop_test_qbuf(t, i % V4L2_LOOP_TEST_PBUFS);
+
+	v4l2_loop_test_bench_report(test, "queue and drop", start_ns);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped),
+		V4L2_LOOP_TEST_BENCH_FRAMES - 1);
+}
+
+/* full round trip of a frame: producer's QBUF, consumer's DQBUF and QBUF */
+static void v4l2_loop_test_bench_handoff(struct kunit *test)
+{
+	struct v4l2_loop_test *t = test->priv;
+	struct v4l2_loop_handle *h = v4l2_loop_test_consumer(test, 1);
+	u64 start_ns = ktime_get_ns();
+	int i;
+
+	for (i = 0; i < V4L2_LOOP_TEST_BENCH_FRAMES; i++) {
+		v4l2_loop_test_qbuf(t, i % V4L2_LOOP_TEST_PBUFS);
+		KUNIT_ASSERT_EQ(test, v4l2_loop_test_dqbuf(t, h, 0), 0);
+		v4l2_loop_test_qbuf_consumer(h, 0);
+	}
+
+	v4l2_loop_test_bench_report(test, "handoff", start_ns);
+	KUNIT_EXPECT_EQ(test, atomic64_read(&t->dev->stats.frames_dropped), 0);
+}
+
+static struct kunit_case v4l2_loop_test_cases[] = {
+	KUNIT_CASE(v4l2_loop_test_drop_oldest),
+	KUNIT_CASE(v4l2_loop_test_drop_newest),
+	KUNIT_CASE(v4l2_loop_test_drop_none),
+	KUNIT_CASE(v4l2_loop_test_nothing_queued),
+	KUNIT_CASE(v4l2_loop_test_handoff),
+	KUNIT_CASE(v4l2_loop_test_two_consumers),
+	KUNIT_CASE(v4l2_loop_test_joining),
+	KUNIT_CASE(v4l2_loop_test_max_age),
+	KUNIT_CASE(v4l2_loop_test_max_age_lossless),
+	KUNIT_CASE(v4l2_loop_test_detaching),
+	KUNIT_CASE(v4l2_loop_test_stop_streaming),
+	KUNIT_CASE(v4l2_loop_test_bench_queue_drop),
+	KUNIT_CASE(v4l2_loop_test_bench_handoff),
+	{}
+};
+
+static struct kunit_suite v4l2_loop_test_suite = {
+	.name = "v4l2-loop",
+	.init = v4l2_loop_test_init,
+	.exit = v4l2_loop_test_exit,
+	.test_cases = v4l2_loop_test_cases,
+};
+
+kunit_test_suites(&v4l2_loop_test_suite);
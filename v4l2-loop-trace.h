@@ -0,0 +1,160 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+/*
+ * v4l2-loop-trace.h
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM v4l2_loop
+
+#if !defined(V4L2_LOOP_TRACE) || defined(TRACE_HEADER_MULTI_READ)
+#define V4L2_LOOP_TRACE
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include <linux/videodev2.h>
+
+#define v4l2_loop_show_buf_type(type)					\
+	__print_symbolic(type,						\
+		{ V4L2_BUF_TYPE_VIDEO_CAPTURE,        "VIDEO_CAPTURE" },	\
+		{ V4L2_BUF_TYPE_VIDEO_OUTPUT,         "VIDEO_OUTPUT" },	\
+		{ V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, "VIDEO_CAPTURE_MPLANE" }, \
+		{ V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE,  "VIDEO_OUTPUT_MPLANE" })
+
+#define v4l2_loop_show_memory(memory)					\
+	__print_symbolic(memory,					\
+		{ V4L2_MEMORY_MMAP,    "MMAP" },			\
+		{ V4L2_MEMORY_USERPTR, "USERPTR" },			\
+		{ V4L2_MEMORY_DMABUF,  "DMABUF" })
+
+/* buffer lifecycle: producer/consumer qbuf & dqbuf, frames dropped in buf_queue */
+DECLARE_EVENT_CLASS(v4l2_loop_buf_class,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u32, index)
+		__field(__u32, sequence)
+		__field(__u32, bytesused)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->index = index;
+		__entry->sequence = sequence;
+		__entry->bytesused = bytesused;
+	),
+
+	TP_printk("minor=%d index=%u sequence=%u bytesused=%u",
+		__entry->minor, __entry->index,
+		__entry->sequence, __entry->bytesused)
+);
+
+DEFINE_EVENT(v4l2_loop_buf_class, v4l2_loop_producer_qbuf,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused)
+);
+
+DEFINE_EVENT(v4l2_loop_buf_class, v4l2_loop_producer_dqbuf,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused)
+);
+
+DEFINE_EVENT(v4l2_loop_buf_class, v4l2_loop_buf_drop,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused)
+);
+
+DEFINE_EVENT(v4l2_loop_buf_class, v4l2_loop_consumer_qbuf,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused)
+);
+
+DEFINE_EVENT(v4l2_loop_buf_class, v4l2_loop_consumer_dqbuf,
+	TP_PROTO(int minor, __u32 index, __u32 sequence, __u32 bytesused),
+	TP_ARGS(minor, index, sequence, bytesused)
+);
+
+/* copying of producer planes into USERPTR/DMABUF consumer buffers */
+DECLARE_EVENT_CLASS(v4l2_loop_copy_class,
+	TP_PROTO(int minor, __u32 index, __u32 plane, __u32 memory, __u32 bytes),
+	TP_ARGS(minor, index, plane, memory, bytes),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u32, index)
+		__field(__u32, plane)
+		__field(__u32, memory)
+		__field(__u32, bytes)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->index = index;
+		__entry->plane = plane;
+		__entry->memory = memory;
+		__entry->bytes = bytes;
+	),
+
+	TP_printk("minor=%d index=%u plane=%u memory=%s bytes=%u",
+		__entry->minor, __entry->index, __entry->plane,
+		v4l2_loop_show_memory(__entry->memory), __entry->bytes)
+);
+
+DEFINE_EVENT(v4l2_loop_copy_class, v4l2_loop_copy_start,
+	TP_PROTO(int minor, __u32 index, __u32 plane, __u32 memory, __u32 bytes),
+	TP_ARGS(minor, index, plane, memory, bytes)
+);
+
+DEFINE_EVENT(v4l2_loop_copy_class, v4l2_loop_copy_end,
+	TP_PROTO(int minor, __u32 index, __u32 plane, __u32 memory, __u32 bytes),
+	TP_ARGS(minor, index, plane, memory, bytes)
+);
+
+/* streamon/streamoff issued by producers and consumers */
+DECLARE_EVENT_CLASS(v4l2_loop_stream_class,
+	TP_PROTO(int minor, __u32 type),
+	TP_ARGS(minor, type),
+
+	TP_STRUCT__entry(
+		__field(int, minor)
+		__field(__u32, type)
+	),
+
+	TP_fast_assign(
+		__entry->minor = minor;
+		__entry->type = type;
+	),
+
+	TP_printk("minor=%d type=%s",
+		__entry->minor, v4l2_loop_show_buf_type(__entry->type))
+);
+
+DEFINE_EVENT(v4l2_loop_stream_class, v4l2_loop_streamon,
+	TP_PROTO(int minor, __u32 type),
+	TP_ARGS(minor, type)
+);
+
+DEFINE_EVENT(v4l2_loop_stream_class, v4l2_loop_streamoff,
+	TP_PROTO(int minor, __u32 type),
+	TP_ARGS(minor, type)
+);
+
+#endif /* V4L2_LOOP_TRACE */
+
+/* this part has to be outside of the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE v4l2-loop-trace
+#include <trace/define_trace.h>
@@ -26,26 +26,53 @@
 #include <linux/printk.h>
 #include <linux/atomic.h>
 #include <linux/wait.h>
+#include <linux/jump_label.h>
+#include <linux/refcount.h>
+#include <linux/math64.h>
+#include <linux/sort.h>
+#include <linux/bsearch.h>
+#include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/vmalloc.h>
+#include <linux/log2.h>
+#include <linux/sizes.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mm.h>
+#include <linux/fs.h>
+#include <linux/miscdevice.h>
+#include <linux/uaccess.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include <linux/videodev2.h>
 #include <linux/dma-buf.h>
 
 #include <media/v4l2-device.h>
 #include <media/v4l2-ioctl.h>
+#include <media/v4l2-event.h>
+#include <media/v4l2-ctrls.h>
 #include <media/videobuf2-core.h>
 #include <media/videobuf2-v4l2.h>
 #include <media/videobuf2-vmalloc.h>
 
-#define v4l2_loop_dbg_at1(args...) \
-	do { if (v4l2_loop_debug_level >= 1) pr_info(args); } while (0)
+#include "v4l2-loop.h"
 
-#define v4l2_loop_dbg_at2(args...) \
-	do { if (v4l2_loop_debug_level >= 2) pr_info(args); } while (0)
+/*
+ * Debug messages are compiled behind a static branch which is only enabled
+ * while the global 'debug' parameter or at least one device's 'debug'
+ * attribute is non-zero. Until then each message costs a single nop.
+ */
+#define v4l2_loop_dbg_on(vdev, level) \
+	(static_branch_unlikely(&v4l2_loop_debug_key) && \
+		v4l2_loop_debug_level_of(vdev) >= (level))
 
-#define v4l2_loop_dbg_at3(args...) \
-	do { if (v4l2_loop_debug_level >= 3) pr_info(args); } while (0)
+#define v4l2_loop_dbg(vdev, level, args...) \
+	do { if (v4l2_loop_dbg_on(vdev, level)) pr_info(args); } while (0)
 
-#define v4l2_loop_dbg_at4(args...) \
-	do { if (v4l2_loop_debug_level >= 4) pr_info(args); } while (0)
+#define v4l2_loop_dbg_at1(vdev, args...) v4l2_loop_dbg(vdev, 1, args)
+#define v4l2_loop_dbg_at2(vdev, args...) v4l2_loop_dbg(vdev, 2, args)
+#define v4l2_loop_dbg_at3(vdev, args...) v4l2_loop_dbg(vdev, 3, args)
+#define v4l2_loop_dbg_at4(vdev, args...) v4l2_loop_dbg(vdev, 4, args)
 
 #define V4L2_LOOP_VERSION_MAJOR 0
 #define V4L2_LOOP_VERSION_MINOR 1
@@ -74,11 +101,59 @@
 	((type) == V4L2_BUF_TYPE_VIDEO_CAPTURE		\
 	|| (type) == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE)
 
+#define V4L2_LOOP_DEBUG_LEVEL_MAX 4
+
+#define V4L2_LOOP_TIMEOUT_MAX_MS 60000U
+#define V4L2_LOOP_STRIDE_ALIGN_MAX 4096U
+/* limits rows asked for by the producer, so frame sizes always fit in 32 bits */
+#define V4L2_LOOP_BYTESPERLINE_MAX (4U * 4U * V4L2_LOOP_DEFAULT_FRMSIZE_MAX_WIDTH)
+#define V4L2_LOOP_COMPRESSED_MIN_SIZE (64U * 1024U)
+#define V4L2_LOOP_COMPRESSED_MAX_SIZE (64U * 1024U * 1024U)
+
+static DEFINE_STATIC_KEY_FALSE(v4l2_loop_debug_key);
+
+/*
+ * Every non-zero debug level (global one or per device one)
+ * holds one reference on the v4l2_loop_debug_key.
+ */
+static void v4l2_loop_set_debug_level(int *level, int new_level)
+{
+	int old_level = xchg(level, new_level);
+
+	if (!old_level && new_level)
+		static_branch_inc(&v4l2_loop_debug_key);
+	else
+	if (old_level && !new_level)
+		static_branch_dec(&v4l2_loop_debug_key);
+}
+
+static int v4l2_loop_debug_level_set(const char *val, const struct kernel_param *kp)
+{
+	int level;
+	int status;
+
+	status = kstrtoint(val, 0, &level);
+	if (status)
+		return status;
+
+	if (level < 0 || level > V4L2_LOOP_DEBUG_LEVEL_MAX)
+		return -EINVAL;
+
+	v4l2_loop_set_debug_level(kp->arg, level);
+
+	return 0;
+}
+
+static const struct kernel_param_ops v4l2_loop_debug_level_ops = {
+	.set = v4l2_loop_debug_level_set,
+	.get = param_get_int,
+};
+
 /* module's params */
 static int v4l2_loop_debug_level = 0; /* do not emmit any traces by default */
-module_param_named(debug, v4l2_loop_debug_level, int, 0660);
+module_param_cb(debug, &v4l2_loop_debug_level_ops, &v4l2_loop_debug_level, 0660);
 MODULE_PARM_DESC(debug,
-	"Verbosity of debug messages (range: [0(none)-4(max)], default: 0)");
+	"Verbosity of debug messages for all devices (range: [0(none)-4(max)], default: 0)");
 
 static int v4l2_loop_devices = 1; /* number of virtual v4l2 devices created by this module */
 module_param_named(devices, v4l2_loop_devices, int, 0660);
@@ -95,7 +170,22 @@ module_param_named(mplane, v4l2_loop_mplane, bool, 0660);
 MODULE_PARM_DESC(mplane,
 	"Whether v4l2-loop shall support multiple frame formats (default: false)");
 
+static unsigned int v4l2_loop_stride_align = 1;
+module_param_named(stride_align, v4l2_loop_stride_align, uint, 0660);
+MODULE_PARM_DESC(stride_align,
+	"Alignment (power of 2, in bytes) of rows of uncompressed producer formats (default: 1)");
+
+static unsigned int v4l2_loop_max_memory = 0; /* in MiB, 0 - no limit */
+module_param_named(max_memory, v4l2_loop_max_memory, uint, 0660);
+MODULE_PARM_DESC(max_memory,
+	"Limit (in MiB) of memory allocated by all devices together (0 - no limit, default: 0)");
+
 static LIST_HEAD(v4l2_loop_devices_list);
+static DEFINE_MUTEX(v4l2_loop_devices_lock); /* protects 'v4l2_loop_devices_list' */
+static DEFINE_IDA(v4l2_loop_ida); /* source of devices' 'id' */
+static struct dentry *v4l2_loop_debugfs_root; /* /sys/kernel/debug/v4l2-loop */
+static atomic64_t v4l2_loop_mem_bytes = ATOMIC64_INIT(0); /* allocated by all devices */
+static atomic64_t v4l2_loop_mem_peak = ATOMIC64_INIT(0);
 
 #define V4L2_LOOP_MAX_PLANES 4
 struct v4l2_loop_fmtdesc
@@ -112,6 +202,36 @@ struct v4l2_loop_pbuf
 {
 	struct vb2_v4l2_buffer vbuf;
 	struct list_head pnode;		/* a node on producer 'queued_bufs' list */
+	refcount_t refs;		/* held by 'queued_bufs', consumers and 'last_pbuf' */
+	u64 queued_ns;			/* when producer queued it (CLOCK_MONOTONIC) */
+	u64 frame_id;			/* identifies current content (unique within the device) */
+	size_t charged;			/* memory of MMAP buffer charged to the device */
+};
+
+/* mmap offset of the placeholder image, above offsets of producer buffers given by vb2 */
+#define V4L2_LOOP_PLACEHOLDER_OFFSET	SZ_1G
+
+/*
+ * Driver owned frame ('timeout_image') delivered instead of the content
+ * of producer's last frame during stalls. Planes start at page boundaries,
+ * so MMAP consumers can map each of them (at V4L2_LOOP_PLACEHOLDER_OFFSET
+ * + plane's 'offset').
+ */
+struct v4l2_loop_placeholder
+{
+	struct kref refs;		/* held by the device, consumer buffers and mappings */
+	struct v4l2_loop_device *dev;
+	struct v4l2_format format;	/* producer's format the image was written for */
+	void *data;
+	size_t alloc;			/* allocated (and charged) bytes */
+	size_t image_size;		/* bytes of all planes */
+	size_t size;			/* bytes of the image written so far */
+	__u32 num_planes;
+	struct {
+		size_t offset;		/* in 'data' (page aligned) */
+		__u32 size;		/* bytes of the plane */
+	} planes[VIDEO_MAX_PLANES];
+	u64 frame_id;			/* identifies current content, like pbufs' one */
 };
 
 /* A consumer/capture buffer */
@@ -120,7 +240,27 @@ struct v4l2_loop_cbuf
 	struct vb2_v4l2_buffer vbuf;
 	struct list_head cnode;		/* a node on consumer 'queued_bufs' list */
 	struct v4l2_loop_pbuf *pbuf;	/* associated producer buffer */
+	struct v4l2_loop_placeholder *image; /* delivered instead of content of 'pbuf' (NULL - none) */
+};
 
+/*
+ * A producer frame transformed (cropped, downscaled and/or converted)
+ * into a consumer's format. It is shared by all consumers which asked
+ * for the same crop rectangle and format, so every frame is transformed
+ * only once no matter how many consumers receive it.
+ */
+#define V4L2_LOOP_MAX_XFORMS 4
+struct v4l2_loop_xform
+{
+	struct v4l2_loop_device *dev;
+	struct v4l2_rect crop;		/* part of the producer's frame */
+	struct v4l2_pix_format pix;	/* target format */
+	unsigned users;			/* protected by device's 'xforms_lock' */
+	struct mutex lock;		/* protects 'data', 'scaled' and 'frame_id' */
+	u64 frame_id;			/* producer frame held in 'data' (0 - none) */
+	void *data;			/* transformed frame ('pix.sizeimage' bytes) */
+	void *scaled;			/* downscaled, not yet converted frame (if both are needed) */
+	size_t scaled_size;
 };
 
 enum v4l2_loop_handle_type {
@@ -132,10 +272,30 @@ enum v4l2_loop_handle_type {
 struct v4l2_loop_producer_handle {
 };
 
+/* updated by the consumer itself (DQBUF is serialized by the queue lock) */
+struct v4l2_loop_consumer_stats {
+	u64 frames;			/* frames (and placeholders) dequeued */
+	u64 bytes;			/* payload of dequeued buffers */
+	u64 dqbuf_wait_ns;		/* time spent in DQBUF waiting for frames */
+	u64 frame_interval_ns;		/* running average, see v4l2_loop_stats_frame() */
+	u64 last_frame_ns;
+};
+
 struct v4l2_loop_consumer_handle {
 	__u32 buffers;
 	struct v4l2_loop_cbuf *bufs;
 	struct list_head queued_bufs;	/* consumer buffers will be queued here */
+	unsigned stall_count;		/* value of device's 'stall_count' when a frame was dequeued */
+	struct v4l2_fract timeperframe;	/* as requested with S_PARM, 0/0 - producer's frame rate */
+	u64 frame_interval_ns;		/* 'timeperframe' in ns, 0 - every frame is delivered */
+	u64 next_frame_ns;		/* frames queued before that time are skipped */
+	struct v4l2_rect crop;		/* set with S_SELECTION (width 0 - whole frame) */
+	struct v4l2_format format;	/* set with S_FMT if it differs from the producer's one (type 0 - none) */
+	struct v4l2_loop_xform *xform;	/* transformation from the producer's format into 'format' */
+	bool gather;			/* single planar consumer of a multi planar producer */
+	bool joining;			/* started streaming, device's last frame can be delivered at once */
+	u64 max_age_ns;			/* older frames are not delivered, 0 - no limit */
+	struct v4l2_loop_consumer_stats stats;
 };
 
 struct v4l2_loop_handle {
@@ -147,13 +307,63 @@ struct v4l2_loop_handle {
 	};
 };
 
+enum v4l2_loop_source_pattern {
+	V4L2_LOOP_SOURCE_OFF,
+	V4L2_LOOP_SOURCE_BAR,		/* vertical bar moving across the frame */
+	V4L2_LOOP_SOURCE_COUNTER,	/* timestamp (ns) and frame number stamped into first 16 bytes */
+	V4L2_LOOP_SOURCE_SOLID,		/* uniform grey */
+};
+
+/*
+ * In-kernel producer, which generates frames into the device's own
+ * vb2 buffers, see v4l2_loop_source_work(). Protected by 'vb_queue_lock'.
+ */
+struct v4l2_loop_source {
+	enum v4l2_loop_source_pattern pattern;	/* V4L2_LOOP_SOURCE_OFF - not running */
+	__u32 pixelformat;
+	__u32 width;
+	__u32 height;
+	__u32 fps;
+	struct v4l2_fh fh;		/* owner of the vb2 queue while running (never added to the device) */
+	struct hrtimer timer;		/* fires at every frame */
+	struct work_struct work;	/* generates the frame */
+	u64 due_ns;			/* timer's expiry the frame is generated for */
+	u64 free;			/* bitmask of buffers not queued to vb2 */
+	u64 frames;			/* generated so far */
+};
+
+/* device wide counters, see v4l2_loop_stats_show() */
+struct v4l2_loop_stats {
+	atomic64_t frames_queued;	/* by the producer */
+	atomic64_t frames_delivered;	/* to consumers (placeholders excluded) */
+	atomic64_t frames_dropped;	/* replaced by newer ones before any consumer took them */
+	atomic64_t placeholders;	/* delivered while producer stalled */
+	atomic64_t bytes_mmap;		/* delivered to consumers, per memory type */
+	atomic64_t bytes_userptr;
+	atomic64_t bytes_dmabuf;
+	atomic64_t dqbuf_wait_ns;	/* time consumers spent in DQBUF waiting for frames */
+	u64 frame_interval_ns;		/* producer's one (running average) */
+	u64 last_frame_ns;
+};
+
 struct v4l2_loop_device {
 	struct v4l2_device v4l2_dev;
 	struct video_device vdev;
 	struct list_head node; 		/* a node on the 'v4l2_loop_devices_list' */
+	int id;				/* instance number (v4l2_dev.name) */
+	unsigned int buffers;		/* minimum number of buffers needed before start streaming */
+	unsigned int max_buffers;	/* maximum number of producer buffers (queue depth) */
+	unsigned int max_width;		/* largest frame the producer can set */
+	unsigned int max_height;
+	unsigned int max_fps;		/* highest frame rate the producer and consumers can set */
+	unsigned int max_memory;	/* limit (in MiB) of 'mem_bytes', 0 - none */
+	atomic64_t mem_bytes;		/* producer's MMAP buffers, transformed frames and 'placeholder' */
+	atomic64_t mem_peak;
+	bool mplane;			/* multi planar API is used */
 	struct v4l2_format format;	/* format as set by the producer */
-	struct v4l2_captureparm captureparm;
-	struct v4l2_outputparm outputparm;
+	const struct v4l2_loop_fmtdesc *fmtdesc; /* description of 'format' (NULL if not set) */
+	unsigned int stride_align;	/* 'bytesperline' of producer formats is a multiple of it */
+	struct v4l2_outputparm outputparm; /* as set by the producer, consumers have their own frame rate */
 
 	struct mutex vb_queue_lock;	/* protects vb_queue */
 	struct vb2_queue vb_queue;
@@ -163,8 +373,48 @@ struct v4l2_loop_device {
 
 	wait_queue_head_t waiting_consumers;
 	unsigned sequence;		/* buffer sequence counter */
+
+	/* producer stall handling, see v4l2_loop_stall_work() */
+	struct v4l2_loop_pbuf *last_pbuf; /* last frame taken by consumers (protected by 'queued_bufs_lock') */
+	struct delayed_work stall_work;	/* fires when producer does not queue a frame within 'timeout_ms' */
+	unsigned int timeout_ms;	/* 0 - wait for the producer forever */
+	bool sustain_framerate;		/* stalls are detected and filled at producer's frame rate */
+	bool timeout_use_image;		/* placeholder is 'timeout_image' instead of the last frame */
+	bool stalled;			/* producer stalled (protected by 'queued_bufs_lock') */
+	unsigned stall_count;		/* incremented on every elapsed timeout while stalled */
+	struct mutex timeout_image_lock; /* serializes writers of 'placeholder' */
+	struct v4l2_loop_placeholder *placeholder; /* 'timeout_image' (replaced with both locks held) */
+
+	atomic64_t frame_ids;		/* source of pbufs' 'frame_id' */
+	struct mutex xforms_lock;	/* protects allocation of 'xforms' */
+	struct v4l2_loop_xform xforms[V4L2_LOOP_MAX_XFORMS];
+
+	int debug_level;		/* verbosity of this device (on top of the global one) */
+
+	struct v4l2_ctrl_handler ctrl_handler;
+	bool keep_format;		/* producer's format and buffers survive its close */
+	bool detaching;			/* buffers held by the closing producer are given back */
+	unsigned int drop_policy;	/* V4L2_LOOP_DROP_*, see v4l2_loop_queue_pbuf() */
+
+	struct v4l2_loop_source source;
+
+	struct v4l2_loop_stats stats;
+	struct dentry *debugfs_dir;	/* /sys/kernel/debug/v4l2-loop/videoN */
 };
 
+static inline int v4l2_loop_debug_level_of(struct video_device *vdev)
+{
+	int level = READ_ONCE(v4l2_loop_debug_level);
+
+	if (vdev) {
+		struct v4l2_loop_device *dev =
+			container_of(vdev, struct v4l2_loop_device, vdev);
+		level = max(level, READ_ONCE(dev->debug_level));
+	}
+
+	return level;
+}
+
 static const struct v4l2_loop_fmtdesc v4l2_loop_fmtdescs_splanes[] = {
 #include "v4l2-loop-fmtdesc-splanes.h"
 };
@@ -174,7 +424,144 @@ static const struct v4l2_loop_fmtdesc v4l2_loop_fmtdescs_mplanes[] = {
 #include "v4l2-loop-fmtdesc-mplanes.h"
 };
 
+/* pointers to above tables sorted by fourcc (built at module init) for binary search */
+static const struct v4l2_loop_fmtdesc *v4l2_loop_fmtdescs_splanes_index[ARRAY_SIZE(v4l2_loop_fmtdescs_splanes)];
+static const struct v4l2_loop_fmtdesc *v4l2_loop_fmtdescs_mplanes_index[ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes)];
+
+static int v4l2_loop_fmtdesc_cmp(const void *a, const void *b)
+{
+	const struct v4l2_loop_fmtdesc *fa = *(const struct v4l2_loop_fmtdesc * const *)a;
+	const struct v4l2_loop_fmtdesc *fb = *(const struct v4l2_loop_fmtdesc * const *)b;
+
+	if (fa->pixelformat < fb->pixelformat)
+		return -1;
+	else
+	if (fa->pixelformat > fb->pixelformat)
+		return 1;
+	else
+		return 0;
+}
+
+static int v4l2_loop_fmtdesc_key_cmp(const void *key, const void *elt)
+{
+	__u32 pixelformat = *(const __u32 *)key;
+	const struct v4l2_loop_fmtdesc *f = *(const struct v4l2_loop_fmtdesc * const *)elt;
+
+	if (pixelformat < f->pixelformat)
+		return -1;
+	else
+	if (pixelformat > f->pixelformat)
+		return 1;
+	else
+		return 0;
+}
+
+static void v4l2_loop_fmtdesc_index_init(const struct v4l2_loop_fmtdesc **index,
+	const struct v4l2_loop_fmtdesc *fmtdescs, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		index[i] = &fmtdescs[i];
+
+	sort(index, n, sizeof(*index), v4l2_loop_fmtdesc_cmp, NULL);
+}
+
+static void v4l2_loop_fmtdescs_index_init(void)
+{
+	v4l2_loop_fmtdesc_index_init(v4l2_loop_fmtdescs_splanes_index,
+		v4l2_loop_fmtdescs_splanes, ARRAY_SIZE(v4l2_loop_fmtdescs_splanes));
+	v4l2_loop_fmtdesc_index_init(v4l2_loop_fmtdescs_mplanes_index,
+		v4l2_loop_fmtdescs_mplanes, ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes));
+}
+
+static const struct v4l2_loop_fmtdesc *v4l2_loop_find_fmtdesc(bool mplane, __u32 pixelformat)
+{
+	const struct v4l2_loop_fmtdesc **f;
+
+	if (mplane)
+		f = bsearch(&pixelformat, v4l2_loop_fmtdescs_mplanes_index,
+			ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes_index), sizeof(*f),
+			v4l2_loop_fmtdesc_key_cmp);
+	else
+		f = bsearch(&pixelformat, v4l2_loop_fmtdescs_splanes_index,
+			ARRAY_SIZE(v4l2_loop_fmtdescs_splanes_index), sizeof(*f),
+			v4l2_loop_fmtdesc_key_cmp);
+
+	return f ? *f : NULL;
+}
+
 #include "v4l2-loop-print-functions.h"
+#include "v4l2-loop-convert.h"
+
+#define CREATE_TRACE_POINTS
+#include "v4l2-loop-trace.h"
+
+static void v4l2_loop_mem_update_peak(atomic64_t *peak, s64 bytes)
+{
+	s64 old = atomic64_read(peak);
+
+	while (bytes > old && !atomic64_try_cmpxchg(peak, &old, bytes))
+		;
+}
+
+/* how many bytes can still be allocated within 'limit_mb' (S64_MAX if there is no limit) */
+static s64 v4l2_loop_mem_room(unsigned int limit_mb, atomic64_t *bytes)
+{
+	if (!limit_mb)
+		return S64_MAX;
+
+	return max_t(s64, (s64)limit_mb * SZ_1M - atomic64_read(bytes), 0);
+}
+
+static s64 v4l2_loop_mem_available(struct v4l2_loop_device *dev)
+{
+	return min(v4l2_loop_mem_room(READ_ONCE(dev->max_memory), &dev->mem_bytes),
+		v4l2_loop_mem_room(READ_ONCE(v4l2_loop_max_memory), &v4l2_loop_mem_bytes));
+}
+
+/*
+ * Accounts 'size' bytes allocated for the device. Fails with -ENOMEM
+ * if either the device's or the global limit would be exceeded.
+ */
+static int v4l2_loop_mem_charge(struct v4l2_loop_device *dev, size_t size)
+{
+	unsigned int dev_limit = READ_ONCE(dev->max_memory);
+	unsigned int limit = READ_ONCE(v4l2_loop_max_memory);
+	s64 dev_bytes = atomic64_add_return(size, &dev->mem_bytes);
+	s64 bytes = atomic64_add_return(size, &v4l2_loop_mem_bytes);
+
+	if ((dev_limit && dev_bytes > (s64)dev_limit * SZ_1M) ||
+		(limit && bytes > (s64)limit * SZ_1M)) {
+		atomic64_sub(size, &dev->mem_bytes);
+		atomic64_sub(size, &v4l2_loop_mem_bytes);
+		pr_warn_ratelimited("%s: cannot allocate %zu bytes, memory limit exceeded "
+			"(device: %u MiB, all devices: %u MiB)\n",
+			video_device_node_name(&dev->vdev), size, dev_limit, limit);
+		return -ENOMEM;
+	}
+
+	v4l2_loop_mem_update_peak(&dev->mem_peak, dev_bytes);
+	v4l2_loop_mem_update_peak(&v4l2_loop_mem_peak, bytes);
+
+	return 0;
+}
+
+static void v4l2_loop_mem_uncharge(struct v4l2_loop_device *dev, size_t size)
+{
+	atomic64_sub(size, &dev->mem_bytes);
+	atomic64_sub(size, &v4l2_loop_mem_bytes);
+}
+
+/* memory allocated on behalf of a process is charged to its memory cgroup */
+static void *v4l2_loop_vmalloc(size_t size)
+{
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 8, 0)
+	return __vmalloc(size, GFP_KERNEL_ACCOUNT);
+#else
+	return __vmalloc(size, GFP_KERNEL_ACCOUNT, PAGE_KERNEL);
+#endif
+}
 
 //TODO: Shall I move following function to something like v4l2-loop-helpers.h
 static int v4l2_loop_validate_planes(struct vb2_buffer *vb, struct v4l2_buffer *buffer)
@@ -184,14 +571,14 @@ static int v4l2_loop_validate_planes(struct vb2_buffer *vb, struct v4l2_buffer *
 
 	/* Is memory for copying plane information present? */
 	if (buffer->m.planes == NULL) {
-		v4l2_loop_dbg_at1(
+		v4l2_loop_dbg_at1(NULL,
 			"%s() multi-planar scheme used but planes array not provided\n",
 			__func__);
 		return -EINVAL;
 	}
 
 	if (buffer->length < vb->num_planes || buffer->length > VB2_MAX_PLANES) {
-		v4l2_loop_dbg_at1("%s() incorrect planes array length, expected %d, got %d\n",
+		v4l2_loop_dbg_at1(NULL, "%s() incorrect planes array length, expected %d, got %d\n",
 			__func__, vb->num_planes, buffer->length);
 		return -EINVAL;
 	}
@@ -199,6 +586,128 @@ static int v4l2_loop_validate_planes(struct vb2_buffer *vb, struct v4l2_buffer *
 	return 0;
 }
 
+static __u32 v4l2_loop_vb2_bytesused(struct vb2_buffer *vb)
+{
+	__u32 plane;
+	__u32 bytesused = 0;
+
+	for (plane = 0; plane < vb->num_planes; plane++)
+		bytesused += vb2_get_plane_payload(vb, plane);
+
+	return bytesused;
+}
+
+static __u32 v4l2_loop_buffer_bytesused(const struct v4l2_buffer *buffer)
+{
+	__u32 plane;
+	__u32 bytesused = 0;
+
+	if (!V4L2_TYPE_IS_MULTIPLANAR(buffer->type))
+		return buffer->bytesused;
+
+	for (plane = 0; plane < buffer->length; plane++)
+		bytesused += buffer->m.planes[plane].bytesused;
+
+	return bytesused;
+}
+
+/*
+ * Producer buffers are shared between the 'queued_bufs' list, consumers
+ * which have dequeued them and 'last_pbuf'. The buffer is given back to
+ * the producer once the last of them lets it go.
+ */
+static void v4l2_loop_pbuf_get(struct v4l2_loop_pbuf *pbuf)
+{
+	refcount_inc(&pbuf->refs);
+}
+
+static void v4l2_loop_pbuf_put(struct v4l2_loop_pbuf *pbuf, enum vb2_buffer_state state)
+{
+	if (!refcount_dec_and_test(&pbuf->refs))
+		return;
+
+	/* vb2 may have already taken it back while cancelling the queue */
+	if (pbuf->vbuf.vb2_buf.state == VB2_BUF_STATE_ACTIVE)
+		vb2_buffer_done(&pbuf->vbuf.vb2_buf, state);
+}
+
+static void v4l2_loop_placeholder_release(struct kref *kref)
+{
+	struct v4l2_loop_placeholder *ph =
+		container_of(kref, struct v4l2_loop_placeholder, refs);
+
+	v4l2_loop_mem_uncharge(ph->dev, ph->alloc);
+	vfree(ph->data);
+	kfree(ph);
+}
+
+static void v4l2_loop_placeholder_put(struct v4l2_loop_placeholder *ph)
+{
+	kref_put(&ph->refs, v4l2_loop_placeholder_release);
+}
+
+/* drops the placeholder image the consumer buffer was filled with (if any) */
+static void v4l2_loop_cbuf_release_image(struct v4l2_loop_cbuf *cbuf)
+{
+	if (cbuf->image) {
+		v4l2_loop_placeholder_put(cbuf->image);
+		cbuf->image = NULL;
+	}
+}
+
+/*
+ * Where the content of a consumer buffer comes from: the placeholder
+ * image if the buffer is filled with it, otherwise the producer buffer.
+ */
+static void *v4l2_loop_src_vaddr(struct v4l2_loop_pbuf *pbuf,
+	struct v4l2_loop_cbuf *cbuf, __u32 plane)
+{
+	struct v4l2_loop_placeholder *ph = cbuf->image;
+
+	if (ph)
+		return plane < ph->num_planes ? ph->data + ph->planes[plane].offset : NULL;
+
+	return vb2_plane_vaddr(&pbuf->vbuf.vb2_buf, plane);
+}
+
+static unsigned long v4l2_loop_src_size(struct v4l2_loop_pbuf *pbuf,
+	struct v4l2_loop_cbuf *cbuf, __u32 plane)
+{
+	struct v4l2_loop_placeholder *ph = cbuf->image;
+
+	if (ph)
+		return plane < ph->num_planes ? ph->planes[plane].size : 0;
+
+	return vb2_plane_size(&pbuf->vbuf.vb2_buf, plane);
+}
+
+static __u32 v4l2_loop_src_bytesused(struct v4l2_loop_pbuf *pbuf,
+	struct v4l2_loop_cbuf *cbuf, __u32 plane)
+{
+	if (cbuf->image)
+		return v4l2_loop_src_size(pbuf, cbuf, plane);
+
+	return pbuf->vbuf.vb2_buf.planes[plane].bytesused;
+}
+
+static u64 v4l2_loop_src_frame_id(struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf)
+{
+	return cbuf->image ? cbuf->image->frame_id : pbuf->frame_id;
+}
+
+/*
+ * Gives back the producer buffer attached to the consumer buffer (if any).
+ * A consumer buffer references the producer buffer it was filled with
+ * from its DQBUF till its next QBUF (or till the buffers are released).
+ */
+static void v4l2_loop_cbuf_release_pbuf(struct v4l2_loop_cbuf *cbuf, enum vb2_buffer_state state)
+{
+	if (cbuf->pbuf) {
+		v4l2_loop_pbuf_put(cbuf->pbuf, state);
+		cbuf->pbuf = NULL;
+	}
+}
+
 static void v4l2_loop_release_cplanes(struct v4l2_loop_cbuf *cbuf)
 {
 	__u32 plane;
@@ -223,26 +732,81 @@ static void v4l2_loop_release_cplanes(struct v4l2_loop_cbuf *cbuf)
 
 }
 
+static void v4l2_loop_xform_put(struct v4l2_loop_xform *xform);
+
 static void v4l2_loop_release_cbufs(struct v4l2_loop_consumer_handle *c)
 {
 	if (c->bufs) {
 		__u32 i;
 
-		v4l2_loop_dbg_at2("releasing %u consumer buffers\n", c->buffers);
+		v4l2_loop_dbg_at2(NULL, "releasing %u consumer buffers\n", c->buffers);
 
 		for (i = 0; i < c->buffers; i++) {
 			struct v4l2_loop_cbuf *cbuf = &c->bufs[i];
+			v4l2_loop_cbuf_release_pbuf(cbuf, VB2_BUF_STATE_DONE);
+			v4l2_loop_cbuf_release_image(cbuf);
 			v4l2_loop_release_cplanes(cbuf);
 		}
 
 		kfree(c->bufs);
 		c->bufs = NULL;
 	}
+
+	if (c->xform) {
+		v4l2_loop_xform_put(c->xform);
+		c->xform = NULL;
+	}
+
+	c->gather = false;
+}
+
+/*
+ * Maps consumer's DMABUF plane (unless it is already mapped),
+ * returns its kernel address or NULL.
+ */
+static void *v4l2_loop_vmap_cplane(struct v4l2_loop_device *dev,
+	struct vb2_plane *csrc, __u32 plane, __u32 *length)
+{
+	struct dma_buf *dbuf;
+
+	dbuf = dma_buf_get(csrc->m.fd);
+	if (IS_ERR_OR_NULL(dbuf)) {
+		v4l2_loop_dbg_at1(&dev->vdev, "invalid dmabuf fd for plane %d\n", plane);
+		return NULL;
+	}
+
+	*length = csrc->length ?: dbuf->size; /* use DMABUF size if length is not provided */
+
+	if (csrc->dbuf != dbuf) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
+		struct iosys_map map = IOSYS_MAP_INIT_VADDR(csrc->mem_priv);
+#else
+		struct dma_buf_map map = DMA_BUF_MAP_INIT_VADDR(csrc->mem_priv);
+#endif
+		if (csrc->dbuf) { /* release previous mapping (if any) */
+			if (csrc->mem_priv)
+				dma_buf_vunmap(csrc->dbuf, &map);
+			dma_buf_put(csrc->dbuf);
+		}
+		if (!dma_buf_vmap(dbuf, &map)) { /* create new mapping */
+			csrc->dbuf = dbuf;
+			csrc->mem_priv = map.vaddr;
+		} else {
+			csrc->dbuf = NULL;
+			csrc->mem_priv = NULL;
+			dma_buf_put(dbuf);
+		}
+	}
+	else
+		dma_buf_put(dbuf);
+
+	return csrc->mem_priv;
 }
 
 static int v4l2_loop_fill_user_buffer_mplane_mmap(
 	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
 {
+	struct v4l2_loop_device *dev = vb2_get_drv_priv(pbuf->vbuf.vb2_buf.vb2_queue);
 	__u32 plane;
 	__u32 num_planes = cbuf->vbuf.vb2_buf.num_planes;
 
@@ -254,6 +818,13 @@ static int v4l2_loop_fill_user_buffer_mplane_mmap(
 
 		memset(dst->reserved, 0, sizeof(dst->reserved));
 
+		if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_MMAP && cbuf->image) {
+			dst->m.mem_offset = V4L2_LOOP_PLACEHOLDER_OFFSET + cbuf->image->planes[plane].offset;
+			dst->length = PAGE_ALIGN(v4l2_loop_src_size(pbuf, cbuf, plane));
+			dst->bytesused = v4l2_loop_src_bytesused(pbuf, cbuf, plane);
+			dst->data_offset = 0;
+		}
+		else
 		if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_MMAP) {
 			dst->m.mem_offset = psrc->m.offset;
 			dst->length = psrc->length;
@@ -264,9 +835,9 @@ static int v4l2_loop_fill_user_buffer_mplane_mmap(
 		if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_USERPTR) {
 			void *vaddr;
 
-			vaddr = vb2_plane_vaddr(&pbuf->vbuf.vb2_buf, plane);
+			vaddr = v4l2_loop_src_vaddr(pbuf, cbuf, plane);
 			if (!vaddr) {
-				v4l2_loop_dbg_at1("cannot obtain vaddr of producer plane %d\n", plane);
+				v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", plane);
 				return -EFAULT;
 			}
 
@@ -275,54 +846,33 @@ static int v4l2_loop_fill_user_buffer_mplane_mmap(
 
 			dst->m.userptr = csrc->m.userptr;
 			dst->length = csrc->length;
-			dst->bytesused = min(psrc->bytesused, dst->length);
+			dst->bytesused = min(v4l2_loop_src_bytesused(pbuf, cbuf, plane), dst->length);
+			trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+				plane, cbuf->vbuf.vb2_buf.memory, dst->bytesused);
 			WARN_ON(copy_to_user((void*)dst->m.userptr, vaddr, dst->bytesused));
+			trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+				plane, cbuf->vbuf.vb2_buf.memory, dst->bytesused);
 		}
 		else
 		if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_DMABUF) {
 			void *vaddr;
-			struct dma_buf *dbuf;
 
-			vaddr = vb2_plane_vaddr(&pbuf->vbuf.vb2_buf, plane);
+			vaddr = v4l2_loop_src_vaddr(pbuf, cbuf, plane);
 			if (!vaddr) {
-				v4l2_loop_dbg_at1("cannot obtain vaddr of producer plane %d\n", plane);
-				return -EFAULT;
-			}
-
-			dbuf = dma_buf_get(csrc->m.fd);
-			if (IS_ERR_OR_NULL(dbuf)) {
-				v4l2_loop_dbg_at1("invalid dmabuf fd for plane %d\n", plane);
+				v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", plane);
 				return -EFAULT;
 			}
 
 			dst->m.fd = csrc->m.fd;
-			dst->length = csrc->length ?: dbuf->size; /* use DMABUF size if length is not provided */
-			dst->bytesused = min(psrc->bytesused, dst->length);
-
-			if (csrc->dbuf != dbuf) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
-				struct iosys_map map = IOSYS_MAP_INIT_VADDR(csrc->mem_priv);
-#else
-				struct dma_buf_map map = DMA_BUF_MAP_INIT_VADDR(csrc->mem_priv);
-#endif
-				if (csrc->dbuf && csrc->mem_priv) /* release previous mapping (if any) */
-					dma_buf_vunmap(dbuf, &map);
-				if (!dma_buf_vmap(dbuf, &map)) { /* create new mapping */
-					csrc->dbuf = dbuf;
-					csrc->mem_priv = map.vaddr;
-				} else {
-					csrc->dbuf = NULL;
-					csrc->mem_priv = NULL;
-					dma_buf_put(dbuf);
-				}
-			}
-			else
-				dma_buf_put(dbuf);
-
-			if (!csrc->mem_priv)
+			if (!v4l2_loop_vmap_cplane(dev, csrc, plane, &dst->length))
 				return -EFAULT;
+			dst->bytesused = min(v4l2_loop_src_bytesused(pbuf, cbuf, plane), dst->length);
 
+			trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+				plane, cbuf->vbuf.vb2_buf.memory, dst->bytesused);
 			memcpy(csrc->mem_priv, vaddr, dst->bytesused);
+			trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+				plane, cbuf->vbuf.vb2_buf.memory, dst->bytesused);
 		}
 		else
 			return -EFAULT;
@@ -364,9 +914,16 @@ static int v4l2_loop_fill_user_buffer_mplane(
 static int v4l2_loop_fill_user_buffer_splane_mmap(
 	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
 {
+	struct v4l2_loop_device *dev = vb2_get_drv_priv(pbuf->vbuf.vb2_buf.vb2_queue);
 	struct vb2_plane *psrc = &pbuf->vbuf.vb2_buf.planes[0];
 	struct vb2_plane *csrc = &cbuf->vbuf.vb2_buf.planes[0];
 
+	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_MMAP && cbuf->image) {
+		buffer->m.offset = V4L2_LOOP_PLACEHOLDER_OFFSET + cbuf->image->planes[0].offset;
+		buffer->length = PAGE_ALIGN(v4l2_loop_src_size(pbuf, cbuf, 0));
+		buffer->bytesused = v4l2_loop_src_bytesused(pbuf, cbuf, 0);
+	}
+	else
 	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_MMAP) {
 		buffer->m.offset = psrc->m.offset;
 		buffer->length = psrc->length;
@@ -376,9 +933,9 @@ static int v4l2_loop_fill_user_buffer_splane_mmap(
 	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_USERPTR) {
 		void *vaddr;
 
-		vaddr = vb2_plane_vaddr(&pbuf->vbuf.vb2_buf, 0);
+		vaddr = v4l2_loop_src_vaddr(pbuf, cbuf, 0);
 		if (!vaddr) {
-			v4l2_loop_dbg_at1("cannot obtain vaddr of producer plane %d\n", 0);
+			v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", 0);
 			return -EFAULT;
 		}
 
@@ -387,54 +944,33 @@ static int v4l2_loop_fill_user_buffer_splane_mmap(
 
 		buffer->m.userptr = csrc->m.userptr;
 		buffer->length = csrc->length;
-		buffer->bytesused = min(psrc->bytesused, buffer->length);
+		buffer->bytesused = min(v4l2_loop_src_bytesused(pbuf, cbuf, 0), buffer->length);
+		trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
 		WARN_ON(copy_to_user((void*)buffer->m.userptr, vaddr, buffer->bytesused));
+		trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
 	}
 	else
 	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_DMABUF) {
 		void *vaddr;
-		struct dma_buf *dbuf;
 
-		vaddr = vb2_plane_vaddr(&pbuf->vbuf.vb2_buf, 0);
+		vaddr = v4l2_loop_src_vaddr(pbuf, cbuf, 0);
 		if (!vaddr) {
-			v4l2_loop_dbg_at1("cannot obtain vaddr of producer plane %d\n", 0);
-			return -EFAULT;
-		}
-
-		dbuf = dma_buf_get(csrc->m.fd);
-		if (IS_ERR_OR_NULL(dbuf)) {
-			v4l2_loop_dbg_at1("invalid dmabuf fd for plane %d\n", 0);
+			v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", 0);
 			return -EFAULT;
 		}
 
 		buffer->m.fd = csrc->m.fd;
-		buffer->length = csrc->length ?: dbuf->size; /* use DMABUF size if length is not provided */
-		buffer->bytesused = min(psrc->bytesused, buffer->length);
-
-		if (csrc->dbuf != dbuf) {
-#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 18, 0)
-			struct iosys_map map = IOSYS_MAP_INIT_VADDR(csrc->mem_priv);
-#else
-			struct dma_buf_map map = DMA_BUF_MAP_INIT_VADDR(csrc->mem_priv);
-#endif
-			if (csrc->dbuf && csrc->mem_priv) /* release previous mapping (if any) */
-				dma_buf_vunmap(dbuf, &map);
-			if (!dma_buf_vmap(dbuf, &map)) { /* create new mapping */
-				csrc->dbuf = dbuf;
-				csrc->mem_priv = map.vaddr;
-			} else {
-				csrc->dbuf = NULL;
-				csrc->mem_priv = NULL;
-				dma_buf_put(dbuf);
-			}
-		}
-		else
-			dma_buf_put(dbuf);
-
-		if (!csrc->mem_priv)
+		if (!v4l2_loop_vmap_cplane(dev, csrc, 0, &buffer->length))
 			return -EFAULT;
+		buffer->bytesused = min(v4l2_loop_src_bytesused(pbuf, cbuf, 0), buffer->length);
 
+		trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
 		memcpy(csrc->mem_priv, vaddr, buffer->bytesused);
+		trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
 	}
 	else
 		return -EFAULT;
@@ -472,7 +1008,7 @@ static int v4l2_loop_fill_user_buffer_splane(
 	}
 }
 
-static int v4l2_loop_fill_user_buffer(
+static void v4l2_loop_fill_user_buffer_header(
 	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
 {
 	buffer->index = cbuf->vbuf.vb2_buf.index;
@@ -491,19 +1027,442 @@ static int v4l2_loop_fill_user_buffer(
 	buffer->sequence = pbuf->vbuf.sequence;
 	buffer->reserved2 = 0;
 	buffer->request_fd = -1;
+}
+
+static int v4l2_loop_fill_user_buffer(
+	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
+{
+	v4l2_loop_fill_user_buffer_header(pbuf, cbuf, buffer);
 
 	return V4L2_TYPE_IS_MULTIPLANAR(buffer->type) ?
 		v4l2_loop_fill_user_buffer_mplane(pbuf, cbuf, buffer) :
 		v4l2_loop_fill_user_buffer_splane(pbuf, cbuf, buffer);
 }
 
-static void v4l2_loop_fill_vb2_buffer_mplane(struct v4l2_buffer *buffer, struct vb2_buffer *vb)
+/*
+ * Layouts of (not tiled) multi planar formats. They let consumers get crops
+ * without any copying, just with 'data_offset' of every plane pointing at
+ * the rectangle's origin (and 'bytesperline' kept from the producer's format),
+ * and are used to pad planes' rows, see v4l2_loop_fill_sizes_mplane().
+ */
+struct v4l2_loop_mplane_layout
 {
+	__u32 pixelformat;
+	__u32 splane_pixelformat;	/* the same layout with planes stored one after another (0 - none) */
+	struct {
+		u8 hsub;	/* pixels per byte of the plane's row */
+		u8 vsub;	/* frame rows per plane's row */
+	} planes[3];
+};
+
+static const struct v4l2_loop_mplane_layout v4l2_loop_mplane_layouts[] = {
+	{ V4L2_PIX_FMT_NV12M,   V4L2_PIX_FMT_NV12,    {{1, 1}, {1, 2}} },
+	{ V4L2_PIX_FMT_NV21M,   V4L2_PIX_FMT_NV21,    {{1, 1}, {1, 2}} },
+	{ V4L2_PIX_FMT_NV16M,   V4L2_PIX_FMT_NV16,    {{1, 1}, {1, 1}} },
+	{ V4L2_PIX_FMT_NV61M,   V4L2_PIX_FMT_NV61,    {{1, 1}, {1, 1}} },
+	{ V4L2_PIX_FMT_YUV420M, V4L2_PIX_FMT_YUV420,  {{1, 1}, {2, 2}, {2, 2}} },
+	{ V4L2_PIX_FMT_YVU420M, V4L2_PIX_FMT_YVU420,  {{1, 1}, {2, 2}, {2, 2}} },
+	{ V4L2_PIX_FMT_YUV422M, V4L2_PIX_FMT_YUV422P, {{1, 1}, {2, 1}, {2, 1}} },
+	{ V4L2_PIX_FMT_YVU422M, 0,                    {{1, 1}, {2, 1}, {2, 1}} },
+	{ V4L2_PIX_FMT_YUV444M, 0,                    {{1, 1}, {1, 1}, {1, 1}} },
+	{ V4L2_PIX_FMT_YVU444M, 0,                    {{1, 1}, {1, 1}, {1, 1}} },
+};
+
+static const struct v4l2_loop_mplane_layout *v4l2_loop_find_mplane_layout(__u32 pixelformat)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(v4l2_loop_mplane_layouts); i++)
+		if (v4l2_loop_mplane_layouts[i].pixelformat == pixelformat)
+			return &v4l2_loop_mplane_layouts[i];
+
+	return NULL;
+}
+
+/*
+ * Producer's format as seen by single planar consumers. Multi planar
+ * formats are exported as their single planar equivalents (planes stored
+ * one after another, chroma rows of the Y plane's 'bytesperline' divided
+ * by horizontal subsampling), see v4l2_loop_fill_user_buffer_gather().
+ */
+static int v4l2_loop_bridge_pix(struct v4l2_loop_device *dev, struct v4l2_pix_format *pix)
+{
+	const struct v4l2_pix_format_mplane *pix_mp = &dev->format.fmt.pix_mp;
+	const struct v4l2_loop_mplane_layout *layout;
 	__u32 plane;
-	__u32 num_planes = buffer->length;
 
-	for (plane = 0; plane < num_planes; ++plane) {
-		if (vb->memory == VB2_MEMORY_USERPTR) {
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
+		*pix = dev->format.fmt.pix;
+		return 0;
+	}
+
+	memset(pix, 0, sizeof(*pix));
+	pix->width = pix_mp->width;
+	pix->height = pix_mp->height;
+	pix->field = pix_mp->field;
+	pix->colorspace = pix_mp->colorspace;
+	pix->flags = pix_mp->flags;
+	pix->ycbcr_enc = pix_mp->ycbcr_enc;
+	pix->quantization = pix_mp->quantization;
+	pix->xfer_func = pix_mp->xfer_func;
+	pix->bytesperline = pix_mp->plane_fmt[0].bytesperline;
+
+	if (pix_mp->num_planes == 1) {
+		pix->pixelformat = pix_mp->pixelformat;
+		pix->sizeimage = pix_mp->plane_fmt[0].sizeimage;
+		return 0;
+	}
+
+	layout = v4l2_loop_find_mplane_layout(pix_mp->pixelformat);
+	if (!layout || !layout->splane_pixelformat)
+		return -EINVAL;
+
+	pix->pixelformat = layout->splane_pixelformat;
+	for (plane = 0; plane < pix_mp->num_planes; plane++)
+		pix->sizeimage += (pix->bytesperline / layout->planes[plane].hsub) *
+			DIV_ROUND_UP(pix->height, layout->planes[plane].vsub);
+
+	return 0;
+}
+
+/* producer's format as seen by multi planar consumers, single planar one has just one plane */
+static void v4l2_loop_bridge_pix_mp(struct v4l2_loop_device *dev,
+	struct v4l2_pix_format_mplane *pix_mp)
+{
+	const struct v4l2_pix_format *pix = &dev->format.fmt.pix;
+
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		*pix_mp = dev->format.fmt.pix_mp;
+		return;
+	}
+
+	memset(pix_mp, 0, sizeof(*pix_mp));
+	pix_mp->width = pix->width;
+	pix_mp->height = pix->height;
+	pix_mp->pixelformat = pix->pixelformat;
+	pix_mp->field = pix->field;
+	pix_mp->colorspace = pix->colorspace;
+	pix_mp->flags = pix->flags;
+	pix_mp->ycbcr_enc = pix->ycbcr_enc;
+	pix_mp->quantization = pix->quantization;
+	pix_mp->xfer_func = pix->xfer_func;
+	pix_mp->num_planes = 1;
+	pix_mp->plane_fmt[0].bytesperline = pix->bytesperline;
+	pix_mp->plane_fmt[0].sizeimage = pix->sizeimage;
+}
+
+/*
+ * Finds (or sets up) the transformation of 'crop' rectangle into 'pix' format,
+ * only single planar producer formats can be transformed.
+ */
+static struct v4l2_loop_xform *v4l2_loop_xform_get(struct v4l2_loop_device *dev,
+	const struct v4l2_rect *crop, const struct v4l2_pix_format *pix)
+{
+	__u32 pixelformat = dev->format.fmt.pix.pixelformat;
+	struct v4l2_loop_xform *xform = NULL;
+	int status;
+	int i;
+
+	mutex_lock(&dev->xforms_lock);
+
+	for (i = 0; i < V4L2_LOOP_MAX_XFORMS; ++i) {
+		struct v4l2_loop_xform *x = &dev->xforms[i];
+		if (x->users &&
+			!memcmp(&x->crop, crop, sizeof(*crop)) &&
+			x->pix.pixelformat == pix->pixelformat &&
+			x->pix.width == pix->width &&
+			x->pix.height == pix->height &&
+			x->pix.bytesperline == pix->bytesperline) {
+			xform = x;
+			break;
+		}
+		if (!x->users && !xform)
+			xform = x; /* first free slot */
+	}
+
+	if (!xform) {
+		xform = ERR_PTR(-EBUSY);
+	} else
+	if (!xform->users) {
+		size_t scaled_size = 0;
+
+		if (pixelformat != pix->pixelformat &&
+			(crop->width != pix->width || crop->height != pix->height))
+			scaled_size = v4l2_loop_cvt_sizeimage(pixelformat, pix->height,
+				v4l2_loop_cvt_bytesperline(pixelformat, pix->width));
+
+		status = v4l2_loop_mem_charge(dev, pix->sizeimage + scaled_size);
+		if (status) {
+			xform = ERR_PTR(status);
+			goto unlock;
+		}
+
+		xform->data = v4l2_loop_vmalloc(pix->sizeimage);
+		xform->scaled = scaled_size ? v4l2_loop_vmalloc(scaled_size) : NULL;
+		if (!xform->data || (scaled_size && !xform->scaled)) {
+			vfree(xform->data);
+			xform->data = NULL;
+			vfree(xform->scaled);
+			xform->scaled = NULL;
+			v4l2_loop_mem_uncharge(dev, pix->sizeimage + scaled_size);
+			xform = ERR_PTR(-ENOMEM);
+			goto unlock;
+		}
+		xform->scaled_size = scaled_size;
+		xform->crop = *crop;
+		xform->pix = *pix;
+		xform->frame_id = 0;
+		xform->users = 1;
+	} else
+		xform->users++;
+
+unlock:
+	mutex_unlock(&dev->xforms_lock);
+
+	return xform;
+}
+
+static void v4l2_loop_xform_put(struct v4l2_loop_xform *xform)
+{
+	struct v4l2_loop_device *dev = xform->dev;
+
+	mutex_lock(&dev->xforms_lock);
+	if (!--xform->users) {
+		v4l2_loop_mem_uncharge(dev, xform->pix.sizeimage + xform->scaled_size);
+		vfree(xform->data);
+		xform->data = NULL;
+		vfree(xform->scaled);
+		xform->scaled = NULL;
+	}
+	mutex_unlock(&dev->xforms_lock);
+}
+
+/* bytes of the frame which v4l2_loop_image_init() lays out for 'pix' */
+static u64 v4l2_loop_xform_extent(const struct v4l2_pix_format *pix)
+{
+	__u32 bytesperline = pix->bytesperline ?
+		pix->bytesperline : v4l2_loop_cvt_bytesperline(pix->pixelformat, pix->width);
+
+	return v4l2_loop_cvt_sizeimage(pix->pixelformat, pix->height, bytesperline);
+}
+
+/* transforms the producer frame (unless it was already done), must be called with 'xform->lock' held */
+static int v4l2_loop_xform_frame(struct v4l2_loop_xform *xform,
+	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf)
+{
+	struct v4l2_loop_device *dev = xform->dev;
+	const struct v4l2_pix_format *pix = &dev->format.fmt.pix;
+	const struct v4l2_rect *crop = &xform->crop;
+	u64 frame_id = v4l2_loop_src_frame_id(pbuf, cbuf);
+	unsigned long size = v4l2_loop_src_size(pbuf, cbuf, 0);
+	struct v4l2_loop_image src, dst;
+	void *vaddr;
+
+	if (xform->frame_id == frame_id)
+		return 0; /* already done for another consumer */
+
+	if (crop->left + crop->width > pix->width || crop->top + crop->height > pix->height) {
+		v4l2_loop_dbg_at1(&dev->vdev, "producer's frame size has changed\n");
+		return -EINVAL;
+	}
+
+	vaddr = v4l2_loop_src_vaddr(pbuf, cbuf, 0);
+	if (!vaddr) {
+		v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", 0);
+		return -EFAULT;
+	}
+
+	if (v4l2_loop_image_init(&src, pix->pixelformat, vaddr,
+			pix->width, pix->height, pix->bytesperline) ||
+		v4l2_loop_image_init(&dst, xform->pix.pixelformat, xform->data,
+			xform->pix.width, xform->pix.height, xform->pix.bytesperline))
+		return -EINVAL;
+
+	/* chroma of (semi)planar formats starts right after 'bytesperline' * 'height' bytes of luma */
+	if (pix->sizeimage > size ||
+		v4l2_loop_xform_extent(&dev->format.fmt.pix) > size ||
+		v4l2_loop_xform_extent(&xform->pix) > xform->pix.sizeimage)
+		return -EINVAL;
+
+	v4l2_loop_image_crop(&src, crop->left, crop->top, crop->width, crop->height);
+
+	if (src.width == dst.width && src.height == dst.height) {
+		v4l2_loop_convert(&dst, &src);
+	} else
+	if (src.pixelformat == dst.pixelformat) {
+		v4l2_loop_scale(&dst, &src);
+	} else {
+		/* downscaling first means less pixels to convert */
+		struct v4l2_loop_image scaled;
+
+		if (v4l2_loop_cvt_sizeimage(src.pixelformat, dst.height,
+				v4l2_loop_cvt_bytesperline(src.pixelformat, dst.width)) > xform->scaled_size ||
+			v4l2_loop_image_init(&scaled, src.pixelformat, xform->scaled,
+				dst.width, dst.height, 0))
+			return -EINVAL;
+
+		v4l2_loop_scale(&scaled, &src);
+		v4l2_loop_convert(&dst, &scaled);
+	}
+
+	xform->frame_id = frame_id;
+
+	return 0;
+}
+
+static int v4l2_loop_fill_user_buffer_xform(struct v4l2_loop_xform *xform,
+	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
+{
+	struct v4l2_loop_device *dev = xform->dev;
+	struct vb2_plane *csrc = &cbuf->vbuf.vb2_buf.planes[0];
+	int status;
+
+	v4l2_loop_fill_user_buffer_header(pbuf, cbuf, buffer);
+
+	mutex_lock(&xform->lock);
+
+	status = v4l2_loop_xform_frame(xform, pbuf, cbuf);
+	if (status)
+		goto unlock;
+
+	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_USERPTR) {
+		if (!csrc->m.userptr) {
+			status = -EFAULT;
+			goto unlock;
+		}
+
+		buffer->m.userptr = csrc->m.userptr;
+		buffer->length = csrc->length;
+		buffer->bytesused = min(xform->pix.sizeimage, buffer->length);
+		trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
+		if (copy_to_user((void __user *)buffer->m.userptr, xform->data, buffer->bytesused))
+			status = -EFAULT;
+		trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
+	}
+	else
+	if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_DMABUF) {
+		void *vaddr;
+
+		buffer->m.fd = csrc->m.fd;
+		vaddr = v4l2_loop_vmap_cplane(dev, csrc, 0, &buffer->length);
+		if (!vaddr) {
+			status = -EFAULT;
+			goto unlock;
+		}
+
+		buffer->bytesused = min(xform->pix.sizeimage, buffer->length);
+		trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
+		memcpy(vaddr, xform->data, buffer->bytesused);
+		trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index,
+			0, cbuf->vbuf.vb2_buf.memory, buffer->bytesused);
+	}
+	else
+		status = -EFAULT; /* MMAP consumers share producer's buffers */
+
+unlock:
+	mutex_unlock(&xform->lock);
+
+	return status;
+}
+
+static int v4l2_loop_copy_out(u8 __user *uaddr, u8 *kaddr, __u32 offset, const void *src, __u32 bytes)
+{
+	if (uaddr)
+		return copy_to_user(uaddr + offset, src, bytes) ? -EFAULT : 0;
+
+	memcpy(kaddr + offset, src, bytes);
+
+	return 0;
+}
+
+/*
+ * Gathers planes of a multi planar producer buffer into a single planar
+ * consumer's USERPTR/DMABUF buffer, in the layout of v4l2_loop_bridge_pix().
+ * Planes whose rows already have the right length are copied at once.
+ */
+static int v4l2_loop_fill_user_buffer_gather(struct v4l2_loop_device *dev,
+	struct v4l2_loop_pbuf *pbuf, struct v4l2_loop_cbuf *cbuf, struct v4l2_buffer *buffer)
+{
+	const struct v4l2_pix_format_mplane *pix_mp = &dev->format.fmt.pix_mp;
+	const struct v4l2_loop_mplane_layout *layout =
+		v4l2_loop_find_mplane_layout(pix_mp->pixelformat);
+	struct vb2_buffer *vb = &pbuf->vbuf.vb2_buf;
+	struct vb2_plane *csrc = &cbuf->vbuf.vb2_buf.planes[0];
+	enum vb2_memory memory = cbuf->vbuf.vb2_buf.memory;
+	u8 __user *uaddr = NULL;
+	u8 *kaddr = NULL;
+	__u32 offset = 0;
+	__u32 plane, row;
+	int status = 0;
+
+	v4l2_loop_fill_user_buffer_header(pbuf, cbuf, buffer);
+
+	if (!layout || !layout->splane_pixelformat ||
+		vb->num_planes != pix_mp->num_planes || vb->num_planes > ARRAY_SIZE(layout->planes) ||
+		(cbuf->image && cbuf->image->num_planes != vb->num_planes))
+		return -EINVAL;
+
+	if (memory == VB2_MEMORY_USERPTR) {
+		if (!csrc->m.userptr)
+			return -EFAULT;
+		buffer->m.userptr = csrc->m.userptr;
+		buffer->length = csrc->length;
+		uaddr = (u8 __user *)csrc->m.userptr;
+	}
+	else
+	if (memory == VB2_MEMORY_DMABUF) {
+		buffer->m.fd = csrc->m.fd;
+		kaddr = v4l2_loop_vmap_cplane(dev, csrc, 0, &buffer->length);
+		if (!kaddr)
+			return -EFAULT;
+	}
+	else
+		return -EFAULT; /* MMAP consumers cannot see more than one plane */
+
+	for (plane = 0; plane < vb->num_planes && !status; plane++) {
+		const u8 *src = v4l2_loop_src_vaddr(pbuf, cbuf, plane);
+		__u32 src_bytesperline = pix_mp->plane_fmt[plane].bytesperline;
+		__u32 dst_bytesperline = pix_mp->plane_fmt[0].bytesperline / layout->planes[plane].hsub;
+		__u32 rows = DIV_ROUND_UP(pix_mp->height, layout->planes[plane].vsub);
+		__u32 bytes = dst_bytesperline * rows;
+
+		if (!src) {
+			v4l2_loop_dbg_at1(&dev->vdev, "cannot obtain vaddr of producer plane %d\n", plane);
+			return -EFAULT;
+		}
+
+		if (offset + bytes > buffer->length ||
+			src_bytesperline * rows > v4l2_loop_src_size(pbuf, cbuf, plane))
+			return -EINVAL;
+
+		trace_v4l2_loop_copy_start(dev->vdev.minor, buffer->index, plane, memory, bytes);
+		if (src_bytesperline == dst_bytesperline) {
+			status = v4l2_loop_copy_out(uaddr, kaddr, offset, src, bytes);
+		} else {
+			for (row = 0; row < rows && !status; row++)
+				status = v4l2_loop_copy_out(uaddr, kaddr, offset + row * dst_bytesperline,
+					src + row * src_bytesperline, min(src_bytesperline, dst_bytesperline));
+		}
+		trace_v4l2_loop_copy_end(dev->vdev.minor, buffer->index, plane, memory, bytes);
+
+		offset += bytes;
+	}
+
+	buffer->bytesused = offset;
+
+	return status;
+}
+
+static void v4l2_loop_fill_vb2_buffer_mplane(struct v4l2_buffer *buffer, struct vb2_buffer *vb)
+{
+	__u32 plane;
+	__u32 num_planes = buffer->length;
+
+	for (plane = 0; plane < num_planes; ++plane) {
+		if (vb->memory == VB2_MEMORY_USERPTR) {
 			vb->planes[plane].m.userptr = buffer->m.planes[plane].m.userptr;
 			vb->planes[plane].length = buffer->m.planes[plane].length;
 		}
@@ -557,43 +1516,279 @@ static struct v4l2_loop_pbuf *v4l2_loop_pbuf(struct vb2_buffer *vb)
 	return container_of(vbuf, struct v4l2_loop_pbuf, vbuf);
 }
 
-static int v4l2_loop_buffer_is_available(struct v4l2_loop_device *dev)
+/* Is a frame queued at 'queued_ns' needed to meet consumer's frame rate? */
+static bool v4l2_loop_frame_is_due(struct v4l2_loop_consumer_handle *c, u64 queued_ns)
+{
+	return !c->frame_interval_ns || queued_ns >= c->next_frame_ns;
+}
+
+/* Is a frame queued at 'queued_ns' young enough for the consumer? */
+static bool v4l2_loop_frame_is_fresh(struct v4l2_loop_consumer_handle *c, u64 queued_ns)
+{
+	return !c->max_age_ns || ktime_get_ns() - queued_ns <= c->max_age_ns;
+}
+
+static void v4l2_loop_frame_delivered(struct v4l2_loop_consumer_handle *c, u64 queued_ns)
+{
+	if (!c->frame_interval_ns)
+		return;
+
+	/* keep the grid, so frame rate does not drift due to producer's jitter */
+	c->next_frame_ns += c->frame_interval_ns;
+	if (c->next_frame_ns <= queued_ns) /* first frame or consumer fell behind */
+		c->next_frame_ns = queued_ns + c->frame_interval_ns;
+}
+
+/* keeps running average of intervals between frames (weight of the newest one: 1/8) */
+static void v4l2_loop_stats_frame(u64 *frame_interval_ns, u64 *last_frame_ns, u64 now_ns)
+{
+	u64 last_ns = *last_frame_ns;
+
+	if (last_ns && now_ns > last_ns) {
+		u64 interval_ns = now_ns - last_ns;
+		u64 average_ns = READ_ONCE(*frame_interval_ns);
+
+		WRITE_ONCE(*frame_interval_ns,
+			average_ns ? (average_ns * 7 + interval_ns) / 8 : interval_ns);
+	}
+
+	*last_frame_ns = now_ns;
+}
+
+static void v4l2_loop_stats_delivered(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, unsigned int memory, __u32 bytes, bool placeholder)
+{
+	atomic64_inc(placeholder ? &dev->stats.placeholders : &dev->stats.frames_delivered);
+
+	if (memory == VB2_MEMORY_MMAP)
+		atomic64_add(bytes, &dev->stats.bytes_mmap);
+	else
+	if (memory == VB2_MEMORY_USERPTR)
+		atomic64_add(bytes, &dev->stats.bytes_userptr);
+	else
+	if (memory == VB2_MEMORY_DMABUF)
+		atomic64_add(bytes, &dev->stats.bytes_dmabuf);
+
+	WRITE_ONCE(c->stats.frames, c->stats.frames + 1);
+	WRITE_ONCE(c->stats.bytes, c->stats.bytes + bytes);
+	v4l2_loop_stats_frame(&c->stats.frame_interval_ns, &c->stats.last_frame_ns, ktime_get_ns());
+}
+
+/*
+ * Picks the frame to be delivered to the consumer: the oldest one waiting
+ * queued by the producer, the last frame for a consumer which has just
+ * started streaming or, when producer stalled, a placeholder (last frame)
+ * which was not yet delivered to this consumer in the current timeout
+ * period. Frames which are not needed to
+ * meet consumer's frame rate or are older than its 'max_age_ns' are skipped
+ * (they are left waiting for other consumers), unless the device is lossless.
+ * Must be called with 'queued_bufs_lock' held.
+ */
+static struct v4l2_loop_pbuf *v4l2_loop_next_pbuf(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, bool *placeholder)
+{
+	bool lossless = READ_ONCE(dev->drop_policy) == V4L2_LOOP_DROP_NONE;
+
+	if (!list_empty(&dev->queued_bufs)) {
+		struct v4l2_loop_pbuf *pbuf =
+			list_first_entry(&dev->queued_bufs, struct v4l2_loop_pbuf, pnode);
+
+		/* without dropping, frames cannot be skipped (max age and frame rate do not apply) */
+		if (lossless || (v4l2_loop_frame_is_fresh(c, pbuf->queued_ns) &&
+			v4l2_loop_frame_is_due(c, pbuf->queued_ns))) {
+			*placeholder = false;
+			return pbuf;
+		}
+	}
+
+	/* joining consumer does not have to wait for the producer's next frame */
+	if (c->joining && dev->last_pbuf && !dev->stalled &&
+		v4l2_loop_frame_is_fresh(c, dev->last_pbuf->queued_ns)) {
+		*placeholder = false;
+		return dev->last_pbuf;
+	}
+
+	if (dev->stalled && dev->last_pbuf && c->stall_count != dev->stall_count &&
+		v4l2_loop_frame_is_due(c, ktime_get_ns())) {
+		*placeholder = true;
+		return dev->last_pbuf;
+	}
+
+	return NULL;
+}
+
+/* Is there anything to be dequeued by the consumer? */
+static int v4l2_loop_frame_is_available(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c)
 {
 	unsigned long flags;
+	bool placeholder;
 	int available;
 
 	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
-	available = !list_empty(&dev->queued_bufs);
+	available = v4l2_loop_next_pbuf(dev, c, &placeholder) != NULL;
 	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
 
 	return available;
 }
 
+/*
+ * Time after which a silent producer is considered stalled (and then
+ * the period of placeholders), with 'sustain_framerate' it is the
+ * producer's frame interval (if the producer has set its frame rate).
+ */
+static unsigned int v4l2_loop_timeout_ms(struct v4l2_loop_device *dev)
+{
+	if (READ_ONCE(dev->sustain_framerate)) {
+		struct v4l2_fract timeperframe = dev->outputparm.timeperframe;
+
+		if (timeperframe.numerator && timeperframe.denominator)
+			return max(1U, (unsigned int)div_u64((u64)timeperframe.numerator * MSEC_PER_SEC,
+				timeperframe.denominator));
+	}
+
+	return READ_ONCE(dev->timeout_ms);
+}
+
+/* must be called with 'queued_bufs_lock' held */
+static void v4l2_loop_set_last_pbuf(struct v4l2_loop_device *dev, struct v4l2_loop_pbuf *pbuf)
+{
+	struct v4l2_loop_pbuf *last = dev->last_pbuf;
+
+	if (pbuf)
+		v4l2_loop_pbuf_get(pbuf);
+
+	dev->last_pbuf = pbuf;
+
+	if (last)
+		v4l2_loop_pbuf_put(last, VB2_BUF_STATE_DONE);
+}
+
+/*
+ * Producer buffers dequeued by consumers have to be given back
+ * before vb2 stops streaming, so take them away from all consumers.
+ */
+static void v4l2_loop_release_consumers_pbufs(struct v4l2_loop_device *dev)
+{
+	struct v4l2_fh *fh;
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->vdev.fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev.fh_list, list) {
+		struct v4l2_loop_handle *h =
+			container_of(fh, struct v4l2_loop_handle, fh);
+		__u32 i;
+
+		if (h->htype != V4L2_LOOP_HANDLE_CONSUMER || !h->c.bufs)
+			continue;
+
+		for (i = 0; i < h->c.buffers; i++)
+			v4l2_loop_cbuf_release_pbuf(&h->c.bufs[i], VB2_BUF_STATE_ERROR);
+	}
+	spin_unlock_irqrestore(&dev->vdev.fh_lock, flags);
+}
+
+static void v4l2_loop_queue_stall_event(struct v4l2_loop_device *dev, bool stalled)
+{
+	struct v4l2_event event = {
+		.type = V4L2_LOOP_EVENT_STALL,
+	};
+	struct v4l2_loop_event_stall *stall =
+		(struct v4l2_loop_event_stall *)event.u.data;
+
+	BUILD_BUG_ON(sizeof(*stall) > sizeof(event.u.data));
+
+	stall->stalled = stalled;
+	stall->timeout_ms = v4l2_loop_timeout_ms(dev);
+	stall->sequence = READ_ONCE(dev->sequence);
+
+	v4l2_event_queue(&dev->vdev, &event);
+}
+
+/*
+ * Tells all subscribers that producer's frames have changed their size
+ * or layout, so buffers allocated for the old format should be released
+ * and allocated again.
+ */
+static void v4l2_loop_queue_source_change_event(struct v4l2_loop_device *dev)
+{
+	struct v4l2_event event = {
+		.type = V4L2_EVENT_SOURCE_CHANGE,
+		.u.src_change.changes = V4L2_EVENT_SRC_CH_RESOLUTION,
+	};
+
+	v4l2_event_queue(&dev->vdev, &event);
+}
+
+/* (re)arms the stall detection, called whenever producer shows a sign of life */
+static void v4l2_loop_stall_watchdog_kick(struct v4l2_loop_device *dev)
+{
+	unsigned int timeout_ms = v4l2_loop_timeout_ms(dev);
+
+	if (timeout_ms)
+		mod_delayed_work(system_wq, &dev->stall_work, msecs_to_jiffies(timeout_ms));
+	else
+		cancel_delayed_work(&dev->stall_work);
+}
+
+/*
+ * Runs when the producer has not queued any frame within 'timeout_ms'.
+ * On the first run the stall is signalled with V4L2_LOOP_EVENT_STALL.
+ * On every run each consumer is allowed to dequeue one placeholder
+ * (the last frame or 'timeout_image', see v4l2_loop_take_pbuf()),
+ * so consumers are fed at the rate of one frame per 'timeout_ms'.
+ */
+static void v4l2_loop_stall_work(struct work_struct *work)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_delayed_work(work), struct v4l2_loop_device, stall_work);
+	unsigned long flags;
+	unsigned sequence;
+	unsigned int timeout_ms;
+	bool stalled;
+
+	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
+	stalled = dev->stalled;
+	sequence = dev->sequence;
+	dev->stalled = true;
+	dev->stall_count++;
+	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
+
+	if (!stalled) {
+		v4l2_loop_dbg_at1(&dev->vdev, "%s producer stalled (sequence: %u)\n",
+			video_device_node_name(&dev->vdev), sequence);
+		v4l2_loop_queue_stall_event(dev, true);
+	}
+
+	wake_up_all(&dev->waiting_consumers);
+
+	timeout_ms = v4l2_loop_timeout_ms(dev);
+	if (timeout_ms)
+		schedule_delayed_work(&dev->stall_work, msecs_to_jiffies(timeout_ms));
+}
+
 static int v4l2_loop_validate_buffer_types(struct v4l2_loop_device *dev, enum v4l2_buf_type type)
 {
 	if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE &&
 		type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
-		v4l2_loop_dbg_at1("unsuported buffer type\n");
+		v4l2_loop_dbg_at1(&dev->vdev, "unsuported buffer type\n");
 		return -EINVAL;
 	}
 
 	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("format is not yet set by the producer\n");
+		v4l2_loop_dbg_at2(&dev->vdev, "format is not yet set by the producer\n");
 		return -EINVAL;
 	}
 
 	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
-		/* producer uses single planar format */
-		if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE) {
-			v4l2_loop_dbg_at1("incompatible buffer types "
-				"(producer: single planar, consumer: multi planar)\n");
-			return -EINVAL;
-		}
+		/* producer uses single planar format, multi planar consumers see it as one plane */
 	} else
 	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
-		/* producer uses multi planar format */
-		if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
-			v4l2_loop_dbg_at1("incompatible buffer types "
+		/* producer uses multi planar format, single planar consumers need its equivalent */
+		struct v4l2_pix_format pix;
+
+		if (type != V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE && v4l2_loop_bridge_pix(dev, &pix)) {
+			v4l2_loop_dbg_at1(&dev->vdev, "incompatible buffer types "
 				"(producer: multi planar, consumer: single planar)\n");
 			return -EINVAL;
 		}
@@ -607,20 +1802,23 @@ static int v4l2_loop_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers,
 	unsigned int *nplanes, unsigned int sizes[], struct device *alloc_devs[])
 {
 	struct v4l2_loop_device *dev = vb2_get_drv_priv(vq);
+	int i;
 
 	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("format is not yet set by the producer\n");
+		v4l2_loop_dbg_at2(&dev->vdev, "format is not yet set by the producer\n");
 		*nbuffers = 0;
 		*nplanes = 0;
 		return -EINVAL;
 	}
 
-	v4l2_loop_print_format(&dev->format);
+	v4l2_loop_print_format(&dev->vdev, &dev->format);
 
-	if (vq->num_buffers + *nbuffers < v4l2_loop_buffers)
-		*nbuffers = v4l2_loop_buffers - vq->num_buffers;
+	vq->min_buffers_needed = dev->buffers;
+	if (vq->num_buffers + *nbuffers < dev->buffers)
+		*nbuffers = dev->buffers - vq->num_buffers;
+	if (vq->num_buffers + *nbuffers > dev->max_buffers)
+		*nbuffers = dev->max_buffers > vq->num_buffers ? dev->max_buffers - vq->num_buffers : 0;
 	if (V4L2_TYPE_IS_MULTIPLANAR(dev->format.type)) {
-		int i;
 		*nplanes = dev->format.fmt.pix_mp.num_planes;
 		for (i = 0; i < *nplanes; ++i)
 			sizes[i] = PAGE_ALIGN(dev->format.fmt.pix_mp.plane_fmt[i].sizeimage);
@@ -629,7 +1827,36 @@ static int v4l2_loop_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers,
 		sizes[0] = PAGE_ALIGN(dev->format.fmt.pix.sizeimage);
 	}
 
-	v4l2_loop_dbg_at2("%s(%s) nbuffers: %u, nplanes: %u\n",
+	/* MMAP buffers are allocated by the driver, so they have to fit into memory limits */
+	if (vq->memory == VB2_MEMORY_MMAP) {
+		s64 available = v4l2_loop_mem_available(dev);
+		size_t size = 0;
+
+		for (i = 0; i < *nplanes; ++i)
+			size += sizes[i];
+
+		/* offsets of MMAP buffers (given by vb2) stay below the placeholder image's one */
+		available = min_t(s64, available,
+			max_t(s64, 0, V4L2_LOOP_PLACEHOLDER_OFFSET - (s64)size * vq->num_buffers));
+
+		if (size && (s64)size * *nbuffers > available) {
+			unsigned int fit = div64_s64(available, size);
+
+			if (vq->num_buffers + fit < dev->buffers) {
+				pr_warn_ratelimited("%s: %u buffers of %zu bytes exceed memory limit "
+					"(device: %u MiB, all devices: %u MiB)\n",
+					video_device_node_name(&dev->vdev), dev->buffers - vq->num_buffers,
+					size, READ_ONCE(dev->max_memory), READ_ONCE(v4l2_loop_max_memory));
+				*nbuffers = 0;
+				*nplanes = 0;
+				return -ENOMEM;
+			}
+
+			*nbuffers = fit;
+		}
+	}
+
+	v4l2_loop_dbg_at2(&dev->vdev, "%s(%s) nbuffers: %u, nplanes: %u\n",
 		__func__, video_device_node_name(&dev->vdev), *nbuffers, *nplanes);
 
 	return 0;
@@ -637,7 +1864,89 @@ static int v4l2_loop_queue_setup(struct vb2_queue *vq, unsigned int *nbuffers,
 
 static int v4l2_loop_queue_buf_init(struct vb2_buffer *vb)
 {
-	return 0;
+	struct v4l2_loop_device *dev = vb2_get_drv_priv(vb->vb2_queue);
+	struct v4l2_loop_pbuf *pbuf = v4l2_loop_pbuf(vb);
+	size_t size = 0;
+	__u32 plane;
+	int status;
+
+	if (vb->memory != VB2_MEMORY_MMAP || pbuf->charged) /* not allocated by us */
+		return 0;
+
+	for (plane = 0; plane < vb->num_planes; plane++)
+		size += vb2_plane_size(vb, plane);
+
+	status = v4l2_loop_mem_charge(dev, size);
+	if (status)
+		return status;
+
+	pbuf->charged = size;
+
+	return 0;
+}
+
+static void v4l2_loop_queue_buf_cleanup(struct vb2_buffer *vb)
+{
+	struct v4l2_loop_device *dev = vb2_get_drv_priv(vb->vb2_queue);
+	struct v4l2_loop_pbuf *pbuf = v4l2_loop_pbuf(vb);
+
+	v4l2_loop_mem_uncharge(dev, pbuf->charged);
+	pbuf->charged = 0;
+}
+
+/*
+ * Gives back producer buffers which were replaced by a newer frame before
+ * any consumer took them. 'list' holds them (linked by 'pnode') and must
+ * not be reachable from the device any more.
+ */
+static void v4l2_loop_drop_pbufs(struct v4l2_loop_device *dev, struct list_head *list)
+{
+	struct v4l2_loop_pbuf *pbuf;
+
+	list_for_each_entry(pbuf, list, pnode) {
+		trace_v4l2_loop_buf_drop(dev->vdev.minor,
+			pbuf->vbuf.vb2_buf.index, pbuf->vbuf.sequence,
+			v4l2_loop_vb2_bytesused(&pbuf->vbuf.vb2_buf));
+		atomic64_inc(&dev->stats.frames_dropped);
+		v4l2_loop_pbuf_put(pbuf, VB2_BUF_STATE_ERROR);
+	}
+}
+
+/*
+ * Puts a new frame on 'queued_bufs' according to device's drop policy,
+ * frames to be dropped are moved to 'list' (and dropped afterwards,
+ * outside of the lock):
+ * - V4L2_LOOP_DROP_OLDEST - only the newest frame is kept, older ones
+ *   (not yet taken by any consumer) are dropped,
+ * - V4L2_LOOP_DROP_NEWEST - the new frame is dropped if an older one
+ *   is still waiting for consumers,
+ * - V4L2_LOOP_DROP_NONE - all frames are kept (and delivered in order),
+ *   so once all its buffers are queued the producer blocks in DQBUF
+ *   (or poll) until consumers give one back.
+ * Must be called with 'queued_bufs_lock' held.
+ */
+static void v4l2_loop_queue_pbuf(struct v4l2_loop_device *dev,
+	struct v4l2_loop_pbuf *pbuf, struct list_head *list)
+{
+	switch (READ_ONCE(dev->drop_policy)) {
+	case V4L2_LOOP_DROP_NEWEST:
+		INIT_LIST_HEAD(list);
+		if (list_empty(&dev->queued_bufs))
+			list_add_tail(&pbuf->pnode, &dev->queued_bufs);
+		else
+			list_add_tail(&pbuf->pnode, list);
+		break;
+
+	case V4L2_LOOP_DROP_NONE:
+		INIT_LIST_HEAD(list);
+		list_add_tail(&pbuf->pnode, &dev->queued_bufs);
+		break;
+
+	default:
+		list_replace_init(&dev->queued_bufs, list);
+		list_add_tail(&pbuf->pnode, &dev->queued_bufs);
+		break;
+	}
 }
 
 static void v4l2_loop_queue_buf_queue(struct vb2_buffer *vb)
@@ -646,19 +1955,40 @@ static void v4l2_loop_queue_buf_queue(struct vb2_buffer *vb)
 	struct v4l2_loop_pbuf *pbuf = v4l2_loop_pbuf(vb);
 	unsigned long flags;
 	struct list_head list;
+	bool resumed;
+
+	/* not a frame, see v4l2_loop_detach_producer_bufs() */
+	if (dev->detaching) {
+		vb2_buffer_done(vb, VB2_BUF_STATE_ERROR);
+		return;
+	}
+
+	refcount_set(&pbuf->refs, 1); /* held by 'queued_bufs' */
+	pbuf->queued_ns = ktime_get_ns();
+	pbuf->frame_id = atomic64_inc_return(&dev->frame_ids);
+	pbuf->vbuf.sequence = dev->sequence++;
+
+	atomic64_inc(&dev->stats.frames_queued);
+	v4l2_loop_stats_frame(&dev->stats.frame_interval_ns, &dev->stats.last_frame_ns,
+		pbuf->queued_ns);
 
 	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
-	list_replace_init(&dev->queued_bufs, &list);
-	list_add_tail(&pbuf->pnode, &dev->queued_bufs);
+	v4l2_loop_queue_pbuf(dev, pbuf, &list);
+	resumed = dev->stalled;
+	dev->stalled = false;
 	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
 
-	wake_up_all(&dev->waiting_consumers);
+	v4l2_loop_stall_watchdog_kick(dev);
 
-	if (!list_empty(&list)) {
-		list_for_each_entry(pbuf, &list, pnode) {
-			vb2_buffer_done(&pbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
-		}
+	if (resumed) {
+		v4l2_loop_dbg_at1(&dev->vdev, "%s producer resumed (sequence: %u)\n",
+			video_device_node_name(&dev->vdev), pbuf->vbuf.sequence);
+		v4l2_loop_queue_stall_event(dev, false);
 	}
+
+	wake_up_all(&dev->waiting_consumers);
+
+	v4l2_loop_drop_pbufs(dev, &list);
 }
 
 static int v4l2_loop_queue_start_streaming(struct vb2_queue *vq, unsigned int i)
@@ -666,6 +1996,9 @@ static int v4l2_loop_queue_start_streaming(struct vb2_queue *vq, unsigned int i)
 	struct v4l2_loop_device *dev = vb2_get_drv_priv(vq);
 
 	dev->sequence = 0;
+	dev->stats.last_frame_ns = 0;
+
+	v4l2_loop_stall_watchdog_kick(dev);
 
 	return 0;
 }
@@ -675,13 +2008,19 @@ static void v4l2_loop_queue_stop_streaming(struct vb2_queue *vq)
 	struct v4l2_loop_device *dev = vb2_get_drv_priv(vq);
 	unsigned long flags;
 
+	cancel_delayed_work_sync(&dev->stall_work);
+
 	spin_lock_irqsave(&dev->queued_bufs_lock, flags); {
 		struct v4l2_loop_pbuf *pbuf;
 		list_for_each_entry(pbuf, &dev->queued_bufs, pnode)
-			vb2_buffer_done(&pbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+			v4l2_loop_pbuf_put(pbuf, VB2_BUF_STATE_ERROR);
 		INIT_LIST_HEAD(&dev->queued_bufs);
+		v4l2_loop_set_last_pbuf(dev, NULL);
+		dev->stalled = false;
 	} spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
 
+	v4l2_loop_release_consumers_pbufs(dev);
+
 	wake_up_all(&dev->waiting_consumers);
 }
 
@@ -698,6 +2037,7 @@ static void v4l2_loop_queue_wait_finish(struct vb2_queue *vq)
 static const struct vb2_ops v4l2_loop_vb2_ops = {
 	.queue_setup       = v4l2_loop_queue_setup,
 	.buf_init          = v4l2_loop_queue_buf_init,
+	.buf_cleanup       = v4l2_loop_queue_buf_cleanup,
 	.buf_queue         = v4l2_loop_queue_buf_queue,
 	.start_streaming   = v4l2_loop_queue_start_streaming,
 	.stop_streaming    = v4l2_loop_queue_stop_streaming,
@@ -705,14 +2045,108 @@ static const struct vb2_ops v4l2_loop_vb2_ops = {
 	.wait_finish       = v4l2_loop_queue_wait_finish
 };
 
+/* forgets producer's format (and frame rate), unless it is to be kept */
+static void v4l2_loop_reset_producer_format(struct v4l2_loop_device *dev)
+{
+	if (READ_ONCE(dev->keep_format))
+		return;
+
+	/* buffers of a closed producer are still there (they were kept) */
+	if (vb2_is_busy(&dev->vb_queue))
+		return;
+
+	/* the in-kernel source is the producer, whoever else closes the device */
+	if (READ_ONCE(dev->source.pattern) != V4L2_LOOP_SOURCE_OFF)
+		return;
+
+	memset(&dev->format, 0, sizeof(dev->format));
+	dev->fmtdesc = NULL;
+	memset(&dev->outputparm, 0, sizeof(dev->outputparm));
+}
+
+/*
+ * Producer buffers which stay with the queue when their producer is gone
+ * are detached: nobody owns them, so they are busy for everyone (see
+ * v4l2_loop_queue_is_busy()) until the next producer takes them over
+ * with VIDIOC_REQBUFS.
+ */
+static bool v4l2_loop_queue_is_detached(struct vb2_queue *vq)
+{
+	return !vq->owner && vb2_is_busy(vq);
+}
+
+/* the output queue can only be used by its owner */
+static bool v4l2_loop_queue_is_busy(struct vb2_queue *vq, struct file *file)
+{
+	if (v4l2_loop_queue_is_detached(vq))
+		return true;
+
+	return vq->owner && vq->owner != file->private_data;
+}
+
+static void v4l2_loop_source_buffer(struct v4l2_loop_device *dev, struct v4l2_buffer *buffer,
+	struct v4l2_plane *planes, __u32 index);
+
+/*
+ * Queues buffers the closing producer has dequeued and not queued back,
+ * they are given back at once (with V4L2_BUF_FLAG_ERROR) instead of being
+ * delivered, so the next producer gets every buffer through VIDIOC_DQBUF.
+ * Must be called with 'vb_queue_lock' held.
+ */
+static int v4l2_loop_detach_producer_bufs(struct v4l2_loop_device *dev)
+{
+	struct vb2_queue *vq = &dev->vb_queue;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	unsigned int i;
+	int status = 0;
+
+	dev->detaching = true;
+	for (i = 0; i < vq->num_buffers && !status; i++) {
+		if (vq->bufs[i]->state != VB2_BUF_STATE_DEQUEUED)
+			continue;
+
+		v4l2_loop_source_buffer(dev, &buffer, planes, i);
+		status = vb2_qbuf(vq, dev->v4l2_dev.mdev, &buffer);
+	}
+	dev->detaching = false;
+
+	return status;
+}
+
+/*
+ * Only the producer which owns the queue gives it up when closing. With
+ * 'keep_format' its (MMAP) buffers stay streaming, together with frames
+ * waiting for consumers and the last frame, so consumers do not notice
+ * (apart from a stall) and the next producer takes them over. Otherwise
+ * the queue is released and consumers' DQBUF fails. USERPTR and DMABUF
+ * buffers are never kept, their memory belongs to the producer.
+ */
+static void v4l2_loop_close_producer(struct v4l2_loop_device *dev, struct file *file)
+{
+	struct vb2_queue *vq = &dev->vb_queue;
+
+	mutex_lock(&dev->vb_queue_lock);
+	if (vq->owner == file->private_data) {
+		vq->owner = NULL;
+		if (!READ_ONCE(dev->keep_format) || !vb2_is_streaming(vq) ||
+			vq->memory != VB2_MEMORY_MMAP ||
+			v4l2_loop_detach_producer_bufs(dev))
+			vb2_queue_release(vq);
+	}
+	if (!vq->owner)
+		v4l2_loop_reset_producer_format(dev);
+	mutex_unlock(&dev->vb_queue_lock);
+}
+
 static int v4l2_loop_open(struct file *file)
 {
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_handle *h;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
-	h = kzalloc(sizeof(*h), GFP_KERNEL);
+	h = kzalloc(sizeof(*h), GFP_KERNEL_ACCOUNT);
 	if (h == NULL) {
 		file->private_data = NULL;
 		return -ENOMEM;
@@ -735,18 +2169,17 @@ static int v4l2_loop_close(struct file *file)
 		container_of(vdev, struct v4l2_loop_device, vdev);
 	struct v4l2_loop_handle *h;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	h = container_of(file->private_data, struct v4l2_loop_handle, fh);
 
-	if (h->htype == V4L2_LOOP_HANDLE_PRODUCER) {
-		memset(&dev->format, 0, sizeof(dev->format));
-		memset(&dev->captureparm, 0, sizeof(dev->captureparm));
-		memset(&dev->outputparm, 0, sizeof(dev->outputparm));
-	}
+	if (h->htype == V4L2_LOOP_HANDLE_PRODUCER)
+		v4l2_loop_close_producer(dev, file);
 	else
 	if (h->htype == V4L2_LOOP_HANDLE_CONSUMER) {
+		mutex_lock(&dev->vb_queue_lock);
 		v4l2_loop_release_cbufs(&h->c);
+		mutex_unlock(&dev->vb_queue_lock);
 	}
 	else {
 		/* do nothing */
@@ -765,7 +2198,7 @@ static ssize_t v4l2_loop_read(struct file *file, char __user *buf, size_t count,
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	return -ENOSYS; /* not implemented yet */;
 }
@@ -774,7 +2207,7 @@ static ssize_t v4l2_loop_write(struct file *file, const char __user *buf, size_t
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	return -ENOSYS; /* not implemented yet */;
 }
@@ -789,7 +2222,7 @@ static __poll_t v4l2_loop_poll(struct file *file, struct poll_table_struct *poll
 	__poll_t events = poll_requested_events(poll);
 	__poll_t revents = EPOLLERR; /* returned events */
 
-	v4l2_loop_dbg_at3("%s(%s, %s) events: 0x%08x\n",
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s) events: 0x%08x\n",
 		__func__, video_device_node_name(vdev), v4l2_loop_handle_name(h), events);
 
 	if (h->htype == V4L2_LOOP_HANDLE_PRODUCER) {
@@ -812,24 +2245,94 @@ static __poll_t v4l2_loop_poll(struct file *file, struct poll_table_struct *poll
 	} else
 	if (h->htype == V4L2_LOOP_HANDLE_CONSUMER) {
 		poll_wait(file, &dev->waiting_consumers, poll);
+		poll_wait(file, &h->fh.wait, poll);
+
+		revents = v4l2_event_pending(&h->fh) ? EPOLLPRI : 0;
 
 		if (!(events & (EPOLLIN | EPOLLRDNORM)))
-			return 0;
+			return revents;
 
 		if (!vdev->queue->streaming || vdev->queue->error)
-			return EPOLLERR;
+			return revents | EPOLLERR;
 
-		if (v4l2_loop_buffer_is_available(dev))
-			return (EPOLLIN | EPOLLRDNORM);
+		if (v4l2_loop_frame_is_available(dev, &h->c))
+			revents |= (EPOLLIN | EPOLLRDNORM);
+	}
+	else {
+		/* handle which has not requested any buffers can still wait for events */
+		poll_wait(file, &h->fh.wait, poll);
 
-		revents = 0;
+		if (v4l2_event_pending(&h->fh))
+			revents = EPOLLPRI;
+		else
+		if (!(events & (EPOLLIN | EPOLLRDNORM | EPOLLOUT | EPOLLWRNORM)))
+			revents = 0;
 	}
-	else
-		; /* do nothing */
 
 	return revents;
 }
 
+/* a mapping of the placeholder image keeps it, even if 'timeout_image' is replaced */
+static void v4l2_loop_placeholder_vm_open(struct vm_area_struct *vma)
+{
+	struct v4l2_loop_placeholder *ph = vma->vm_private_data;
+
+	kref_get(&ph->refs);
+}
+
+static void v4l2_loop_placeholder_vm_close(struct vm_area_struct *vma)
+{
+	v4l2_loop_placeholder_put(vma->vm_private_data);
+}
+
+static const struct vm_operations_struct v4l2_loop_placeholder_vm_ops = {
+	.open	= v4l2_loop_placeholder_vm_open,
+	.close	= v4l2_loop_placeholder_vm_close
+};
+
+/*
+ * Producer buffers are mapped by vb2, the placeholder image (see
+ * V4L2_LOOP_PLACEHOLDER_OFFSET) by the driver.
+ */
+static int v4l2_loop_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	unsigned long pgoff = V4L2_LOOP_PLACEHOLDER_OFFSET >> PAGE_SHIFT;
+	unsigned long size = vma->vm_end - vma->vm_start;
+	struct v4l2_loop_placeholder *ph;
+	int status;
+
+	if (vma->vm_pgoff < pgoff)
+		return vb2_fop_mmap(file, vma);
+
+	pgoff = vma->vm_pgoff - pgoff;
+
+	mutex_lock(&dev->timeout_image_lock);
+
+	ph = dev->placeholder;
+	if (!ph || (pgoff << PAGE_SHIFT) + size > ph->alloc) {
+		v4l2_loop_dbg_at1(vdev, "%s(%s) no placeholder image at offset 0x%lx\n",
+			__func__, video_device_node_name(vdev), vma->vm_pgoff << PAGE_SHIFT);
+		status = -EINVAL;
+		goto unlock;
+	}
+
+	status = remap_vmalloc_range(vma, ph->data, pgoff);
+	if (status)
+		goto unlock;
+
+	kref_get(&ph->refs);
+	vma->vm_private_data = ph;
+	vma->vm_ops = &v4l2_loop_placeholder_vm_ops;
+
+unlock:
+	mutex_unlock(&dev->timeout_image_lock);
+
+	return status;
+}
+
 static const struct v4l2_file_operations v4l2_loop_fops = {
 	.owner		= THIS_MODULE,
 	.open		= v4l2_loop_open,
@@ -837,7 +2340,7 @@ static const struct v4l2_file_operations v4l2_loop_fops = {
 	.read		= v4l2_loop_read,
 	.write		= v4l2_loop_write,
 	.poll		= v4l2_loop_poll,
-	.mmap		= vb2_fop_mmap,
+	.mmap		= v4l2_loop_mmap,
 	.unlocked_ioctl	= video_ioctl2
 };
 
@@ -845,7 +2348,7 @@ static int v4l2_loop_querycap(struct file *file, void *priv, struct v4l2_capabil
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	strscpy(capability->driver, KBUILD_MODNAME, sizeof(capability->driver));
 	strscpy(capability->card, vdev->name, sizeof(capability->card));
@@ -860,7 +2363,7 @@ static int v4l2_loop_enum_framesizes(struct file *file, void *fh, struct v4l2_fr
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (frmsizeenum->index > 0)
 		return -EINVAL;
@@ -875,14 +2378,14 @@ static int v4l2_loop_enum_framesizes(struct file *file, void *fh, struct v4l2_fr
 	} else { /* format is not negotiated yet, allow for wide range of resolutions */
 		frmsizeenum->type = V4L2_FRMSIZE_TYPE_CONTINUOUS;
 		frmsizeenum->stepwise.min_width = V4L2_LOOP_DEFAULT_FRMSIZE_MIN_WIDTH;
-		frmsizeenum->stepwise.max_width = V4L2_LOOP_DEFAULT_FRMSIZE_MAX_WIDTH;
+		frmsizeenum->stepwise.max_width = dev->max_width;
 		frmsizeenum->stepwise.step_width = 1;
 		frmsizeenum->stepwise.min_height = V4L2_LOOP_DEFAULT_FRMSIZE_MIN_HEIGHT;
-		frmsizeenum->stepwise.max_height = V4L2_LOOP_DEFAULT_FRMSIZE_MAX_HEIGHT;
+		frmsizeenum->stepwise.max_height = dev->max_height;
 		frmsizeenum->stepwise.step_height = 1;
 	}
 
-	v4l2_loop_print_frmsizeenum(frmsizeenum);
+	v4l2_loop_print_frmsizeenum(vdev, frmsizeenum);
 
 	return 0;
 }
@@ -893,7 +2396,7 @@ static int v4l2_loop_enum_frameintervals(struct file *file, void *fh, struct v4l
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (frmivalenum->index > 0)
 		return -EINVAL;
@@ -908,19 +2411,30 @@ static int v4l2_loop_enum_frameintervals(struct file *file, void *fh, struct v4l
 		if (frmivalenum->height != dev->format.fmt.pix.height)
 			return -EINVAL;
 
-		frmivalenum->type = V4L2_FRMIVAL_TYPE_DISCRETE;
-		frmivalenum->discrete = dev->captureparm.timeperframe;
+		/* consumers can request any frame rate up to the producer's one */
+		frmivalenum->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
+		if (dev->outputparm.timeperframe.numerator &&
+			dev->outputparm.timeperframe.denominator)
+			frmivalenum->stepwise.min = dev->outputparm.timeperframe;
+		else {
+			frmivalenum->stepwise.min.numerator = 1;
+			frmivalenum->stepwise.min.denominator = dev->max_fps;
+		}
+		frmivalenum->stepwise.max.numerator = 1;
+		frmivalenum->stepwise.max.denominator = V4L2_LOOP_DEFAULT_FPS_MIN;
+		frmivalenum->stepwise.step.numerator = 1;
+		frmivalenum->stepwise.step.denominator = V4L2_LOOP_DEFAULT_FPS_MAX;
 	} else { /* format is not negotiated yet, allow for wide range of frame intervals */
 		frmivalenum->type = V4L2_FRMIVAL_TYPE_CONTINUOUS;
 		frmivalenum->stepwise.min.numerator = 1;
-		frmivalenum->stepwise.min.denominator = V4L2_LOOP_DEFAULT_FPS_MAX;
+		frmivalenum->stepwise.min.denominator = dev->max_fps;
 		frmivalenum->stepwise.max.numerator = 1;
 		frmivalenum->stepwise.max.denominator = V4L2_LOOP_DEFAULT_FPS_MIN;
 		frmivalenum->stepwise.step.numerator = 1;
 		frmivalenum->stepwise.step.denominator = V4L2_LOOP_DEFAULT_FPS_MAX;
 	}
 
-	v4l2_loop_print_frmivalenum(frmivalenum);
+	v4l2_loop_print_frmivalenum(vdev, frmivalenum);
 
 	return 0;
 }
@@ -930,7 +2444,7 @@ static int v4l2_loop_enum_output(struct file *file, void *fh, struct v4l2_output
 	struct video_device *vdev = video_devdata(file);
 	__u32 index = output->index;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 
 	if (V4L2_LOOP_ACTIVE_OUTPUT != index)
@@ -948,7 +2462,7 @@ static int v4l2_loop_g_output(struct file *file, void *fh, unsigned int *i)
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (i)
 		*i = V4L2_LOOP_ACTIVE_OUTPUT;
@@ -960,7 +2474,7 @@ static int v4l2_loop_s_output(struct file *file, void *fh, unsigned int i)
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (i != V4L2_LOOP_ACTIVE_OUTPUT)
 		return -EINVAL;
@@ -973,7 +2487,7 @@ static int v4l2_loop_enum_input(struct file *file, void *fh, struct v4l2_input *
 	struct video_device *vdev = video_devdata(file);
 	__u32 index = input->index;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (V4L2_LOOP_ACTIVE_INPUT != index)
 		return -EINVAL;
@@ -990,7 +2504,7 @@ static int v4l2_loop_g_input(struct file *file, void *fh, unsigned int *i)
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (i)
 		*i = V4L2_LOOP_ACTIVE_INPUT;
@@ -1002,7 +2516,7 @@ static int v4l2_loop_s_input(struct file *file, void *fh, unsigned int i)
 {
 	struct video_device *vdev = video_devdata(file);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (i != V4L2_LOOP_ACTIVE_INPUT)
 		return -EINVAL;
@@ -1010,267 +2524,699 @@ static int v4l2_loop_s_input(struct file *file, void *fh, unsigned int i)
 	return 0;
 }
 
-static int v4l2_loop_enum_fmt_cap(struct file *file, void *fh, struct v4l2_fmtdesc *fmtdesc)
+/*
+ * Returns pixel format which (single planar) consumers can get frames
+ * converted into, index 0 - producer's own format.
+ */
+static __u32 v4l2_loop_xform_pixelformat(struct v4l2_loop_device *dev, __u32 index)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct v4l2_loop_device *dev =
-		container_of(vdev, struct v4l2_loop_device, vdev);
-	const struct v4l2_loop_fmtdesc *f = NULL;
-	size_t i;
+	__u32 pixelformat = dev->format.fmt.pix.pixelformat;
+	__u32 i;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	if (index == 0)
+		return pixelformat;
 
-	if (fmtdesc->index > 0)
-		return -EINVAL;
+	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT ||
+		!v4l2_loop_cvt_is_supported(pixelformat))
+		return 0;
 
-	if (!dev->format.type) {/* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
-			__func__, video_device_node_name(vdev));
-		return -EINVAL;
+	for (i = 0; i < ARRAY_SIZE(v4l2_loop_cvt_formats); i++) {
+		if (v4l2_loop_cvt_formats[i] == pixelformat)
+			continue;
+		if (--index == 0)
+			return v4l2_loop_cvt_formats[i];
 	}
 
-	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
-		/* producer uses single planar format */
-		for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_splanes); ++i) {
-			f = &v4l2_loop_fmtdescs_splanes[i];
-			if (f->pixelformat == dev->format.fmt.pix.pixelformat)
-				break;
-		}
-
-		if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_splanes))
-			return -EINVAL;
-	} else
-	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
-		/* producer uses multi planar format */
-		for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes); ++i) {
-			f = &v4l2_loop_fmtdescs_mplanes[i];
-			if (f->pixelformat == dev->format.fmt.pix_mp.pixelformat)
-				break;
-		}
+	return 0;
+}
 
-		if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes))
-			return -EINVAL;
+/* returns the whole producer's frame */
+static void v4l2_loop_frame_rect(struct v4l2_loop_device *dev, struct v4l2_rect *rect)
+{
+	rect->left = 0;
+	rect->top = 0;
+	if (V4L2_TYPE_IS_MULTIPLANAR(dev->format.type)) {
+		rect->width = dev->format.fmt.pix_mp.width;
+		rect->height = dev->format.fmt.pix_mp.height;
 	} else {
-		/* do nothing */
+		rect->width = dev->format.fmt.pix.width;
+		rect->height = dev->format.fmt.pix.height;
 	}
+}
 
-	if (f == NULL)
-		return -EINVAL;
-
-	fmtdesc->flags = f->is_compressed ? V4L2_FMT_FLAG_COMPRESSED : 0;
-	strscpy(fmtdesc->description, f->name, sizeof(fmtdesc->description));
-	fmtdesc->pixelformat = f->pixelformat;
-
-	return 0;
+/* returns consumer's crop rectangle, the whole producer's frame if none was set */
+static void v4l2_loop_consumer_crop(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_rect *crop)
+{
+	if (c->crop.width)
+		*crop = c->crop;
+	else
+		v4l2_loop_frame_rect(dev, crop);
 }
 
-static int v4l2_loop_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
+/* moves 'data_offset' of consumer's planes to the origin of its crop rectangle */
+static void v4l2_loop_roi_apply(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_buffer *buffer)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct v4l2_loop_device *dev =
-		container_of(vdev, struct v4l2_loop_device, vdev);
+	const struct v4l2_pix_format_mplane *pix = &dev->format.fmt.pix_mp;
+	const struct v4l2_loop_mplane_layout *layout;
+	__u32 plane;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	if (!c->crop.width || !V4L2_TYPE_IS_MULTIPLANAR(buffer->type) ||
+		dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return;
 
-	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
-			__func__, video_device_node_name(vdev));
-		return -EINVAL;
+	layout = v4l2_loop_find_mplane_layout(pix->pixelformat);
+	if (!layout ||
+		c->crop.left + c->crop.width > pix->width ||
+		c->crop.top + c->crop.height > pix->height) {
+		v4l2_loop_dbg_at1(&dev->vdev, "producer's format has changed, crop ignored\n");
+		return;
 	}
 
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT)
-		return -EINVAL;
+	for (plane = 0; plane < buffer->length && plane < ARRAY_SIZE(layout->planes); plane++) {
+		struct v4l2_plane *p = &buffer->m.planes[plane];
 
-	if (dev->format.fmt.pix.pixelformat != format->fmt.pix.pixelformat)
-		return -EINVAL;
+		p->data_offset +=
+			(c->crop.top / layout->planes[plane].vsub) * pix->plane_fmt[plane].bytesperline +
+			c->crop.left / layout->planes[plane].hsub;
+	}
+}
 
-	if (dev->format.fmt.pix.width != format->fmt.pix.width)
-		return -EINVAL;
+static bool v4l2_loop_xform_is_needed(struct v4l2_loop_device *dev,
+	const struct v4l2_rect *crop, const struct v4l2_pix_format *pix)
+{
+	const struct v4l2_pix_format *src = &dev->format.fmt.pix;
 
-	if (dev->format.fmt.pix.height != format->fmt.pix.height)
-		return -EINVAL;
+	return pix->pixelformat != src->pixelformat ||
+		pix->width != src->width || pix->height != src->height ||
+		crop->width != src->width || crop->height != src->height;
+}
 
-	*format = dev->format;
+/*
+ * Adjusts format of a frame transformed from the 'crop' rectangle, it can
+ * be smaller (downscaled) but not bigger than the rectangle. Zero width
+ * or height means the rectangle's one, zero pixel format - the producer's one.
+ */
+static int v4l2_loop_xform_try_fmt(struct v4l2_loop_device *dev,
+	const struct v4l2_rect *crop, struct v4l2_format *format)
+{
+	const struct v4l2_pix_format *src = &dev->format.fmt.pix;
+	struct v4l2_pix_format *pix = &format->fmt.pix;
+	__u32 pixelformat = pix->pixelformat ? pix->pixelformat : src->pixelformat;
+	__u32 width = pix->width ? min(pix->width, crop->width) : crop->width;
+	__u32 height = pix->height ? min(pix->height, crop->height) : crop->height;
+
+	*pix = *src;
+	pix->pixelformat = pixelformat;
+	pix->width = width;
+	pix->height = height;
 	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 
-	v4l2_loop_print_format(format);
+	if (!v4l2_loop_xform_is_needed(dev, crop, pix))
+		return 0; /* producer's frames go as they are */
+
+	if (!v4l2_loop_cvt_is_supported(src->pixelformat) ||
+		!v4l2_loop_cvt_is_supported(pixelformat))
+		return -EINVAL;
+
+	pix->width = max(width & ~1U, 2U);
+	pix->height = max(height & ~1U, 2U);
+	pix->bytesperline = v4l2_loop_cvt_bytesperline(pixelformat, pix->width);
+	pix->sizeimage = v4l2_loop_cvt_sizeimage(pixelformat, pix->height, pix->bytesperline);
 
 	return 0;
 }
 
-static int v4l2_loop_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
+static int v4l2_loop_enum_fmt_cap(struct file *file, void *fh, struct v4l2_fmtdesc *fmtdesc)
 {
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
+	const struct v4l2_loop_fmtdesc *f;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
-	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
+	if (!dev->format.type) {/* format is not yet set by the producer */
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
 			__func__, video_device_node_name(vdev));
 		return -EINVAL;
 	}
 
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT)
-		return -EINVAL;
+	if (V4L2_TYPE_IS_MULTIPLANAR(fmtdesc->type) != V4L2_TYPE_IS_MULTIPLANAR(dev->format.type)) {
+		/* consumer's planarity differs from the producer's one, see v4l2_loop_bridge_pix() */
+		struct v4l2_pix_format pix;
 
-	*format = dev->format;
-	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (fmtdesc->index > 0)
+			return -EINVAL;
+
+		if (V4L2_TYPE_IS_MULTIPLANAR(fmtdesc->type))
+			f = dev->fmtdesc;
+		else
+		if (!v4l2_loop_bridge_pix(dev, &pix))
+			f = v4l2_loop_find_fmtdesc(false, pix.pixelformat);
+		else
+			f = NULL;
+	} else
+	if (fmtdesc->index == 0)
+		f = dev->fmtdesc;
+	else
+		f = v4l2_loop_find_fmtdesc(false, v4l2_loop_xform_pixelformat(dev, fmtdesc->index));
+	if (f == NULL)
+		return -EINVAL;
 
-	v4l2_loop_print_format(format);
+	fmtdesc->flags = f->is_compressed ? V4L2_FMT_FLAG_COMPRESSED : 0;
+	strscpy(fmtdesc->description, f->name, sizeof(fmtdesc->description));
+	fmtdesc->pixelformat = f->pixelformat;
 
 	return 0;
 }
 
-static int v4l2_loop_try_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
+/* frames of multi planar producers are passed to single planar consumers as they are */
+static int v4l2_loop_try_fmt_cap_bridged(struct v4l2_loop_device *dev, struct v4l2_format *format)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct v4l2_loop_device *dev =
-		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_pix_format pix;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
-
-	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
-			__func__, video_device_node_name(vdev));
-		return -EINVAL;
-	}
-
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT)
+	if (v4l2_loop_bridge_pix(dev, &pix))
 		return -EINVAL;
 
-	if (format->fmt.pix.pixelformat &&
-		(dev->format.fmt.pix.pixelformat != format->fmt.pix.pixelformat))
+	if (format->fmt.pix.pixelformat && (pix.pixelformat != format->fmt.pix.pixelformat))
 		return -EINVAL;
 
-	if (format->fmt.pix.width &&
-		(dev->format.fmt.pix.width != format->fmt.pix.width))
+	if (format->fmt.pix.width && (pix.width != format->fmt.pix.width))
 		return -EINVAL;
 
-	if (format->fmt.pix.height &&
-		(dev->format.fmt.pix.height != format->fmt.pix.height))
+	if (format->fmt.pix.height && (pix.height != format->fmt.pix.height))
 		return -EINVAL;
 
-	*format = dev->format;
 	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-
-	v4l2_loop_print_format(format);
+	format->fmt.pix = pix;
 
 	return 0;
 }
 
-static int v4l2_loop_s_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+static int v4l2_loop_try_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
 {
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+	struct v4l2_rect crop;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
 			__func__, video_device_node_name(vdev));
 		return -EINVAL;
 	}
 
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
-		return -EINVAL;
-
-	if (dev->format.fmt.pix_mp.pixelformat != format->fmt.pix_mp.pixelformat)
-		return -EINVAL;
-
-	if (dev->format.fmt.pix_mp.width != format->fmt.pix_mp.width)
-		return -EINVAL;
-
-	if (dev->format.fmt.pix_mp.height != format->fmt.pix_mp.height)
-		return -EINVAL;
-
-	*format = dev->format;
-	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		if (v4l2_loop_try_fmt_cap_bridged(dev, format))
+			return -EINVAL;
+	} else {
+		v4l2_loop_consumer_crop(dev, &h->c, &crop);
+		if (v4l2_loop_xform_try_fmt(dev, &crop, format))
+			return -EINVAL;
+	}
 
-	v4l2_loop_print_format(format);
+	v4l2_loop_print_format(vdev, format);
 
 	return 0;
 }
 
-static int v4l2_loop_g_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+/*
+ * Consumer can ask for any of the formats listed by VIDIOC_ENUM_FMT
+ * and for a size smaller than its crop rectangle, frames are then
+ * transformed (once per crop rectangle and format, no matter how many
+ * consumers use them) and copied into consumer's USERPTR/DMABUF buffers.
+ */
+static int v4l2_loop_consumer_set_format(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, const struct v4l2_rect *crop,
+	const struct v4l2_format *format)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct v4l2_loop_device *dev =
-		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_rect current_crop;
+	bool xform = v4l2_loop_xform_is_needed(dev, crop, &format->fmt.pix);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_consumer_crop(dev, c, &current_crop);
 
-	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
-			__func__, video_device_node_name(vdev));
-		return -EINVAL;
+	if (c->bufs && (xform || c->format.type) &&
+		(memcmp(&c->format, format, sizeof(*format)) ||
+		 memcmp(&current_crop, crop, sizeof(*crop)))) {
+		v4l2_loop_dbg_at1(&dev->vdev, "%s() consumer buffers are already allocated\n", __func__);
+		return -EBUSY;
 	}
 
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
-		return -EINVAL;
-
-	*format = dev->format;
-	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	if (crop->width == dev->format.fmt.pix.width && crop->height == dev->format.fmt.pix.height)
+		memset(&c->crop, 0, sizeof(c->crop));
+	else
+		c->crop = *crop;
 
-	v4l2_loop_print_format(format);
+	if (xform)
+		c->format = *format;
+	else
+		c->format.type = 0;
 
 	return 0;
 }
 
-static int v4l2_loop_try_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+/*
+ * Crop rectangle and format chosen by a consumer refer to the producer's
+ * frame as it was when they were set. If the producer has changed its format
+ * since then, they are fitted into the new frame (or dropped when they cannot be)
+ * before consumer's buffers are allocated again.
+ */
+static void v4l2_loop_consumer_refit(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct v4l2_loop_device *dev =
-		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_rect frame;
+	struct v4l2_rect crop;
+	struct v4l2_format format;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	if (c->bufs)
+		return;
+
+	v4l2_loop_frame_rect(dev, &frame);
+
+	if (c->crop.width &&
+		(c->crop.left + c->crop.width > frame.width ||
+		 c->crop.top + c->crop.height > frame.height)) {
+		v4l2_loop_dbg_at2(&dev->vdev, "%s() crop rectangle dropped\n", __func__);
+		memset(&c->crop, 0, sizeof(c->crop));
+	}
+
+	if (!c->format.type)
+		return;
+
+	format = c->format;
+	v4l2_loop_consumer_crop(dev, c, &crop);
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(dev->format.type) ||
+		v4l2_loop_xform_try_fmt(dev, &crop, &format) ||
+		v4l2_loop_consumer_set_format(dev, c, &crop, &format)) {
+		v4l2_loop_dbg_at2(&dev->vdev, "%s() format dropped\n", __func__);
+		c->format.type = 0;
+	}
+}
+
+static int v4l2_loop_s_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+	struct v4l2_rect crop;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	if (!format->fmt.pix.pixelformat ||
+		!format->fmt.pix.width || !format->fmt.pix.height)
+		return -EINVAL;
+
+	if (v4l2_loop_try_fmt_cap(file, priv, format))
+		return -EINVAL;
+
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+		return 0; /* bridged, nothing to set */
+
+	v4l2_loop_consumer_crop(dev, &h->c, &crop);
+
+	return v4l2_loop_consumer_set_format(dev, &h->c, &crop, format);
+}
+
+static int v4l2_loop_g_fmt_cap(struct file *file, void *priv, struct v4l2_format *format)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (!dev->format.type) { /* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
 			__func__, video_device_node_name(vdev));
 		return -EINVAL;
 	}
 
-	if (dev->format.type != V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE)
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+		if (v4l2_loop_bridge_pix(dev, &format->fmt.pix))
+			return -EINVAL;
+	} else
+	if (h->c.format.type) {
+		*format = h->c.format;
+	} else {
+		*format = dev->format;
+		format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	}
+
+	v4l2_loop_print_format(vdev, format);
+
+	return 0;
+}
+
+/*
+ * Producer's format as seen by a multi planar consumer, the size is
+ * the one of its crop rectangle (if any), see v4l2_loop_roi_apply().
+ */
+static void v4l2_loop_consumer_fmt_mplane(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_format *format)
+{
+	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	v4l2_loop_bridge_pix_mp(dev, &format->fmt.pix_mp);
+
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE && c->crop.width) {
+		format->fmt.pix_mp.width = c->crop.width;
+		format->fmt.pix_mp.height = c->crop.height;
+	}
+}
+
+static int v4l2_loop_s_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+	struct v4l2_format consumer;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	if (!dev->format.type) { /* format is not yet set by the producer */
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
+			__func__, video_device_node_name(vdev));
 		return -EINVAL;
+	}
+
+	v4l2_loop_consumer_fmt_mplane(dev, &h->c, &consumer);
 
-	if (format->fmt.pix.pixelformat &&
-		(dev->format.fmt.pix.pixelformat != format->fmt.pix.pixelformat))
+	if (consumer.fmt.pix_mp.pixelformat != format->fmt.pix_mp.pixelformat)
 		return -EINVAL;
 
-	if (format->fmt.pix.width &&
-		(dev->format.fmt.pix.width != format->fmt.pix.width))
+	if (consumer.fmt.pix_mp.width != format->fmt.pix_mp.width)
 		return -EINVAL;
 
-	if (format->fmt.pix.height &&
-		(dev->format.fmt.pix.height != format->fmt.pix.height))
+	if (consumer.fmt.pix_mp.height != format->fmt.pix_mp.height)
 		return -EINVAL;
 
-	*format = dev->format;
-	format->type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+	*format = consumer;
+
+	v4l2_loop_print_format(vdev, format);
+
+	return 0;
+}
+
+static int v4l2_loop_g_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	if (!dev->format.type) { /* format is not yet set by the producer */
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
+			__func__, video_device_node_name(vdev));
+		return -EINVAL;
+	}
+
+	v4l2_loop_consumer_fmt_mplane(dev, &h->c, format);
+
+	v4l2_loop_print_format(vdev, format);
+
+	return 0;
+}
+
+static int v4l2_loop_try_fmt_cap_mplane(struct file *file, void *priv, struct v4l2_format *format)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+	struct v4l2_format consumer;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	if (!dev->format.type) { /* format is not yet set by the producer */
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
+			__func__, video_device_node_name(vdev));
+		return -EINVAL;
+	}
+
+	v4l2_loop_consumer_fmt_mplane(dev, &h->c, &consumer);
+
+	if (format->fmt.pix_mp.pixelformat &&
+		(consumer.fmt.pix_mp.pixelformat != format->fmt.pix_mp.pixelformat))
+		return -EINVAL;
+
+	if (format->fmt.pix_mp.width &&
+		(consumer.fmt.pix_mp.width != format->fmt.pix_mp.width))
+		return -EINVAL;
+
+	if (format->fmt.pix_mp.height &&
+		(consumer.fmt.pix_mp.height != format->fmt.pix_mp.height))
+		return -EINVAL;
+
+	*format = consumer;
+
+	v4l2_loop_print_format(vdev, format);
+
+	return 0;
+}
+
+/* single planar formats made of a Y plane followed by (subsampled) chroma plane(s) */
+static bool v4l2_loop_is_contiguous_planar(__u32 pixelformat)
+{
+	switch (pixelformat) {
+	case V4L2_PIX_FMT_M420:
+	case V4L2_PIX_FMT_NV12:
+	case V4L2_PIX_FMT_NV21:
+	case V4L2_PIX_FMT_NV16:
+	case V4L2_PIX_FMT_NV61:
+	case V4L2_PIX_FMT_NV24:
+	case V4L2_PIX_FMT_NV42:
+	case V4L2_PIX_FMT_YUV410:
+	case V4L2_PIX_FMT_YVU410:
+	case V4L2_PIX_FMT_YUV411P:
+	case V4L2_PIX_FMT_YUV420:
+	case V4L2_PIX_FMT_YVU420:
+	case V4L2_PIX_FMT_YUV422P:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static bool v4l2_loop_is_tiled(__u32 pixelformat)
+{
+	switch (pixelformat) {
+#ifdef V4L2_PIX_FMT_NV12_4L4
+	case V4L2_PIX_FMT_NV12_4L4:
+#endif
+#ifdef V4L2_PIX_FMT_NV12_16L16
+	case V4L2_PIX_FMT_NV12_16L16:
+#endif
+#ifdef V4L2_PIX_FMT_NV12_32L32
+	case V4L2_PIX_FMT_NV12_32L32:
+#endif
+	case V4L2_PIX_FMT_NV12MT:
+	case V4L2_PIX_FMT_NV12MT_16X16:
+		return true;
+	default:
+		return false;
+	}
+}
+
+/*
+ * Computes 'bytesperline' (at least the one asked for, rounded up to
+ * 'align') and 'sizeimage' of a format stored in a single plane.
+ * For (contiguous) planar formats 'bytesperline' is the one of the Y plane,
+ * chroma planes are placed right after it. Frames of compressed formats
+ * vary in size, their 'sizeimage' (as asked for by the producer or
+ * 4 bits per pixel by default) is the upper bound of it. Tiled formats
+ * are sized as before, from the depth only. 'bytesperline' asked for
+ * is limited to V4L2_LOOP_BYTESPERLINE_MAX.
+ */
+static void v4l2_loop_plane_sizes(unsigned int align, const struct v4l2_loop_fmtdesc *f,
+	__u32 width, __u32 height, __u32 *bytesperline, __u32 *sizeimage)
+{
+	__u32 min_bytesperline;
 
-	v4l2_loop_print_format(format);
+	*bytesperline = min(*bytesperline, V4L2_LOOP_BYTESPERLINE_MAX);
+
+	if (f->is_compressed) {
+		u64 size = *sizeimage ? *sizeimage : (u64)width * height / 2;
+
+		*bytesperline = 0;
+		*sizeimage = clamp_t(u64, size,
+			V4L2_LOOP_COMPRESSED_MIN_SIZE, V4L2_LOOP_COMPRESSED_MAX_SIZE);
+	} else
+	if (v4l2_loop_is_tiled(f->pixelformat)) {
+		if (*bytesperline != 0)
+			*sizeimage = (u64)*bytesperline * height;
+		else
+			*sizeimage = div_u64((u64)width * height *
+				f->depth[0].numerator, f->depth[0].denominator);
+	} else
+	if (v4l2_loop_is_contiguous_planar(f->pixelformat)) {
+		*bytesperline = ALIGN(max(*bytesperline, width), align);
+		*sizeimage = div_u64((u64)*bytesperline * height *
+			f->depth[0].numerator, f->depth[0].denominator);
+	} else {
+		min_bytesperline = DIV_ROUND_UP(width * f->depth[0].numerator,
+			f->depth[0].denominator);
+		*bytesperline = ALIGN(max(*bytesperline, min_bytesperline), align);
+		*sizeimage = (u64)*bytesperline * height;
+	}
+}
+
+static void v4l2_loop_fill_sizes(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_fmtdesc *f, struct v4l2_pix_format *pix)
+{
+	pix->width = min(pix->width, dev->max_width);
+	pix->height = min(pix->height, dev->max_height);
+
+	v4l2_loop_plane_sizes(READ_ONCE(dev->stride_align), f, pix->width, pix->height,
+		&pix->bytesperline, &pix->sizeimage);
+}
+
+/* as v4l2_loop_fill_sizes(), rows of every plane are padded */
+static void v4l2_loop_fill_sizes_mplane(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_fmtdesc *f, struct v4l2_pix_format_mplane *pix_mp)
+{
+	const struct v4l2_loop_mplane_layout *layout =
+		v4l2_loop_find_mplane_layout(f->pixelformat);
+	unsigned int align = READ_ONCE(dev->stride_align);
+	int plane;
+
+	pix_mp->width = min(pix_mp->width, dev->max_width);
+	pix_mp->height = min(pix_mp->height, dev->max_height);
+
+	pix_mp->num_planes = f->planes;
+	for (plane = 0; plane < f->planes; ++plane) {
+		struct v4l2_plane_pix_format *plane_fmt = &pix_mp->plane_fmt[plane];
+
+		plane_fmt->bytesperline = min(plane_fmt->bytesperline, V4L2_LOOP_BYTESPERLINE_MAX);
+
+		if (layout && plane < ARRAY_SIZE(layout->planes)) {
+			__u32 bytesperline = DIV_ROUND_UP(pix_mp->width, layout->planes[plane].hsub);
+
+			plane_fmt->bytesperline = ALIGN(max(plane_fmt->bytesperline, bytesperline), align);
+			plane_fmt->sizeimage = (u64)plane_fmt->bytesperline *
+				DIV_ROUND_UP(pix_mp->height, layout->planes[plane].vsub);
+		} else
+		if (f->planes == 1) { /* single planar format exported as multi planar one */
+			__u32 bytesperline = plane_fmt->bytesperline; /* plane_fmt is packed */
+			__u32 sizeimage = plane_fmt->sizeimage;
+
+			v4l2_loop_plane_sizes(align, f, pix_mp->width, pix_mp->height,
+				&bytesperline, &sizeimage);
+			plane_fmt->bytesperline = bytesperline;
+			plane_fmt->sizeimage = sizeimage;
+		} else
+		if (plane_fmt->bytesperline != 0) {
+			plane_fmt->sizeimage = (u64)plane_fmt->bytesperline * pix_mp->height;
+		} else {
+			plane_fmt->sizeimage = div_u64((u64)pix_mp->width * pix_mp->height *
+				f->depth[plane].numerator, f->depth[plane].denominator);
+		}
+	}
+}
+
+static bool v4l2_loop_format_changed(const struct v4l2_format *old, const struct v4l2_format *new)
+{
+	__u32 plane;
+
+	if (old->type != new->type)
+		return true;
+
+	if (!V4L2_TYPE_IS_MULTIPLANAR(new->type))
+		return old->fmt.pix.width != new->fmt.pix.width ||
+			old->fmt.pix.height != new->fmt.pix.height ||
+			old->fmt.pix.pixelformat != new->fmt.pix.pixelformat ||
+			old->fmt.pix.bytesperline != new->fmt.pix.bytesperline ||
+			old->fmt.pix.sizeimage != new->fmt.pix.sizeimage;
+
+	if (old->fmt.pix_mp.width != new->fmt.pix_mp.width ||
+		old->fmt.pix_mp.height != new->fmt.pix_mp.height ||
+		old->fmt.pix_mp.pixelformat != new->fmt.pix_mp.pixelformat ||
+		old->fmt.pix_mp.num_planes != new->fmt.pix_mp.num_planes)
+		return true;
+
+	for (plane = 0; plane < new->fmt.pix_mp.num_planes; plane++)
+		if (old->fmt.pix_mp.plane_fmt[plane].bytesperline !=
+				new->fmt.pix_mp.plane_fmt[plane].bytesperline ||
+			old->fmt.pix_mp.plane_fmt[plane].sizeimage !=
+				new->fmt.pix_mp.plane_fmt[plane].sizeimage)
+			return true;
+
+	return false;
+}
+
+/*
+ * Producer may change its format mid-stream, but only after it has
+ * released its buffers (VIDIOC_STREAMOFF and VIDIOC_REQBUFS with count 0),
+ * as buffers allocated for the old format could be too small for the new one.
+ * Consumers subscribed to V4L2_EVENT_SOURCE_CHANGE are told about the change,
+ * so they can reallocate their buffers without reopening the device.
+ */
+/* must be called with 'vb_queue_lock' held */
+static int __v4l2_loop_set_producer_format(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_fmtdesc *f, const struct v4l2_format *format)
+{
+	bool changed;
+
+	changed = v4l2_loop_format_changed(&dev->format, format);
+	if (changed && vb2_is_busy(&dev->vb_queue)) {
+		v4l2_loop_dbg_at1(&dev->vdev, "%s() producer buffers are already allocated\n", __func__);
+		return -EBUSY;
+	}
+
+	dev->format = *format;
+	dev->fmtdesc = f;
+
+	v4l2_loop_print_format(&dev->vdev, format);
+
+	if (changed)
+		v4l2_loop_queue_source_change_event(dev);
 
 	return 0;
 }
 
+static int v4l2_loop_set_producer_format(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_fmtdesc *f, const struct v4l2_format *format)
+{
+	int status;
+
+	mutex_lock(&dev->vb_queue_lock);
+	status = __v4l2_loop_set_producer_format(dev, f, format);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status;
+}
+
 static int v4l2_loop_enum_fmt_out(struct file *file, void *fh, struct v4l2_fmtdesc *fmtdesc)
 {
 	struct video_device *vdev = video_devdata(file);
 	const struct v4l2_loop_fmtdesc *f = NULL;
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (fmtdesc->type == V4L2_BUF_TYPE_VIDEO_OUTPUT) {
-		v4l2_loop_dbg_at3("%s(%s) enumerating single planar formats\n",
+		v4l2_loop_dbg_at3(vdev, "%s(%s) enumerating single planar formats\n",
 			__func__, video_device_node_name(vdev));
 		if (fmtdesc->index < ARRAY_SIZE(v4l2_loop_fmtdescs_splanes))
 			f = &v4l2_loop_fmtdescs_splanes[fmtdesc->index];
 	} else
 	if (fmtdesc->type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
-		v4l2_loop_dbg_at3("%s(%s) enumerating multi planar formats\n",
+		v4l2_loop_dbg_at3(vdev, "%s(%s) enumerating multi planar formats\n",
 			__func__, video_device_node_name(vdev));
 		if (fmtdesc->index < ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes))
 			f = &v4l2_loop_fmtdescs_mplanes[fmtdesc->index];
@@ -1293,20 +3239,11 @@ static int v4l2_loop_s_fmt_out(struct file *file, void *priv, struct v4l2_format
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
-	const struct v4l2_loop_fmtdesc *f = NULL;
-	size_t i;
-
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
-
-	for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_splanes); ++i) {
-		f = &v4l2_loop_fmtdescs_splanes[i];
-		if (f->pixelformat == format->fmt.pix.pixelformat)
-			break;
-	}
+	const struct v4l2_loop_fmtdesc *f;
 
-	if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_splanes))
-		return -EINVAL;
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
+	f = v4l2_loop_find_fmtdesc(false, format->fmt.pix.pixelformat);
 	if (f == NULL)
 		return -EINVAL;
 
@@ -1319,18 +3256,9 @@ static int v4l2_loop_s_fmt_out(struct file *file, void *priv, struct v4l2_format
 	if (format->fmt.pix.colorspace == V4L2_COLORSPACE_DEFAULT)
 		format->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
 
-	if (format->fmt.pix.bytesperline != 0)
-		format->fmt.pix.sizeimage =
-			format->fmt.pix.bytesperline * format->fmt.pix.height;
-	else
-		format->fmt.pix.sizeimage =
-			(format->fmt.pix.width * format->fmt.pix.height *
-			f->depth[0].numerator) / f->depth[0].denominator;
-
-	dev->format = *format;
-	v4l2_loop_print_format(format);
+	v4l2_loop_fill_sizes(dev, f, &format->fmt.pix);
 
-	return 0;
+	return v4l2_loop_set_producer_format(dev, f, format);
 }
 
 static int v4l2_loop_g_fmt_out(struct file *file, void *priv, struct v4l2_format *format)
@@ -1339,10 +3267,10 @@ static int v4l2_loop_g_fmt_out(struct file *file, void *priv, struct v4l2_format
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (!dev->format.type) {/* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
 			__func__, video_device_node_name(vdev));
 		/* This method is to be called by producers.
 		But what format shall be returned if it hasn't been negotiated yet?
@@ -1353,7 +3281,7 @@ static int v4l2_loop_g_fmt_out(struct file *file, void *priv, struct v4l2_format
 
 	*format = dev->format;
 	format->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
-	v4l2_loop_print_format(format);
+	v4l2_loop_print_format(vdev, format);
 
 	return 0;
 }
@@ -1361,21 +3289,13 @@ static int v4l2_loop_g_fmt_out(struct file *file, void *priv, struct v4l2_format
 static int v4l2_loop_try_fmt_out(struct file *file, void *priv, struct v4l2_format *format)
 {
 	struct video_device *vdev = video_devdata(file);
-	const struct v4l2_loop_fmtdesc *f = NULL;
-	size_t i;
-
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
-
-
-	for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_splanes); ++i) {
-		f = &v4l2_loop_fmtdescs_splanes[i];
-		if (f->pixelformat == format->fmt.pix.pixelformat)
-			break;
-	}
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	const struct v4l2_loop_fmtdesc *f;
 
-	if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_splanes))
-		return -EINVAL;
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
+	f = v4l2_loop_find_fmtdesc(false, format->fmt.pix.pixelformat);
 	if (f == NULL)
 		return -EINVAL;
 
@@ -1388,15 +3308,9 @@ static int v4l2_loop_try_fmt_out(struct file *file, void *priv, struct v4l2_form
 	if (format->fmt.pix.colorspace == V4L2_COLORSPACE_DEFAULT)
 		format->fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
 
-	if (format->fmt.pix.bytesperline != 0)
-		format->fmt.pix.sizeimage =
-			format->fmt.pix.bytesperline * format->fmt.pix.height;
-	else
-		format->fmt.pix.sizeimage =
-			(format->fmt.pix.width * format->fmt.pix.height *
-			f->depth[0].numerator) / f->depth[0].denominator;
+	v4l2_loop_fill_sizes(dev, f, &format->fmt.pix);
 
-	v4l2_loop_print_format(format);
+	v4l2_loop_print_format(vdev, format);
 
 	return 0;
 }
@@ -1406,21 +3320,11 @@ static int v4l2_loop_s_fmt_out_mplane(struct file *file, void *priv, struct v4l2
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
-	const struct v4l2_loop_fmtdesc *f = NULL;
-	size_t i;
-	int plane;
-
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
-
-	for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes); ++i) {
-		f = &v4l2_loop_fmtdescs_mplanes[i];
-		if (f->pixelformat == format->fmt.pix.pixelformat)
-			break;
-	}
+	const struct v4l2_loop_fmtdesc *f;
 
-	if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes))
-		return -EINVAL;
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
+	f = v4l2_loop_find_fmtdesc(true, format->fmt.pix_mp.pixelformat);
 	if (f == NULL)
 		return -EINVAL;
 
@@ -1433,22 +3337,9 @@ static int v4l2_loop_s_fmt_out_mplane(struct file *file, void *priv, struct v4l2
 	if (format->fmt.pix_mp.colorspace == V4L2_COLORSPACE_DEFAULT)
 		format->fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
 
-	format->fmt.pix_mp.num_planes = f->planes;
-	for (plane = 0; plane < f->planes; ++plane) {
-		if (format->fmt.pix_mp.plane_fmt[plane].bytesperline != 0) {
-			format->fmt.pix_mp.plane_fmt[plane].sizeimage =
-				format->fmt.pix_mp.plane_fmt[plane].bytesperline * format->fmt.pix_mp.height;
-		} else {
-			format->fmt.pix_mp.plane_fmt[plane].sizeimage =
-				(format->fmt.pix_mp.width * format->fmt.pix_mp.height *
-				f->depth[plane].numerator) / f->depth[plane].denominator;
-		}
-	}
-
-	dev->format = *format;
-	v4l2_loop_print_format(format);
+	v4l2_loop_fill_sizes_mplane(dev, f, &format->fmt.pix_mp);
 
-	return 0;
+	return v4l2_loop_set_producer_format(dev, f, format);
 }
 
 static int v4l2_loop_g_fmt_out_mplane(struct file *file, void *priv, struct v4l2_format *format)
@@ -1457,10 +3348,10 @@ static int v4l2_loop_g_fmt_out_mplane(struct file *file, void *priv, struct v4l2
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (!dev->format.type) {/* format is not yet set by the producer */
-		v4l2_loop_dbg_at2("%s(%s) format is not yet set by the producer\n",
+		v4l2_loop_dbg_at2(vdev, "%s(%s) format is not yet set by the producer\n",
 			__func__, video_device_node_name(vdev));
 		/* This method is to be called by producers.
 		But what format shall be returned if it hasn't been negotiated yet?
@@ -1471,7 +3362,7 @@ static int v4l2_loop_g_fmt_out_mplane(struct file *file, void *priv, struct v4l2
 
 	*format = dev->format;
 	format->type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
-	v4l2_loop_print_format(format);
+	v4l2_loop_print_format(vdev, format);
 
 	return 0;
 }
@@ -1479,21 +3370,13 @@ static int v4l2_loop_g_fmt_out_mplane(struct file *file, void *priv, struct v4l2
 static int v4l2_loop_try_fmt_out_mplane(struct file *file, void *priv, struct v4l2_format *format)
 {
 	struct video_device *vdev = video_devdata(file);
-	const struct v4l2_loop_fmtdesc *f = NULL;
-	size_t i;
-	int plane;
-
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
-
-	for (i = 0; i < ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes); ++i) {
-		f = &v4l2_loop_fmtdescs_mplanes[i];
-		if (f->pixelformat == format->fmt.pix_mp.pixelformat)
-			break;
-	}
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	const struct v4l2_loop_fmtdesc *f;
 
-	if (i == ARRAY_SIZE(v4l2_loop_fmtdescs_mplanes))
-		return -EINVAL;
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
+	f = v4l2_loop_find_fmtdesc(true, format->fmt.pix_mp.pixelformat);
 	if (f == NULL)
 		return -EINVAL;
 
@@ -1506,19 +3389,56 @@ static int v4l2_loop_try_fmt_out_mplane(struct file *file, void *priv, struct v4
 	if (format->fmt.pix_mp.colorspace == V4L2_COLORSPACE_DEFAULT)
 		format->fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
 
-	format->fmt.pix_mp.num_planes = f->planes;
-	for (plane = 0; plane < f->planes; ++plane) {
-		if (format->fmt.pix_mp.plane_fmt[plane].bytesperline != 0) {
-			format->fmt.pix_mp.plane_fmt[plane].sizeimage =
-				format->fmt.pix_mp.plane_fmt[plane].bytesperline * format->fmt.pix_mp.height;
-		} else {
-			format->fmt.pix_mp.plane_fmt[plane].sizeimage =
-				(format->fmt.pix_mp.width * format->fmt.pix_mp.height *
-				f->depth[plane].numerator) / f->depth[plane].denominator;
+	v4l2_loop_fill_sizes_mplane(dev, f, &format->fmt.pix_mp);
+
+	v4l2_loop_print_format(vdev, format);
+
+	return 0;
+}
+
+static void v4l2_loop_g_parm_consumer(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_captureparm *capture)
+{
+	memset(capture, 0, sizeof(*capture));
+	capture->capability = V4L2_CAP_TIMEPERFRAME;
+	capture->timeperframe = c->frame_interval_ns ?
+		c->timeperframe : dev->outputparm.timeperframe;
+}
+
+/*
+ * Every consumer can ask for its own frame rate (not higher than the
+ * producer's one), frames which are not needed to meet it are skipped
+ * without being copied or waking the consumer up. 0/0 restores the
+ * producer's frame rate.
+ */
+static int v4l2_loop_s_parm_consumer(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_captureparm *capture)
+{
+	struct v4l2_fract *timeperframe = &capture->timeperframe;
+	u64 frame_interval_ns = 0;
+
+	if (timeperframe->numerator && timeperframe->denominator) {
+		frame_interval_ns = div_u64((u64)timeperframe->numerator * NSEC_PER_SEC,
+			timeperframe->denominator);
+
+		if (frame_interval_ns < NSEC_PER_SEC / dev->max_fps) {
+			timeperframe->numerator = 1;
+			timeperframe->denominator = dev->max_fps;
+			frame_interval_ns = NSEC_PER_SEC / dev->max_fps;
+		} else
+		if (frame_interval_ns > NSEC_PER_SEC / V4L2_LOOP_DEFAULT_FPS_MIN) {
+			timeperframe->numerator = 1;
+			timeperframe->denominator = V4L2_LOOP_DEFAULT_FPS_MIN;
+			frame_interval_ns = NSEC_PER_SEC / V4L2_LOOP_DEFAULT_FPS_MIN;
 		}
+
+		c->timeperframe = *timeperframe;
 	}
 
-	v4l2_loop_print_format(format);
+	c->frame_interval_ns = frame_interval_ns;
+	c->next_frame_ns = 0;
+
+	v4l2_loop_g_parm_consumer(dev, c, capture);
 
 	return 0;
 }
@@ -1528,14 +3448,16 @@ static int v4l2_loop_g_parm(struct file *file, void *priv, struct v4l2_streampar
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
 	if (V4L2_LOOP_IS_PRODUCER(parm->type))
 		parm->parm.output = dev->outputparm;
 	else
 	if (V4L2_LOOP_IS_CONSUMER(parm->type))
-		parm->parm.capture = dev->captureparm;
+		v4l2_loop_g_parm_consumer(dev, &h->c, &parm->parm.capture);
 	else
 		return -EINVAL;
 
@@ -1547,38 +3469,162 @@ static int v4l2_loop_s_parm(struct file *file, void *priv, struct v4l2_streampar
 	struct video_device *vdev = video_devdata(file);
 	struct v4l2_loop_device *dev =
 		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
-	if (V4L2_LOOP_IS_PRODUCER(parm->type))
+	if (V4L2_LOOP_IS_PRODUCER(parm->type)) {
+		struct v4l2_fract *timeperframe = &parm->parm.output.timeperframe;
+
+		if (timeperframe->numerator && timeperframe->denominator &&
+			(u64)timeperframe->numerator * dev->max_fps < timeperframe->denominator) {
+			timeperframe->numerator = 1;
+			timeperframe->denominator = dev->max_fps;
+		}
 		dev->outputparm = parm->parm.output;
-	else
+	} else
 	if (V4L2_LOOP_IS_CONSUMER(parm->type))
-		dev->captureparm = parm->parm.capture;
+		return v4l2_loop_s_parm_consumer(dev, &h->c, &parm->parm.capture);
 	else
 		return -EINVAL;
 
 	return 0;
 }
 
-static int v4l2_loop_reqbufs_producer(
-	struct file *file,
-	struct v4l2_fh *fh,
-	struct v4l2_requestbuffers *requestbuffers)
+static int v4l2_loop_g_selection(struct file *file, void *priv, struct v4l2_selection *selection)
 {
 	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
 	struct v4l2_loop_handle *h =
-		container_of(fh, struct v4l2_loop_handle, fh);
-	struct vb2_queue *vq = vdev->queue;
-	int status;
+		container_of(priv, struct v4l2_loop_handle, fh);
 
-	h->htype = V4L2_LOOP_HANDLE_PRODUCER;
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
 
-	if (vq->owner && vq->owner != file->private_data) {
-		v4l2_loop_dbg_at1("%s(%s) queue is busy\n",
-			__func__, video_device_node_name(vdev));
-		return -EBUSY;
-	}
+	/* v4l2 core passes multi planar types as single planar ones */
+	if (selection->type != V4L2_BUF_TYPE_VIDEO_CAPTURE || !dev->format.type)
+		return -EINVAL;
+
+	switch (selection->target) {
+	case V4L2_SEL_TGT_CROP:
+		v4l2_loop_consumer_crop(dev, &h->c, &selection->r);
+		break;
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+		v4l2_loop_frame_rect(dev, &selection->r);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/*
+ * Consumer can crop producer's frames (rectangle's position and size
+ * are rounded down to even numbers). For single planar formats frames
+ * are then transformed and the consumer's format is adjusted to the
+ * rectangle's size unless S_FMT asked for a smaller one. For multi planar
+ * ones consumer gets producer's buffers with 'data_offset' of each plane
+ * pointing at the rectangle, see v4l2_loop_roi_apply().
+ */
+static int v4l2_loop_s_selection(struct file *file, void *priv, struct v4l2_selection *selection)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+	struct v4l2_rect *r = &selection->r;
+	struct v4l2_rect frame;
+	struct v4l2_format format;
+	int status;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	if (selection->type != V4L2_BUF_TYPE_VIDEO_CAPTURE ||
+		selection->target != V4L2_SEL_TGT_CROP ||
+		!dev->format.type)
+		return -EINVAL;
+
+	v4l2_loop_frame_rect(dev, &frame);
+	if (frame.width < 2 || frame.height < 2)
+		return -EINVAL;
+
+	r->left = clamp_t(__s32, r->left, 0, frame.width - 2) & ~1;
+	r->top = clamp_t(__s32, r->top, 0, frame.height - 2) & ~1;
+	r->width = clamp_t(__u32, r->width, 2, frame.width - r->left) & ~1U;
+	r->height = clamp_t(__u32, r->height, 2, frame.height - r->top) & ~1U;
+
+	if (dev->format.type == V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE) {
+		struct v4l2_rect crop;
+
+		if (!v4l2_loop_find_mplane_layout(dev->format.fmt.pix_mp.pixelformat))
+			return -EINVAL;
+
+		v4l2_loop_consumer_crop(dev, &h->c, &crop);
+		if (h->c.bufs && memcmp(&crop, r, sizeof(*r))) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) consumer buffers are already allocated\n",
+				__func__, video_device_node_name(vdev));
+			return -EBUSY;
+		}
+
+		if (r->width == frame.width && r->height == frame.height)
+			memset(&h->c.crop, 0, sizeof(h->c.crop));
+		else
+			h->c.crop = *r;
+
+		return 0;
+	}
+
+	if (h->c.format.type) {
+		format = h->c.format;
+	} else {
+		format = dev->format;
+		format.fmt.pix.width = 0;
+		format.fmt.pix.height = 0;
+	}
+
+	status = v4l2_loop_xform_try_fmt(dev, r, &format);
+	if (status)
+		return status;
+
+	return v4l2_loop_consumer_set_format(dev, &h->c, r, &format);
+}
+
+static int v4l2_loop_reqbufs_producer(
+	struct file *file,
+	struct v4l2_fh *fh,
+	struct v4l2_requestbuffers *requestbuffers)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_handle *h =
+		container_of(fh, struct v4l2_loop_handle, fh);
+	struct vb2_queue *vq = vdev->queue;
+	int status;
+
+	if (vq->owner && vq->owner != file->private_data) {
+		v4l2_loop_dbg_at1(vdev, "%s(%s) queue is busy\n",
+			__func__, video_device_node_name(vdev));
+		return -EBUSY;
+	}
+
+	h->htype = V4L2_LOOP_HANDLE_PRODUCER;
+
+	/* buffers kept after the previous producer closed are taken over as they are */
+	if (v4l2_loop_queue_is_detached(vq)) {
+		if (requestbuffers->count && requestbuffers->memory == vq->memory) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) taking over %u buffers\n",
+				__func__, video_device_node_name(vdev), vq->num_buffers);
+			requestbuffers->count = vq->num_buffers;
+			vq->owner = file->private_data;
+			return 0;
+		}
+
+		/* any other request starts afresh */
+		vb2_queue_release(vq);
+	}
 
 #if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
 	status = vb2_core_reqbufs(vdev->queue,
@@ -1588,7 +3634,7 @@ static int v4l2_loop_reqbufs_producer(
 		requestbuffers->memory, &requestbuffers->count);
 #endif
 	if (status) {
-		v4l2_loop_dbg_at1("%s(%s) vb2_core_reqbufs() failed\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_core_reqbufs() failed\n",
 			__func__, video_device_node_name(vdev));
 		return status;
 	}
@@ -1612,6 +3658,8 @@ static int v4l2_loop_reqbufs_consumer(
 	struct v4l2_loop_handle *h =
 		container_of(fh, struct v4l2_loop_handle, fh);
 	struct vb2_queue *vq = vdev->queue;
+	struct v4l2_pix_format pix;
+	bool gather;
 	int status;
 
 	h->htype = V4L2_LOOP_HANDLE_CONSUMER;
@@ -1619,7 +3667,7 @@ static int v4l2_loop_reqbufs_consumer(
 	if (requestbuffers->memory != VB2_MEMORY_MMAP &&
 		requestbuffers->memory != VB2_MEMORY_USERPTR &&
 		requestbuffers->memory != VB2_MEMORY_DMABUF) {
-		v4l2_loop_dbg_at1("%s(%s) unsupported memory type\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) unsupported memory type\n",
 			__func__, video_device_node_name(vdev));
 		return -EINVAL;
 	}
@@ -1628,6 +3676,24 @@ static int v4l2_loop_reqbufs_consumer(
 	if (status)
 		return status;
 
+	v4l2_loop_consumer_refit(dev, &h->c);
+
+	if (h->c.format.type && V4L2_TYPE_IS_MULTIPLANAR(requestbuffers->type)) {
+		v4l2_loop_dbg_at1(vdev, "%s(%s) converted frames are for single planar consumers only\n",
+			__func__, video_device_node_name(vdev));
+		return -EINVAL;
+	}
+
+	gather = !V4L2_TYPE_IS_MULTIPLANAR(requestbuffers->type) &&
+		V4L2_TYPE_IS_MULTIPLANAR(dev->format.type) &&
+		dev->format.fmt.pix_mp.num_planes > 1;
+
+	if ((h->c.format.type || gather) && requestbuffers->memory == VB2_MEMORY_MMAP) {
+		v4l2_loop_dbg_at1(vdev, "%s(%s) converted frames need USERPTR or DMABUF buffers\n",
+			__func__, video_device_node_name(vdev));
+		return -EINVAL;
+	}
+
 	if (requestbuffers->count > 0)
 		requestbuffers->count = vq->num_buffers;
 
@@ -1638,11 +3704,30 @@ static int v4l2_loop_reqbufs_consumer(
 		if (h->c.bufs)
 			return 0;
 
-		h->c.bufs = kzalloc(sizeof(*h->c.bufs) * requestbuffers->count, GFP_KERNEL);
-		if (!h->c.bufs)
+		if (h->c.format.type) {
+			struct v4l2_rect crop;
+
+			v4l2_loop_consumer_crop(dev, &h->c, &crop);
+			h->c.xform = v4l2_loop_xform_get(dev, &crop, &h->c.format.fmt.pix);
+			if (IS_ERR(h->c.xform)) {
+				status = PTR_ERR(h->c.xform);
+				h->c.xform = NULL;
+				return status;
+			}
+		}
+
+		h->c.bufs = kcalloc(requestbuffers->count, sizeof(*h->c.bufs), GFP_KERNEL_ACCOUNT);
+		if (!h->c.bufs) {
+			v4l2_loop_release_cbufs(&h->c);
 			return -ENOMEM;
+		}
 
 		h->c.buffers = requestbuffers->count;
+		h->c.gather = gather;
+		if (gather && v4l2_loop_bridge_pix(dev, &pix)) {
+			v4l2_loop_release_cbufs(&h->c);
+			return -EINVAL;
+		}
 
 		for (i = 0; i < h->c.buffers; i++) {
 			struct v4l2_loop_cbuf *cbuf = &h->c.bufs[i];
@@ -1652,10 +3737,21 @@ static int v4l2_loop_reqbufs_consumer(
 			vb->index = i;
 			vb->type = requestbuffers->type;
 			vb->memory = requestbuffers->memory;
-			vb->num_planes = vq->bufs[i]->num_planes;
-			for (plane = 0; plane < vb->num_planes; plane++) {
-				vb->planes[plane].length = vq->bufs[i]->planes[plane].length;
-				vb->planes[plane].min_length = vq->bufs[i]->planes[plane].min_length;
+			if (h->c.xform) {
+				vb->num_planes = 1;
+				vb->planes[0].length = h->c.xform->pix.sizeimage;
+				vb->planes[0].min_length = h->c.xform->pix.sizeimage;
+			} else
+			if (gather) {
+				vb->num_planes = 1;
+				vb->planes[0].length = pix.sizeimage;
+				vb->planes[0].min_length = pix.sizeimage;
+			} else {
+				vb->num_planes = vq->bufs[i]->num_planes;
+				for (plane = 0; plane < vb->num_planes; plane++) {
+					vb->planes[plane].length = vq->bufs[i]->planes[plane].length;
+					vb->planes[plane].min_length = vq->bufs[i]->planes[plane].min_length;
+				}
 			}
 			vb->state = VB2_BUF_STATE_DEQUEUED;
 		}
@@ -1676,13 +3772,13 @@ static int v4l2_loop_reqbufs(struct file *file, void *fh, struct v4l2_requestbuf
 	struct video_device *vdev = video_devdata(file);
 	int status;
 
-	v4l2_loop_dbg_at3("%s(%s, %s, %s, %d)\n", __func__,
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s, %s, %d)\n", __func__,
 		video_device_node_name(vdev),
 		v4l2_loop_buf_type_to_string(requestbuffers->type),
 		v4l2_loop_memory_to_string(requestbuffers->memory),
 		requestbuffers->count);
 
-	v4l2_loop_print_requestbuffers(requestbuffers);
+	v4l2_loop_print_requestbuffers(vdev, requestbuffers);
 
 	if (V4L2_LOOP_IS_PRODUCER(requestbuffers->type))
 		status = v4l2_loop_reqbufs_producer(file, fh, requestbuffers);
@@ -1706,7 +3802,7 @@ static int v4l2_loop_querybuf_producer(struct file *file, void *fh, struct v4l2_
 
 	status = vb2_querybuf(vq, buffer);
 	if (status) {
-		v4l2_loop_dbg_at1("%s(%s) vb2_querybuf() failed\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_querybuf() failed\n",
 			__func__, video_device_node_name(vdev));
 		return status;
 	}
@@ -1734,7 +3830,7 @@ static int v4l2_loop_querybuf_consumer(struct file *file, void *fh, struct v4l2_
 		return -EINVAL;
 
 	if (buffer->index >= vq->num_buffers) {
-		v4l2_loop_dbg_at1("%s(%s) buffer index #%u is bigger than number of allocated buffers (%u)\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) buffer index #%u is bigger than number of allocated buffers (%u)\n",
 			__func__, video_device_node_name(vdev), buffer->index, vq->num_buffers);
 		return -EINVAL;
 	}
@@ -1746,9 +3842,19 @@ static int v4l2_loop_querybuf_consumer(struct file *file, void *fh, struct v4l2_
 	if (status)
 		return -EINVAL;
 
-	status = v4l2_loop_fill_user_buffer(pbuf, cbuf, buffer);
-	if (status)
-		return status;
+	if (h->c.xform || h->c.gather) {
+		v4l2_loop_fill_user_buffer_header(pbuf, cbuf, buffer);
+		if (cbuf->vbuf.vb2_buf.memory == VB2_MEMORY_USERPTR)
+			buffer->m.userptr = cbuf->vbuf.vb2_buf.planes[0].m.userptr;
+		else
+			buffer->m.fd = cbuf->vbuf.vb2_buf.planes[0].m.fd;
+		buffer->length = cbuf->vbuf.vb2_buf.planes[0].length;
+	} else {
+		status = v4l2_loop_fill_user_buffer(pbuf, cbuf, buffer);
+		if (status)
+			return status;
+		v4l2_loop_roi_apply(dev, &h->c, buffer);
+	}
 
 	buffer->bytesused = 0; /* reset bytesused to 0 when querying */
 
@@ -1760,7 +3866,7 @@ static int v4l2_loop_querybuf(struct file *file, void *fh, struct v4l2_buffer *b
 	struct video_device *vdev = video_devdata(file);
 	int status;
 
-	v4l2_loop_dbg_at3("%s(%s, %s, %d)\n", __func__,
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s, %d)\n", __func__,
 		video_device_node_name(vdev),
 		v4l2_loop_buf_type_to_string(buffer->type),
 		buffer->index);
@@ -1776,7 +3882,7 @@ static int v4l2_loop_querybuf(struct file *file, void *fh, struct v4l2_buffer *b
 	if (status)
 		return status;
 
-	v4l2_loop_print_buffer(buffer);
+	v4l2_loop_print_buffer(vdev, buffer);
 
 	return 0;
 }
@@ -1787,17 +3893,19 @@ static int v4l2_loop_qbuf_producer(struct file *file, void *fh, struct v4l2_buff
 	struct vb2_queue *vq = vdev->queue;
 	int status;
 
-	/* The queue is busy if there is an owner and you are not that owner */
-	if (vq->owner && vq->owner != file->private_data)
+	if (v4l2_loop_queue_is_busy(vq, file))
 		return -EBUSY;
 
 	status = vb2_qbuf(vq, vdev->v4l2_dev->mdev, buffer);
 	if (status) {
-		v4l2_loop_dbg_at1("%s(%s) vb2_qbuf() failed\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_qbuf() failed\n",
 			__func__, video_device_node_name(vdev));
 		return status;
 	}
 
+	trace_v4l2_loop_producer_qbuf(vdev->minor, buffer->index,
+		buffer->sequence, v4l2_loop_buffer_bytesused(buffer));
+
 	return 0;
 }
 
@@ -1808,7 +3916,6 @@ static int v4l2_loop_qbuf_consumer(struct file *file, void *fh, struct v4l2_buff
 		container_of(vdev, struct v4l2_loop_device, vdev);
 	struct v4l2_loop_handle *h =
 		container_of(fh, struct v4l2_loop_handle, fh);
-	struct v4l2_loop_pbuf *pbuf;
 	struct v4l2_loop_cbuf *cbuf;
 	struct vb2_queue *vq = vdev->queue;
 	int status;
@@ -1821,18 +3928,14 @@ static int v4l2_loop_qbuf_consumer(struct file *file, void *fh, struct v4l2_buff
 		return -EINVAL;
 
 	if (buffer->index >= vq->num_buffers) {
-		v4l2_loop_dbg_at1("%s(%s) buffer index #%u is bigger than number of allocated buffers (%u)\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) buffer index #%u is bigger than number of allocated buffers (%u)\n",
 			__func__, video_device_node_name(vdev), buffer->index, vq->num_buffers);
 		return -EINVAL;
 	}
 
 	cbuf = &h->c.bufs[buffer->index];
-	pbuf = cbuf->pbuf;
-
-	if (pbuf) {
-		vb2_buffer_done(&pbuf->vbuf.vb2_buf, VB2_BUF_STATE_DONE);
-		cbuf->pbuf = NULL;
-	}
+	v4l2_loop_cbuf_release_pbuf(cbuf, VB2_BUF_STATE_DONE);
+	v4l2_loop_cbuf_release_image(cbuf);
 
 	if (cbuf->vbuf.vb2_buf.state == VB2_BUF_STATE_QUEUED)
 		return -EINVAL;
@@ -1842,20 +3945,17 @@ static int v4l2_loop_qbuf_consumer(struct file *file, void *fh, struct v4l2_buff
 	cbuf->vbuf.vb2_buf.state = VB2_BUF_STATE_QUEUED;
 	list_add_tail(&cbuf->cnode, &h->c.queued_bufs);
 
+	trace_v4l2_loop_consumer_qbuf(vdev->minor, buffer->index,
+		buffer->sequence, v4l2_loop_buffer_bytesused(buffer));
+
 	return 0;
 }
 
 static int v4l2_loop_qbuf(struct file *file, void *fh, struct v4l2_buffer *buffer)
 {
-	struct video_device *vdev = video_devdata(file);
 	int status;
 
-	v4l2_loop_dbg_at3("%s(%s, %s, %u)\n", __func__,
-		video_device_node_name(vdev),
-		v4l2_loop_buf_type_to_string(buffer->type),
-		buffer->index);
-
-	v4l2_loop_print_buffer(buffer);
+	v4l2_loop_print_buffer(video_devdata(file), buffer);
 
 	if (V4L2_LOOP_IS_PRODUCER(buffer->type))
 		status = v4l2_loop_qbuf_producer(file, fh, buffer);
@@ -1877,20 +3977,81 @@ static int v4l2_loop_dqbuf_producer(struct file *file, void *fh, struct v4l2_buf
 	struct vb2_queue *vq = vdev->queue;
 	int status;
 
-	/* The queue is busy if there is an owner and you are not that owner */
-	if (vq->owner && vq->owner != file->private_data)
+	if (v4l2_loop_queue_is_busy(vq, file))
 		return -EBUSY;
 
 	status = vb2_dqbuf(vq, buffer, file->f_flags & O_NONBLOCK);
 	if (status) {
-		v4l2_loop_dbg_at1("%s(%s) vb2_dqbuf() failed\n",
+		v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_dqbuf() failed\n",
 			__func__, video_device_node_name(vdev));
 		return status;
 	}
 
+	trace_v4l2_loop_producer_dqbuf(vdev->minor, buffer->index,
+		buffer->sequence, v4l2_loop_buffer_bytesused(buffer));
+
 	return 0;
 }
 
+/*
+ * 'timeout_image' to be delivered instead of the content of the last frame
+ * (if it is to be and it was written for the current format).
+ * Must be called with 'queued_bufs_lock' held.
+ */
+static struct v4l2_loop_placeholder *v4l2_loop_get_timeout_image(struct v4l2_loop_device *dev)
+{
+	struct v4l2_loop_placeholder *ph = dev->placeholder;
+
+	if (!READ_ONCE(dev->timeout_use_image) || !ph || !ph->size ||
+		v4l2_loop_format_changed(&ph->format, &dev->format))
+		return NULL;
+
+	kref_get(&ph->refs);
+
+	return ph;
+}
+
+/*
+ * Takes the frame picked by v4l2_loop_next_pbuf() for the consumer,
+ * together with the image to be delivered instead of its content (if any).
+ * Returns -EAGAIN if there is nothing to be delivered yet.
+ */
+static int v4l2_loop_take_pbuf(struct v4l2_loop_device *dev,
+	struct v4l2_loop_consumer_handle *c, struct v4l2_buffer *buffer,
+	struct v4l2_loop_pbuf **ppbuf, struct v4l2_loop_placeholder **pimage, bool *placeholder)
+{
+	struct v4l2_loop_pbuf *pbuf;
+	unsigned long flags;
+	int status = -EAGAIN;
+
+	*pimage = NULL;
+
+	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
+	pbuf = v4l2_loop_next_pbuf(dev, c, placeholder);
+	if (pbuf)
+		status = v4l2_loop_validate_planes(&pbuf->vbuf.vb2_buf, buffer);
+	if (pbuf && !status) {
+		if (pbuf == dev->last_pbuf) { /* placeholder or the frame for a joining consumer */
+			v4l2_loop_pbuf_get(pbuf);
+			if (*placeholder)
+				*pimage = v4l2_loop_get_timeout_image(dev);
+			v4l2_loop_frame_delivered(c, ktime_get_ns());
+		} else {
+			/* reference held by 'queued_bufs' goes to the consumer */
+			list_del(&pbuf->pnode);
+			v4l2_loop_set_last_pbuf(dev, pbuf);
+			v4l2_loop_frame_delivered(c, pbuf->queued_ns);
+		}
+		c->stall_count = dev->stall_count;
+		c->joining = false;
+	}
+	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
+
+	*ppbuf = pbuf;
+
+	return status;
+}
+
 static int v4l2_loop_dqbuf_consumer(struct file *file, void *fh, struct v4l2_buffer *buffer)
 {
 	struct video_device *vdev = video_devdata(file);
@@ -1898,73 +4059,98 @@ static int v4l2_loop_dqbuf_consumer(struct file *file, void *fh, struct v4l2_buf
 		container_of(vdev, struct v4l2_loop_device, vdev);
 	struct v4l2_loop_handle *h =
 		container_of(fh, struct v4l2_loop_handle, fh);
+	struct v4l2_loop_placeholder *image;
 	struct v4l2_loop_pbuf *pbuf;
 	struct v4l2_loop_cbuf *cbuf;
 	struct vb2_queue *vq = vdev->queue;
+	bool placeholder;
+	u64 wait_ns;
 	int status;
-	unsigned long flags;
 
-	if (!h->c.bufs)
-		return -EINVAL;
+	for (;;) {
+		/* consumer's state has to be checked again after every wait */
+		if (!h->c.bufs)
+			return -EINVAL;
 
-	cbuf = NULL;
-	if (!list_empty(&h->c.queued_bufs))
-		cbuf = list_first_entry(&h->c.queued_bufs, struct v4l2_loop_cbuf, cnode);
+		if (list_empty(&h->c.queued_bufs))
+			return -EINVAL;
 
-	if (!cbuf)
-		return -EINVAL;
+		if (!vq->streaming) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) streaming off\n",
+				__func__, video_device_node_name(vdev));
+			return -EINVAL;
+		}
 
-	// TODO: Add support for file->f_flags & O_NONBLOCK
-	status = wait_event_interruptible(dev->waiting_consumers,
-		v4l2_loop_buffer_is_available(dev) ||
-			!vq->streaming || vq->error);
-	if (status)
-		return status;
+		if (vq->error) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) queue in error state\n",
+				__func__, video_device_node_name(vdev));
+			return -EIO;
+		}
 
-	if (!vq->streaming) {
-		v4l2_loop_dbg_at1("%s(%s) streaming off\n",
-			__func__, video_device_node_name(vdev));
-		return -EINVAL;
-	}
+		status = v4l2_loop_take_pbuf(dev, &h->c, buffer, &pbuf, &image, &placeholder);
+		if (status != -EAGAIN)
+			break;
 
-	if (vq->error) {
-		v4l2_loop_dbg_at1("%s(%s) queue in error state\n",
-			__func__, video_device_node_name(vdev));
-		return -EIO;
+		if (file->f_flags & O_NONBLOCK)
+			return -EAGAIN;
+
+		/* release the queue lock (taken by v4l2 core) so the producer can queue its buffers */
+		wait_ns = ktime_get_ns();
+		v4l2_loop_queue_wait_prepare(vq);
+		status = wait_event_interruptible(dev->waiting_consumers,
+			v4l2_loop_frame_is_available(dev, &h->c) ||
+				!vq->streaming || vq->error);
+		v4l2_loop_queue_wait_finish(vq);
+		wait_ns = ktime_get_ns() - wait_ns;
+		WRITE_ONCE(h->c.stats.dqbuf_wait_ns, h->c.stats.dqbuf_wait_ns + wait_ns);
+		atomic64_add(wait_ns, &dev->stats.dqbuf_wait_ns);
+		if (status)
+			return status;
 	}
 
-	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
-	pbuf = list_first_entry(&dev->queued_bufs, struct v4l2_loop_pbuf, pnode);
-	status = v4l2_loop_validate_planes(&pbuf->vbuf.vb2_buf, buffer);
-	if (!status)
-		list_del(&pbuf->pnode);
-	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
-
 	if (status)
 		return status;
 
-	status = v4l2_loop_fill_user_buffer(pbuf, cbuf, buffer);
+	cbuf = list_first_entry(&h->c.queued_bufs, struct v4l2_loop_cbuf, cnode);
+	cbuf->image = image;
+
+	if (h->c.xform)
+		status = v4l2_loop_fill_user_buffer_xform(h->c.xform, pbuf, cbuf, buffer);
+	else
+	if (h->c.gather)
+		status = v4l2_loop_fill_user_buffer_gather(dev, pbuf, cbuf, buffer);
+	else
+		status = v4l2_loop_fill_user_buffer(pbuf, cbuf, buffer);
 	if (status) {
-		vb2_buffer_done(&pbuf->vbuf.vb2_buf, VB2_BUF_STATE_ERROR);
+		v4l2_loop_cbuf_release_image(cbuf);
+		v4l2_loop_pbuf_put(pbuf, VB2_BUF_STATE_ERROR);
 		return status;
 	}
 
+	v4l2_loop_roi_apply(dev, &h->c, buffer);
+
+	if (placeholder) {
+		buffer->flags |= V4L2_LOOP_BUF_FLAG_PLACEHOLDER;
+		v4l2_buffer_set_timestamp(buffer, ktime_get_ns());
+	}
+
 	list_del(&cbuf->cnode);
 	cbuf->pbuf = pbuf;
 	cbuf->vbuf.vb2_buf.state = VB2_BUF_STATE_DEQUEUED;
 
+	v4l2_loop_stats_delivered(dev, &h->c, cbuf->vbuf.vb2_buf.memory,
+		v4l2_loop_buffer_bytesused(buffer), placeholder);
+
+	trace_v4l2_loop_consumer_dqbuf(vdev->minor, buffer->index,
+		buffer->sequence, v4l2_loop_buffer_bytesused(buffer));
+
 	return 0;
 }
 
 static int v4l2_loop_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buffer)
 {
-	struct video_device *vdev = video_devdata(file);
 	int status;
 
-	v4l2_loop_dbg_at3("%s(%s, %s)\n", __func__,
-		video_device_node_name(vdev),
-		v4l2_loop_buf_type_to_string(buffer->type));
-
 	if (V4L2_LOOP_IS_PRODUCER(buffer->type))
 		status = v4l2_loop_dqbuf_producer(file, fh, buffer);
 	else
@@ -1976,7 +4162,7 @@ static int v4l2_loop_dqbuf(struct file *file, void *fh, struct v4l2_buffer *buff
 	if (status)
 		return status;
 
-	v4l2_loop_print_buffer(buffer);
+	v4l2_loop_print_buffer(video_devdata(file), buffer);
 
 	return 0;
 }
@@ -1987,13 +4173,12 @@ static int v4l2_loop_expbuf(struct file *file, void *fh, struct v4l2_exportbuffe
 	struct vb2_queue *vq = vdev->queue;
 	int status;
 
-	v4l2_loop_dbg_at3("%s(%s, %s)\n", __func__,
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s)\n", __func__,
 		video_device_node_name(vdev),
 		v4l2_loop_buf_type_to_string(buffer->type));
 
 	if (V4L2_LOOP_IS_PRODUCER(buffer->type)) {
-		/* The queue is busy if there is a owner and you are not that owner */
-		if (vq->owner && vq->owner != file->private_data)
+		if (v4l2_loop_queue_is_busy(vq, file))
 			return -EBUSY;
 	} else if (V4L2_LOOP_IS_CONSUMER(buffer->type))
 		buffer->type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
@@ -2002,169 +4187,1498 @@ static int v4l2_loop_expbuf(struct file *file, void *fh, struct v4l2_exportbuffe
 
 	status = vb2_expbuf(vq, buffer);
 
-	if (status)
-		return status;
+	if (status)
+		return status;
+
+	//v4l2_loop_print_exportbuffer(buffer);
+
+	return 0;
+}
+
+static int v4l2_loop_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct vb2_queue *vq = vdev->queue;
+	int status;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s)\n", __func__,
+		video_device_node_name(vdev), v4l2_loop_handle_name(fh));
+
+	if (V4L2_LOOP_IS_PRODUCER(type)) {
+		if (v4l2_loop_queue_is_busy(vq, file))
+			return -EBUSY;
+
+		status = vb2_streamon(vq, type);
+		if (status) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_streamon() failed\n",
+				__func__, video_device_node_name(vdev));
+			return status;
+		}
+	} else
+	if (V4L2_LOOP_IS_CONSUMER(type)) {
+		struct v4l2_loop_device *dev =
+			container_of(vdev, struct v4l2_loop_device, vdev);
+		struct v4l2_loop_handle *h =
+			container_of(fh, struct v4l2_loop_handle, fh);
+		unsigned long flags;
+
+		/* the last frame is delivered at once, not only after the producer's next one */
+		spin_lock_irqsave(&dev->queued_bufs_lock, flags);
+		h->c.joining = true;
+		spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
+	} else
+		return -EINVAL;
+
+	trace_v4l2_loop_streamon(vdev->minor, type);
+
+	return 0;
+}
+
+static int v4l2_loop_streamoff(struct file *file, void *fh, enum v4l2_buf_type type)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct vb2_queue *vq = vdev->queue;
+	int status;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s, %s)\n", __func__,
+		video_device_node_name(vdev), v4l2_loop_handle_name(fh));
+
+	if (V4L2_LOOP_IS_PRODUCER(type)) {
+		if (v4l2_loop_queue_is_busy(vq, file))
+			return -EBUSY;
+
+		status = vb2_streamoff(vq, type);
+		if (status) {
+			v4l2_loop_dbg_at1(vdev, "%s(%s) vb2_streamoff() failed\n",
+				__func__, video_device_node_name(vdev));
+			return status;
+		}
+	} else
+	if (V4L2_LOOP_IS_CONSUMER(type))
+		; /* do nothing */
+	else
+		return -EINVAL;
+
+	trace_v4l2_loop_streamoff(vdev->minor, type);
+
+	return 0;
+}
+
+static int v4l2_loop_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	struct video_device *vdev = fh->vdev;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	switch (sub->type) {
+	case V4L2_LOOP_EVENT_STALL:
+		return v4l2_event_subscribe(fh, sub, 2, NULL);
+
+	case V4L2_EVENT_SOURCE_CHANGE:
+		return v4l2_src_change_event_subscribe(fh, sub);
+
+	case V4L2_EVENT_CTRL:
+		return v4l2_ctrl_subscribe_event(fh, sub);
+
+	default:
+		return -EINVAL;
+	}
+}
+
+static int v4l2_loop_unsubscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+{
+	struct video_device *vdev = fh->vdev;
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s)\n", __func__, video_device_node_name(vdev));
+
+	return v4l2_event_unsubscribe(fh, sub);
+}
+
+static void v4l2_loop_g_consumer_mode(struct v4l2_loop_consumer_handle *c,
+	struct v4l2_loop_consumer_mode *mode)
+{
+	memset(mode, 0, sizeof(*mode));
+	mode->max_age_ms = div_u64(c->max_age_ns, NSEC_PER_MSEC);
+}
+
+/*
+ * Frames older than 'max_age_ms' are never delivered to the consumer, it
+ * skips them and they are left waiting for other consumers (placeholders
+ * are not affected, they are timestamped when delivered). As only one
+ * frame waits unless the device is lossless, the consumer always gets
+ * the newest frame anyway.
+ */
+static int v4l2_loop_s_consumer_mode(struct v4l2_loop_device *dev,
+	struct v4l2_loop_handle *h, struct v4l2_loop_consumer_mode *mode)
+{
+	unsigned long flags;
+	int i;
+
+	if (h->htype == V4L2_LOOP_HANDLE_PRODUCER)
+		return -EINVAL;
+
+	for (i = 0; i < ARRAY_SIZE(mode->reserved); i++)
+		if (mode->reserved[i])
+			return -EINVAL;
+
+	if (mode->flags)
+		return -EINVAL;
+
+	/* all frames of a lossless device have to be delivered */
+	if (mode->max_age_ms && READ_ONCE(dev->drop_policy) == V4L2_LOOP_DROP_NONE)
+		return -EBUSY;
+
+	spin_lock_irqsave(&dev->queued_bufs_lock, flags);
+	h->c.max_age_ns = (u64)mode->max_age_ms * NSEC_PER_MSEC;
+	spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
+
+	/* frames waiting might have become available to that consumer */
+	wake_up_all(&dev->waiting_consumers);
+
+	v4l2_loop_g_consumer_mode(&h->c, mode);
+
+	return 0;
+}
+
+static long v4l2_loop_default(struct file *file, void *priv, bool valid_prio,
+	unsigned int cmd, void *arg)
+{
+	struct video_device *vdev = video_devdata(file);
+	struct v4l2_loop_device *dev =
+		container_of(vdev, struct v4l2_loop_device, vdev);
+	struct v4l2_loop_handle *h =
+		container_of(priv, struct v4l2_loop_handle, fh);
+
+	v4l2_loop_dbg_at3(vdev, "%s(%s) cmd 0x%x\n", __func__, video_device_node_name(vdev), cmd);
+
+	switch (cmd) {
+	case V4L2_LOOP_G_CONSUMER_MODE:
+		if (h->htype == V4L2_LOOP_HANDLE_PRODUCER)
+			return -EINVAL;
+		v4l2_loop_g_consumer_mode(&h->c, arg);
+		return 0;
+
+	case V4L2_LOOP_S_CONSUMER_MODE:
+		return v4l2_loop_s_consumer_mode(dev, h, arg);
+
+	default:
+		return -ENOTTY;
+	}
+}
+
+static const struct v4l2_ioctl_ops v4l2_loop_ioctl_ops = {
+	.vidioc_querycap		= v4l2_loop_querycap,
+	.vidioc_enum_framesizes		= v4l2_loop_enum_framesizes,
+	.vidioc_enum_frameintervals	= v4l2_loop_enum_frameintervals,
+
+	.vidioc_enum_output		= v4l2_loop_enum_output,
+	.vidioc_g_output		= v4l2_loop_g_output,
+	.vidioc_s_output		= v4l2_loop_s_output,
+
+	.vidioc_enum_input		= v4l2_loop_enum_input,
+	.vidioc_g_input			= v4l2_loop_g_input,
+	.vidioc_s_input			= v4l2_loop_s_input,
+
+	.vidioc_enum_fmt_vid_cap	= v4l2_loop_enum_fmt_cap,
+	.vidioc_s_fmt_vid_cap		= v4l2_loop_s_fmt_cap,
+	.vidioc_g_fmt_vid_cap		= v4l2_loop_g_fmt_cap,
+	.vidioc_try_fmt_vid_cap		= v4l2_loop_try_fmt_cap,
+	.vidioc_s_fmt_vid_cap_mplane	= v4l2_loop_s_fmt_cap_mplane,
+	.vidioc_g_fmt_vid_cap_mplane	= v4l2_loop_g_fmt_cap_mplane,
+	.vidioc_try_fmt_vid_cap_mplane	= v4l2_loop_try_fmt_cap_mplane,
+
+	.vidioc_enum_fmt_vid_out	= v4l2_loop_enum_fmt_out,
+	.vidioc_s_fmt_vid_out		= v4l2_loop_s_fmt_out,
+	.vidioc_g_fmt_vid_out		= v4l2_loop_g_fmt_out,
+	.vidioc_try_fmt_vid_out		= v4l2_loop_try_fmt_out,
+	.vidioc_s_fmt_vid_out_mplane	= v4l2_loop_s_fmt_out_mplane,
+	.vidioc_g_fmt_vid_out_mplane	= v4l2_loop_g_fmt_out_mplane,
+	.vidioc_try_fmt_vid_out_mplane	= v4l2_loop_try_fmt_out_mplane,
+
+	.vidioc_g_parm			= v4l2_loop_g_parm,
+	.vidioc_s_parm			= v4l2_loop_s_parm,
+
+	.vidioc_g_selection		= v4l2_loop_g_selection,
+	.vidioc_s_selection		= v4l2_loop_s_selection,
+
+	.vidioc_reqbufs			= v4l2_loop_reqbufs,
+	.vidioc_querybuf		= v4l2_loop_querybuf,
+	.vidioc_qbuf			= v4l2_loop_qbuf,
+	.vidioc_dqbuf			= v4l2_loop_dqbuf,
+	.vidioc_expbuf			= v4l2_loop_expbuf,//vb2_ioctl_expbuf,
+
+	.vidioc_streamon		= v4l2_loop_streamon,
+	.vidioc_streamoff		= v4l2_loop_streamoff,
+
+	.vidioc_subscribe_event		= v4l2_loop_subscribe_event,
+	.vidioc_unsubscribe_event	= v4l2_loop_unsubscribe_event,
+
+	.vidioc_default			= v4l2_loop_default
+};
+
+static const char *const v4l2_loop_source_patterns[] = {
+	[V4L2_LOOP_SOURCE_OFF]		= "off",
+	[V4L2_LOOP_SOURCE_BAR]		= "bar",
+	[V4L2_LOOP_SOURCE_COUNTER]	= "counter",
+	[V4L2_LOOP_SOURCE_SOLID]	= "solid",
+};
+
+static void v4l2_loop_source_plane_size(struct v4l2_loop_device *dev, __u32 plane,
+	__u32 *bytesperline, __u32 *sizeimage)
+{
+	if (V4L2_TYPE_IS_MULTIPLANAR(dev->format.type)) {
+		*bytesperline = dev->format.fmt.pix_mp.plane_fmt[plane].bytesperline;
+		*sizeimage = dev->format.fmt.pix_mp.plane_fmt[plane].sizeimage;
+	} else {
+		*bytesperline = dev->format.fmt.pix.bytesperline;
+		*sizeimage = dev->format.fmt.pix.sizeimage;
+	}
+}
+
+/* draws the next frame of the pattern into the planes of producer buffer */
+static void v4l2_loop_source_fill(struct v4l2_loop_device *dev, struct vb2_buffer *vb)
+{
+	struct v4l2_loop_source *src = &dev->source;
+	__u32 plane;
+
+	for (plane = 0; plane < vb->num_planes; plane++) {
+		u8 *vaddr = vb2_plane_vaddr(vb, plane);
+		__u32 bytesperline, sizeimage;
+		__u32 offset, x, width;
+
+		if (!vaddr)
+			continue;
+
+		v4l2_loop_source_plane_size(dev, plane, &bytesperline, &sizeimage);
+
+		switch (src->pattern) {
+		case V4L2_LOOP_SOURCE_BAR:
+			/* 1/8 of a row wide, moves by 1/64 of a row per frame */
+			width = max(bytesperline / 8, 1U);
+			x = div_u64(src->frames * bytesperline, 64) % bytesperline;
+			for (offset = 0; offset + bytesperline <= sizeimage; offset += bytesperline) {
+				u8 *row = vaddr + offset;
+
+				memset(row, 0x10, bytesperline);
+				memset(row + x, 0xeb, min(width, bytesperline - x));
+				if (x + width > bytesperline)
+					memset(row, 0xeb, x + width - bytesperline);
+			}
+			break;
+
+		case V4L2_LOOP_SOURCE_COUNTER:
+			if (plane == 0 && sizeimage >= 2 * sizeof(u64)) {
+				memcpy(vaddr, &src->due_ns, sizeof(u64));
+				memcpy(vaddr + sizeof(u64), &src->frames, sizeof(u64));
+			}
+			break;
+
+		case V4L2_LOOP_SOURCE_SOLID:
+			memset(vaddr, 0x80, sizeimage);
+			break;
+
+		default:
+			break;
+		}
+	}
+}
+
+static void v4l2_loop_source_buffer(struct v4l2_loop_device *dev, struct v4l2_buffer *buffer,
+	struct v4l2_plane *planes, __u32 index)
+{
+	struct vb2_queue *vq = &dev->vb_queue;
+
+	memset(buffer, 0, sizeof(*buffer));
+	buffer->type = vq->type;
+	buffer->memory = V4L2_MEMORY_MMAP;
+	buffer->index = index;
+	buffer->field = V4L2_FIELD_NONE;
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(vq->type)) {
+		__u32 plane;
+
+		memset(planes, 0, sizeof(*planes) * VIDEO_MAX_PLANES);
+		buffer->m.planes = planes;
+		buffer->length = dev->format.fmt.pix_mp.num_planes;
+		for (plane = 0; plane < buffer->length; plane++)
+			planes[plane].bytesused = dev->format.fmt.pix_mp.plane_fmt[plane].sizeimage;
+	} else
+		buffer->bytesused = dev->format.fmt.pix.sizeimage;
+}
+
+/*
+ * Generates one frame: takes back buffers consumers are done with and
+ * queues the next frame into a free one (the frame is skipped if all of
+ * them are still held by consumers). Frames are timestamped with the time
+ * they were due, so consumers can measure their latency exactly.
+ */
+static void v4l2_loop_source_work(struct work_struct *work)
+{
+	struct v4l2_loop_device *dev =
+		container_of(work, struct v4l2_loop_device, source.work);
+	struct v4l2_loop_source *src = &dev->source;
+	struct vb2_queue *vq = &dev->vb_queue;
+	struct v4l2_plane planes[VIDEO_MAX_PLANES];
+	struct v4l2_buffer buffer;
+	struct vb2_buffer *vb;
+	__u32 index;
+	int status;
+
+	mutex_lock(&dev->vb_queue_lock);
+
+	if (src->pattern == V4L2_LOOP_SOURCE_OFF)
+		goto unlock;
+
+	for (;;) {
+		v4l2_loop_source_buffer(dev, &buffer, planes, 0);
+		if (vb2_dqbuf(vq, &buffer, true))
+			break;
+		src->free |= BIT_ULL(buffer.index);
+	}
+
+	if (!src->free) {
+		v4l2_loop_dbg_at2(&dev->vdev, "%s(%s) no free buffer, frame skipped\n",
+			__func__, video_device_node_name(&dev->vdev));
+		goto unlock;
+	}
+
+	index = __ffs64(src->free);
+	vb = vq->bufs[index];
+	v4l2_loop_source_fill(dev, vb);
+
+	v4l2_loop_source_buffer(dev, &buffer, planes, index);
+	v4l2_buffer_set_timestamp(&buffer, src->due_ns); /* copied by vb2, see V4L2_BUF_FLAG_TIMESTAMP_COPY */
+	status = vb2_qbuf(vq, dev->v4l2_dev.mdev, &buffer);
+	if (status) {
+		v4l2_loop_dbg_at1(&dev->vdev, "%s(%s) vb2_qbuf() failed (%d)\n",
+			__func__, video_device_node_name(&dev->vdev), status);
+		goto unlock;
+	}
+
+	src->free &= ~BIT_ULL(index);
+	src->frames++;
+
+unlock:
+	mutex_unlock(&dev->vb_queue_lock);
+}
+
+static enum hrtimer_restart v4l2_loop_source_timer(struct hrtimer *timer)
+{
+	struct v4l2_loop_device *dev =
+		container_of(timer, struct v4l2_loop_device, source.timer);
+	struct v4l2_loop_source *src = &dev->source;
+
+	WRITE_ONCE(src->due_ns, ktime_to_ns(hrtimer_get_expires(timer)));
+	queue_work(system_highpri_wq, &src->work);
+
+	hrtimer_forward_now(timer, ns_to_ktime(div_u64(NSEC_PER_SEC, src->fps)));
+
+	return HRTIMER_RESTART;
+}
+
+static int v4l2_loop_source_set_format(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_source *config)
+{
+	const struct v4l2_loop_fmtdesc *f;
+	struct v4l2_format format;
+
+	f = v4l2_loop_find_fmtdesc(dev->mplane, config->pixelformat);
+	if (f == NULL || f->is_compressed)
+		return -EINVAL;
+
+	memset(&format, 0, sizeof(format));
+	if (dev->mplane) {
+		if ((f->planes >= V4L2_LOOP_MAX_PLANES) || (f->planes >= VIDEO_MAX_PLANES))
+			return -EINVAL;
+
+		format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE;
+		format.fmt.pix_mp.pixelformat = config->pixelformat;
+		format.fmt.pix_mp.width = config->width;
+		format.fmt.pix_mp.height = config->height;
+		format.fmt.pix_mp.field = V4L2_FIELD_NONE;
+		format.fmt.pix_mp.colorspace = V4L2_COLORSPACE_SRGB;
+		v4l2_loop_fill_sizes_mplane(dev, f, &format.fmt.pix_mp);
+	} else {
+		if (f->planes != 1)
+			return -EINVAL;
+
+		format.type = V4L2_BUF_TYPE_VIDEO_OUTPUT;
+		format.fmt.pix.pixelformat = config->pixelformat;
+		format.fmt.pix.width = config->width;
+		format.fmt.pix.height = config->height;
+		format.fmt.pix.field = V4L2_FIELD_NONE;
+		format.fmt.pix.colorspace = V4L2_COLORSPACE_SRGB;
+		v4l2_loop_fill_sizes(dev, f, &format.fmt.pix);
+	}
+
+	return __v4l2_loop_set_producer_format(dev, f, &format);
+}
+
+/* makes the driver the producer of the device, fails with -EBUSY if there is another one */
+static int v4l2_loop_source_start(struct v4l2_loop_device *dev,
+	const struct v4l2_loop_source *config)
+{
+	struct v4l2_loop_source *src = &dev->source;
+	struct vb2_queue *vq = &dev->vb_queue;
+	unsigned int count;
+	int status;
+
+	if (config->width < V4L2_LOOP_DEFAULT_FRMSIZE_MIN_WIDTH ||
+		config->height < V4L2_LOOP_DEFAULT_FRMSIZE_MIN_HEIGHT ||
+		config->fps < V4L2_LOOP_DEFAULT_FPS_MIN || config->fps > dev->max_fps)
+		return -EINVAL;
+
+	mutex_lock(&dev->vb_queue_lock);
+
+	if (src->pattern != V4L2_LOOP_SOURCE_OFF || vq->owner || vb2_is_busy(vq)) {
+		status = -EBUSY;
+		goto unlock;
+	}
+
+	status = v4l2_loop_source_set_format(dev, config);
+	if (status)
+		goto unlock;
+
+	dev->outputparm.capability = V4L2_CAP_TIMEPERFRAME;
+	dev->outputparm.timeperframe.numerator = 1;
+	dev->outputparm.timeperframe.denominator = config->fps;
+
+	/* one more than needed for streaming, so there is always one to generate a frame into */
+	count = min(dev->buffers + 1, dev->max_buffers);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 16, 0)
+	status = vb2_core_reqbufs(vq, VB2_MEMORY_MMAP, 0, &count);
+#else
+	status = vb2_core_reqbufs(vq, VB2_MEMORY_MMAP, &count);
+#endif
+	if (status)
+		goto unlock;
+
+	status = vb2_streamon(vq, vq->type);
+	if (status) {
+		vb2_queue_release(vq);
+		goto unlock;
+	}
+
+	vq->owner = &src->fh;
+	src->pattern = config->pattern;
+	src->pixelformat = config->pixelformat;
+	src->width = dev->mplane ? dev->format.fmt.pix_mp.width : dev->format.fmt.pix.width;
+	src->height = dev->mplane ? dev->format.fmt.pix_mp.height : dev->format.fmt.pix.height;
+	src->fps = config->fps;
+	src->free = count < 64 ? BIT_ULL(count) - 1 : U64_MAX;
+	src->frames = 0;
+
+	hrtimer_start(&src->timer, ns_to_ktime(div_u64(NSEC_PER_SEC, src->fps)), HRTIMER_MODE_REL);
+
+	v4l2_loop_dbg_at1(&dev->vdev, "%s(%s) %s source started (%u buffers, %u fps)\n",
+		__func__, video_device_node_name(&dev->vdev),
+		v4l2_loop_source_patterns[src->pattern], count, src->fps);
+
+unlock:
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status;
+}
+
+static void v4l2_loop_source_stop(struct v4l2_loop_device *dev)
+{
+	struct v4l2_loop_source *src = &dev->source;
+	struct vb2_queue *vq = &dev->vb_queue;
+	bool running;
+
+	mutex_lock(&dev->vb_queue_lock);
+	running = src->pattern != V4L2_LOOP_SOURCE_OFF;
+	src->pattern = V4L2_LOOP_SOURCE_OFF;
+	mutex_unlock(&dev->vb_queue_lock);
+
+	if (!running)
+		return;
+
+	hrtimer_cancel(&src->timer);
+	cancel_work_sync(&src->work);
+
+	mutex_lock(&dev->vb_queue_lock);
+	vb2_queue_release(vq);
+	vq->owner = NULL;
+	v4l2_loop_reset_producer_format(dev);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	v4l2_loop_dbg_at1(&dev->vdev, "%s(%s) source stopped (%llu frames)\n",
+		__func__, video_device_node_name(&dev->vdev), src->frames);
+}
+
+static bool v4l2_loop_device_is_opened(struct v4l2_loop_device *dev)
+{
+	unsigned long flags;
+	bool opened;
+
+	spin_lock_irqsave(&dev->vdev.fh_lock, flags);
+	opened = !list_empty(&dev->vdev.fh_list);
+	spin_unlock_irqrestore(&dev->vdev.fh_lock, flags);
+
+	return opened;
+}
+
+static ssize_t v4l2_loop_debug_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(dev->debug_level));
+}
+
+static ssize_t v4l2_loop_debug_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int level;
+	int status;
+
+	status = kstrtoint(buf, 0, &level);
+	if (status)
+		return status;
+
+	if (level < 0 || level > V4L2_LOOP_DEBUG_LEVEL_MAX)
+		return -EINVAL;
+
+	v4l2_loop_set_debug_level(&dev->debug_level, level);
+
+	return count;
+}
+
+static DEVICE_ATTR(debug, 0644, v4l2_loop_debug_show, v4l2_loop_debug_store);
+
+/* also V4L2_LOOP_CID_TIMEOUT, takes effect immediately */
+static void v4l2_loop_set_timeout(struct v4l2_loop_device *dev, unsigned int timeout_ms)
+{
+	mutex_lock(&dev->vb_queue_lock);
+	WRITE_ONCE(dev->timeout_ms, timeout_ms);
+	if (vb2_is_streaming(&dev->vb_queue))
+		v4l2_loop_stall_watchdog_kick(dev);
+	mutex_unlock(&dev->vb_queue_lock);
+}
+
+static ssize_t v4l2_loop_timeout_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->timeout_ms));
+}
+
+static ssize_t v4l2_loop_timeout_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	unsigned int timeout_ms;
+	int status;
+
+	status = kstrtouint(buf, 0, &timeout_ms);
+	if (status)
+		return status;
+
+	if (timeout_ms > V4L2_LOOP_TIMEOUT_MAX_MS)
+		return -EINVAL;
+
+	v4l2_loop_set_timeout(dev, timeout_ms);
+
+	return count;
+}
+
+static DEVICE_ATTR(timeout, 0644, v4l2_loop_timeout_show, v4l2_loop_timeout_store);
+
+static ssize_t v4l2_loop_stride_align_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->stride_align));
+}
+
+/* takes effect with the next VIDIOC_S_FMT of the producer */
+static ssize_t v4l2_loop_stride_align_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	unsigned int stride_align;
+	int status;
+
+	status = kstrtouint(buf, 0, &stride_align);
+	if (status)
+		return status;
+
+	if (!is_power_of_2(stride_align) || stride_align > V4L2_LOOP_STRIDE_ALIGN_MAX)
+		return -EINVAL;
+
+	WRITE_ONCE(dev->stride_align, stride_align);
+
+	return count;
+}
+
+static DEVICE_ATTR(stride_align, 0644, v4l2_loop_stride_align_show, v4l2_loop_stride_align_store);
+
+static ssize_t v4l2_loop_timeout_mode_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%s\n", READ_ONCE(dev->timeout_use_image) ? "image" : "repeat");
+}
+
+static ssize_t v4l2_loop_timeout_mode_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	if (sysfs_streq(buf, "repeat"))
+		WRITE_ONCE(dev->timeout_use_image, false);
+	else
+	if (sysfs_streq(buf, "image"))
+		WRITE_ONCE(dev->timeout_use_image, true);
+	else
+		return -EINVAL;
+
+	return count;
+}
+
+static DEVICE_ATTR(timeout_mode, 0644, v4l2_loop_timeout_mode_show, v4l2_loop_timeout_mode_store);
+
+static const char * const v4l2_loop_drop_policy_names[] = {
+	[V4L2_LOOP_DROP_OLDEST]	= "oldest",
+	[V4L2_LOOP_DROP_NEWEST]	= "newest",
+	[V4L2_LOOP_DROP_NONE]	= "none",
+};
+
+static ssize_t v4l2_loop_drop_policy_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%s\n", v4l2_loop_drop_policy_names[READ_ONCE(dev->drop_policy)]);
+}
+
+/* takes effect with the next frame queued by the producer */
+static ssize_t v4l2_loop_drop_policy_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int drop_policy;
+
+	drop_policy = sysfs_match_string(v4l2_loop_drop_policy_names, buf);
+	if (drop_policy < 0)
+		return drop_policy;
+
+	WRITE_ONCE(dev->drop_policy, drop_policy);
+
+	return count;
+}
+
+static DEVICE_ATTR(drop_policy, 0644, v4l2_loop_drop_policy_show, v4l2_loop_drop_policy_store);
+
+/*
+ * Settings below can only be changed while the device is idle,
+ * i.e. when nobody has it opened.
+ */
+static int v4l2_loop_store_idle_setting(struct v4l2_loop_device *dev, const char *buf,
+	unsigned int min, unsigned int max, unsigned int *setting)
+{
+	unsigned int value;
+	int status;
+
+	status = kstrtouint(buf, 0, &value);
+	if (status)
+		return status;
+
+	if (value < min || value > max)
+		return -EINVAL;
+
+	mutex_lock(&dev->vb_queue_lock);
+	if (v4l2_loop_device_is_opened(dev))
+		status = -EBUSY;
+	else
+		WRITE_ONCE(*setting, value);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status;
+}
+
+static ssize_t v4l2_loop_buffers_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->buffers));
+}
+
+static ssize_t v4l2_loop_buffers_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int status;
+
+	status = v4l2_loop_store_idle_setting(dev, buf,
+		1, READ_ONCE(dev->max_buffers), &dev->buffers);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(buffers, 0644, v4l2_loop_buffers_show, v4l2_loop_buffers_store);
+
+static ssize_t v4l2_loop_max_buffers_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->max_buffers));
+}
+
+/*
+ * Unlike the settings above, it can be changed while the producer has no
+ * buffers (it takes effect with its next VIDIOC_REQBUFS), the same through
+ * sysfs and V4L2_LOOP_CID_MAX_BUFFERS.
+ */
+static int v4l2_loop_set_max_buffers(struct v4l2_loop_device *dev, unsigned int max_buffers)
+{
+	int status = 0;
+
+	mutex_lock(&dev->vb_queue_lock);
+	if (vb2_is_busy(&dev->vb_queue))
+		status = -EBUSY;
+	else
+	if (max_buffers < dev->buffers || max_buffers > VB2_MAX_FRAME)
+		status = -EINVAL;
+	else
+		WRITE_ONCE(dev->max_buffers, max_buffers);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status;
+}
+
+static ssize_t v4l2_loop_max_buffers_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	unsigned int max_buffers;
+	int status;
+
+	status = kstrtouint(buf, 0, &max_buffers);
+	if (status)
+		return status;
+
+	status = v4l2_loop_set_max_buffers(dev, max_buffers);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(max_buffers, 0644, v4l2_loop_max_buffers_show, v4l2_loop_max_buffers_store);
+
+static ssize_t v4l2_loop_max_width_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->max_width));
+}
+
+static ssize_t v4l2_loop_max_width_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int status;
+
+	status = v4l2_loop_store_idle_setting(dev, buf,
+		V4L2_LOOP_DEFAULT_FRMSIZE_MIN_WIDTH, V4L2_LOOP_DEFAULT_FRMSIZE_MAX_WIDTH,
+		&dev->max_width);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(max_width, 0644, v4l2_loop_max_width_show, v4l2_loop_max_width_store);
+
+static ssize_t v4l2_loop_max_height_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->max_height));
+}
+
+static ssize_t v4l2_loop_max_height_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int status;
+
+	status = v4l2_loop_store_idle_setting(dev, buf,
+		V4L2_LOOP_DEFAULT_FRMSIZE_MIN_HEIGHT, V4L2_LOOP_DEFAULT_FRMSIZE_MAX_HEIGHT,
+		&dev->max_height);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(max_height, 0644, v4l2_loop_max_height_show, v4l2_loop_max_height_store);
+
+static ssize_t v4l2_loop_max_fps_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->max_fps));
+}
+
+static ssize_t v4l2_loop_max_fps_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	int status;
+
+	status = v4l2_loop_store_idle_setting(dev, buf,
+		V4L2_LOOP_DEFAULT_FPS_MIN, V4L2_LOOP_DEFAULT_FPS_MAX, &dev->max_fps);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(max_fps, 0644, v4l2_loop_max_fps_show, v4l2_loop_max_fps_store);
+
+static ssize_t v4l2_loop_max_memory_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%u\n", READ_ONCE(dev->max_memory));
+}
+
+/* takes effect with the next allocation, memory already allocated is kept */
+static ssize_t v4l2_loop_max_memory_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	unsigned int max_memory;
+	int status;
+
+	status = kstrtouint(buf, 0, &max_memory);
+	if (status)
+		return status;
+
+	WRITE_ONCE(dev->max_memory, max_memory);
+
+	return count;
+}
+
+static DEVICE_ATTR(max_memory, 0644, v4l2_loop_max_memory_show, v4l2_loop_max_memory_store);
+
+static ssize_t v4l2_loop_memory_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%lld %lld\n",
+		atomic64_read(&dev->mem_bytes), atomic64_read(&dev->mem_peak));
+}
+
+static DEVICE_ATTR(memory, 0444, v4l2_loop_memory_show, NULL);
+
+static ssize_t v4l2_loop_source_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	struct v4l2_loop_source *src = &dev->source;
+	ssize_t status;
+
+	mutex_lock(&dev->vb_queue_lock);
+	if (src->pattern == V4L2_LOOP_SOURCE_OFF)
+		status = sprintf(buf, "%s\n", v4l2_loop_source_patterns[src->pattern]);
+	else
+		status = sprintf(buf, "%s %c%c%c%c %ux%u %u\n",
+			v4l2_loop_source_patterns[src->pattern],
+			src->pixelformat & 0xff, (src->pixelformat >> 8) & 0xff,
+			(src->pixelformat >> 16) & 0xff, (src->pixelformat >> 24) & 0xff,
+			src->width, src->height, src->fps);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status;
+}
+
+/* "off" or "<pattern> <fourcc> <width>x<height> <fps>", e.g. "bar YUYV 1280x720 30" */
+static ssize_t v4l2_loop_source_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	struct v4l2_loop_source config;
+	char pattern[8];
+	char fourcc[5];
+	int status;
+
+	if (sysfs_streq(buf, v4l2_loop_source_patterns[V4L2_LOOP_SOURCE_OFF])) {
+		v4l2_loop_source_stop(dev);
+		return count;
+	}
+
+	memset(&config, 0, sizeof(config));
+	if (sscanf(buf, "%7s %4s %ux%u %u", pattern, fourcc,
+		&config.width, &config.height, &config.fps) != 5 || strlen(fourcc) != 4)
+		return -EINVAL;
+
+	status = match_string(v4l2_loop_source_patterns,
+		ARRAY_SIZE(v4l2_loop_source_patterns), pattern);
+	if (status <= V4L2_LOOP_SOURCE_OFF)
+		return -EINVAL;
+
+	config.pattern = status;
+	config.pixelformat = v4l2_fourcc(fourcc[0], fourcc[1], fourcc[2], fourcc[3]);
+
+	/* running source is restarted with the new settings */
+	v4l2_loop_source_stop(dev);
+	status = v4l2_loop_source_start(dev, &config);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(source, 0644, v4l2_loop_source_show, v4l2_loop_source_store);
+
+static void v4l2_loop_set_mplane(struct v4l2_loop_device *dev, bool mplane)
+{
+	dev->mplane = mplane;
+	dev->vb_queue.type = mplane ?
+		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
+	dev->vb_queue.is_multiplanar = mplane;
+	dev->vdev.device_caps &=
+		~(V4L2_CAP_VIDEO_CAPTURE_MPLANE | V4L2_CAP_VIDEO_OUTPUT_MPLANE | V4L2_CAP_VIDEO_M2M_MPLANE);
+	if (mplane) {
+		dev->vdev.device_caps |=
+			V4L2_CAP_VIDEO_CAPTURE_MPLANE |
+			V4L2_CAP_VIDEO_OUTPUT_MPLANE |
+			V4L2_CAP_VIDEO_M2M_MPLANE;
+	}
+}
+
+static ssize_t v4l2_loop_mplane_show(struct device *cd,
+	struct device_attribute *attr, char *buf)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+
+	return sprintf(buf, "%d\n", READ_ONCE(dev->mplane));
+}
+
+/* planarity of the producer's queue, its buffers have to be released as well */
+static ssize_t v4l2_loop_mplane_store(struct device *cd,
+	struct device_attribute *attr, const char *buf, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(cd), struct v4l2_loop_device, vdev);
+	bool mplane;
+	int status;
+
+	status = kstrtobool(buf, &mplane);
+	if (status)
+		return status;
+
+	mutex_lock(&dev->vb_queue_lock);
+	if (v4l2_loop_device_is_opened(dev) || vb2_is_busy(&dev->vb_queue))
+		status = -EBUSY;
+	else
+		v4l2_loop_set_mplane(dev, mplane);
+	mutex_unlock(&dev->vb_queue_lock);
+
+	return status ? status : count;
+}
+
+static DEVICE_ATTR(mplane, 0644, v4l2_loop_mplane_show, v4l2_loop_mplane_store);
+
+static struct attribute *v4l2_loop_attrs[] = {
+	&dev_attr_debug.attr,
+	&dev_attr_timeout.attr,
+	&dev_attr_timeout_mode.attr,
+	&dev_attr_drop_policy.attr,
+	&dev_attr_stride_align.attr,
+	&dev_attr_buffers.attr,
+	&dev_attr_max_buffers.attr,
+	&dev_attr_max_width.attr,
+	&dev_attr_max_height.attr,
+	&dev_attr_max_fps.attr,
+	&dev_attr_max_memory.attr,
+	&dev_attr_memory.attr,
+	&dev_attr_source.attr,
+	&dev_attr_mplane.attr,
+	NULL
+};
+
+static size_t v4l2_loop_format_sizeimage(const struct v4l2_format *format)
+{
+	size_t sizeimage = 0;
+	int plane;
+
+	if (!format->type) /* format is not yet set by the producer */
+		return 0;
+
+	if (!V4L2_TYPE_IS_MULTIPLANAR(format->type))
+		return format->fmt.pix.sizeimage;
+
+	for (plane = 0; plane < format->fmt.pix_mp.num_planes; ++plane)
+		sizeimage += format->fmt.pix_mp.plane_fmt[plane].sizeimage;
+
+	return sizeimage;
+}
+
+/* allocates a (blank) placeholder image laid out for the producer's format */
+static struct v4l2_loop_placeholder *v4l2_loop_placeholder_alloc(struct v4l2_loop_device *dev)
+{
+	const struct v4l2_format *format = &dev->format;
+	struct v4l2_loop_placeholder *ph;
+	size_t alloc = 0;
+	__u32 plane;
+	int status;
+
+	if (!v4l2_loop_format_sizeimage(format))
+		return ERR_PTR(-EINVAL);
+
+	ph = kzalloc(sizeof(*ph), GFP_KERNEL_ACCOUNT);
+	if (!ph)
+		return ERR_PTR(-ENOMEM);
+
+	kref_init(&ph->refs);
+	ph->dev = dev;
+	ph->format = *format;
+
+	if (V4L2_TYPE_IS_MULTIPLANAR(format->type)) {
+		ph->num_planes = format->fmt.pix_mp.num_planes;
+		for (plane = 0; plane < ph->num_planes; plane++)
+			ph->planes[plane].size = format->fmt.pix_mp.plane_fmt[plane].sizeimage;
+	} else {
+		ph->num_planes = 1;
+		ph->planes[0].size = format->fmt.pix.sizeimage;
+	}
+
+	for (plane = 0; plane < ph->num_planes; plane++) {
+		ph->planes[plane].offset = alloc;
+		alloc += PAGE_ALIGN(ph->planes[plane].size);
+		ph->image_size += ph->planes[plane].size;
+	}
+
+	status = v4l2_loop_mem_charge(dev, alloc);
+	if (status) {
+		kfree(ph);
+		return ERR_PTR(status);
+	}
+
+	ph->data = vmalloc_user(alloc); /* zeroed and can be mapped by MMAP consumers */
+	if (!ph->data) {
+		v4l2_loop_mem_uncharge(dev, alloc);
+		kfree(ph);
+		return ERR_PTR(-ENOMEM);
+	}
+
+	ph->alloc = alloc;
+	ph->frame_id = atomic64_inc_return(&dev->frame_ids);
+
+	return ph;
+}
+
+/*
+ * Placeholder frame in the format set by the producer (with planes stored
+ * one after another). Writing at offset 0 starts a new image, which is
+ * a buffer of its own, so consumers still holding the previous one are
+ * not affected.
+ */
+static ssize_t v4l2_loop_timeout_image_write(struct file *file, struct kobject *kobj,
+	struct bin_attribute *attr, char *buf, loff_t off, size_t count)
+{
+	struct v4l2_loop_device *dev =
+		container_of(to_video_device(kobj_to_dev(kobj)), struct v4l2_loop_device, vdev);
+	struct v4l2_loop_placeholder *ph;
+	ssize_t status = count;
+	unsigned long flags;
+	size_t start = 0;
+	__u32 plane;
+
+	mutex_lock(&dev->timeout_image_lock);
+
+	if (off == 0) {
+		ph = v4l2_loop_placeholder_alloc(dev);
+		if (IS_ERR(ph)) {
+			status = PTR_ERR(ph);
+			goto unlock;
+		}
+
+		spin_lock_irqsave(&dev->queued_bufs_lock, flags);
+		swap(ph, dev->placeholder);
+		spin_unlock_irqrestore(&dev->queued_bufs_lock, flags);
+
+		if (ph)
+			v4l2_loop_placeholder_put(ph);
+	}
+
+	ph = dev->placeholder;
+	if (!ph || off + count > ph->image_size) {
+		status = -EFBIG;
+		goto unlock;
+	}
+
+	/* planes follow each other in the written image, but start at page boundaries in 'data' */
+	for (plane = 0; plane < ph->num_planes; plane++) {
+		size_t end = start + ph->planes[plane].size;
+
+		if (off < end && off + count > start) {
+			size_t from = max_t(size_t, off, start);
+			size_t to = min_t(size_t, off + count, end);
+
+			memcpy(ph->data + ph->planes[plane].offset + (from - start), buf + (from - off), to - from);
+		}
+
+		start = end;
+	}
+
+	ph->size = max_t(size_t, ph->size, off + count);
+	ph->frame_id = atomic64_inc_return(&dev->frame_ids); /* content has changed */
 
-	//v4l2_loop_print_exportbuffer(buffer);
+unlock:
+	mutex_unlock(&dev->timeout_image_lock);
 
-	return 0;
+	return status;
 }
 
-static int v4l2_loop_streamon(struct file *file, void *fh, enum v4l2_buf_type type)
+static struct bin_attribute v4l2_loop_bin_attr_timeout_image = {
+	.attr = { .name = "timeout_image", .mode = 0200 },
+	.size = 0, /* not known until format is set */
+	.write = v4l2_loop_timeout_image_write,
+};
+
+static struct bin_attribute *v4l2_loop_bin_attrs[] = {
+	&v4l2_loop_bin_attr_timeout_image,
+	NULL
+};
+
+static const struct attribute_group v4l2_loop_attr_group = {
+	.attrs = v4l2_loop_attrs,
+	.bin_attrs = v4l2_loop_bin_attrs,
+};
+
+static int v4l2_loop_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct vb2_queue *vq = vdev->queue;
-	int status;
+	struct v4l2_loop_device *dev =
+		container_of(ctrl->handler, struct v4l2_loop_device, ctrl_handler);
 
-	v4l2_loop_dbg_at3("%s(%s, %s)\n", __func__,
-		video_device_node_name(vdev), v4l2_loop_handle_name(fh));
+	/* these can also be changed through sysfs */
+	switch (ctrl->id) {
+	case V4L2_LOOP_CID_TIMEOUT:
+		ctrl->val = READ_ONCE(dev->timeout_ms);
+		break;
 
-	if (V4L2_LOOP_IS_PRODUCER(type)) {
-		/* The queue is busy if there is a owner and you are not that owner */
-		if (vq->owner && vq->owner != file->private_data)
-			return -EBUSY;
+	case V4L2_LOOP_CID_MAX_BUFFERS:
+		ctrl->val = READ_ONCE(dev->max_buffers);
+		break;
 
-		status = vb2_streamon(vq, type);
-		if (status) {
-			v4l2_loop_dbg_at1("%s(%s) vb2_streamon() failed\n",
-				__func__, video_device_node_name(vdev));
-			return status;
-		}
-	} else
-	if (V4L2_LOOP_IS_CONSUMER(type))
-		; /* do nothing */
-	else
+	case V4L2_LOOP_CID_DROP_POLICY:
+		ctrl->val = READ_ONCE(dev->drop_policy);
+		break;
+
+	default:
 		return -EINVAL;
+	}
 
 	return 0;
 }
 
-static int v4l2_loop_streamoff(struct file *file, void *fh, enum v4l2_buf_type type)
+static int v4l2_loop_s_ctrl(struct v4l2_ctrl *ctrl)
 {
-	struct video_device *vdev = video_devdata(file);
-	struct vb2_queue *vq = vdev->queue;
-	int status;
+	struct v4l2_loop_device *dev =
+		container_of(ctrl->handler, struct v4l2_loop_device, ctrl_handler);
+	int status = 0;
+
+	switch (ctrl->id) {
+	case V4L2_LOOP_CID_KEEP_FORMAT:
+		mutex_lock(&dev->vb_queue_lock);
+		WRITE_ONCE(dev->keep_format, ctrl->val);
+		/* buffers kept after the producer closed are not needed any more */
+		if (!ctrl->val && v4l2_loop_queue_is_detached(&dev->vb_queue)) {
+			vb2_queue_release(&dev->vb_queue);
+			v4l2_loop_reset_producer_format(dev);
+		}
+		mutex_unlock(&dev->vb_queue_lock);
+		break;
 
-	v4l2_loop_dbg_at3("%s(%s, %s)\n", __func__,
-		video_device_node_name(vdev), v4l2_loop_handle_name(fh));
+	case V4L2_LOOP_CID_SUSTAIN_FRAMERATE:
+		mutex_lock(&dev->vb_queue_lock);
+		WRITE_ONCE(dev->sustain_framerate, ctrl->val);
+		if (vb2_is_streaming(&dev->vb_queue))
+			v4l2_loop_stall_watchdog_kick(dev);
+		mutex_unlock(&dev->vb_queue_lock);
+		break;
 
-	if (V4L2_LOOP_IS_PRODUCER(type)) {
-		/* The queue is busy if there is a owner and you are not that owner */
-		if (vq->owner && vq->owner != file->private_data)
-			return -EBUSY;
+	case V4L2_LOOP_CID_TIMEOUT:
+		v4l2_loop_set_timeout(dev, ctrl->val);
+		break;
 
-		status = vb2_streamoff(vq, type);
-		if (status) {
-			v4l2_loop_dbg_at1("%s(%s) vb2_streamoff() failed\n",
-				__func__, video_device_node_name(vdev));
-			return status;
-		}
-	} else
-	if (V4L2_LOOP_IS_CONSUMER(type))
-		; /* do nothing */
-	else
-		return -EINVAL;
+	case V4L2_LOOP_CID_DROP_POLICY: /* takes effect with the next frame queued by the producer */
+		WRITE_ONCE(dev->drop_policy, ctrl->val);
+		break;
 
-	return 0;
+	case V4L2_LOOP_CID_MAX_BUFFERS:
+		status = v4l2_loop_set_max_buffers(dev, ctrl->val);
+		break;
+
+	default:
+		status = -EINVAL;
+		break;
+	}
+
+	return status;
 }
 
-static int v4l2_loop_subscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
-{
-	struct video_device *vdev = fh->vdev;
+static const struct v4l2_ctrl_ops v4l2_loop_ctrl_ops = {
+	.g_volatile_ctrl = v4l2_loop_g_volatile_ctrl,
+	.s_ctrl = v4l2_loop_s_ctrl,
+};
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+static const char * const v4l2_loop_drop_policies[] = {
+	[V4L2_LOOP_DROP_OLDEST]	= "Drop Oldest",
+	[V4L2_LOOP_DROP_NEWEST]	= "Drop Newest",
+	[V4L2_LOOP_DROP_NONE]	= "Lossless",
+	NULL
+};
 
-	return 0;
-}
+static const struct v4l2_ctrl_config v4l2_loop_ctrls[] = {
+	{
+		.ops = &v4l2_loop_ctrl_ops,
+		.id = V4L2_LOOP_CID_KEEP_FORMAT,
+		.name = "Keep Format",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.min = 0,
+		.max = 1,
+		.step = 1,
+		.def = 0,
+	}, {
+		.ops = &v4l2_loop_ctrl_ops,
+		.id = V4L2_LOOP_CID_SUSTAIN_FRAMERATE,
+		.name = "Sustain Framerate",
+		.type = V4L2_CTRL_TYPE_BOOLEAN,
+		.min = 0,
+		.max = 1,
+		.step = 1,
+		.def = 0,
+	}, {
+		.ops = &v4l2_loop_ctrl_ops,
+		.id = V4L2_LOOP_CID_TIMEOUT,
+		.name = "Timeout (ms)",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 0,
+		.max = V4L2_LOOP_TIMEOUT_MAX_MS,
+		.step = 1,
+		.def = 0,
+		.flags = V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	}, {
+		.ops = &v4l2_loop_ctrl_ops,
+		.id = V4L2_LOOP_CID_MAX_BUFFERS,
+		.name = "Max Buffers",
+		.type = V4L2_CTRL_TYPE_INTEGER,
+		.min = 1,
+		.max = VB2_MAX_FRAME,
+		.step = 1,
+		.def = VB2_MAX_FRAME,
+		.flags = V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	}, {
+		.ops = &v4l2_loop_ctrl_ops,
+		.id = V4L2_LOOP_CID_DROP_POLICY,
+		.name = "Drop Policy",
+		.type = V4L2_CTRL_TYPE_MENU,
+		.min = V4L2_LOOP_DROP_OLDEST,
+		.max = V4L2_LOOP_DROP_NONE,
+		.def = V4L2_LOOP_DROP_OLDEST,
+		.qmenu = v4l2_loop_drop_policies,
+		.flags = V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE,
+	},
+};
 
-static int v4l2_loop_unsubscribe_event(struct v4l2_fh *fh, const struct v4l2_event_subscription *sub)
+static int v4l2_loop_init_ctrls(struct v4l2_loop_device *dev)
 {
-	struct video_device *vdev = fh->vdev;
+	int i;
+
+	v4l2_ctrl_handler_init(&dev->ctrl_handler, ARRAY_SIZE(v4l2_loop_ctrls));
+
+	for (i = 0; i < ARRAY_SIZE(v4l2_loop_ctrls); i++)
+		v4l2_ctrl_new_custom(&dev->ctrl_handler, &v4l2_loop_ctrls[i], NULL);
+
+	if (dev->ctrl_handler.error) {
+		int status = dev->ctrl_handler.error;
+		v4l2_ctrl_handler_free(&dev->ctrl_handler);
+		return status;
+	}
 
-	v4l2_loop_dbg_at3("%s(%s)\n", __func__, video_device_node_name(vdev));
+	dev->v4l2_dev.ctrl_handler = &dev->ctrl_handler;
 
 	return 0;
 }
 
-static const struct v4l2_ioctl_ops v4l2_loop_ioctl_ops = {
-	.vidioc_querycap		= v4l2_loop_querycap,
-	.vidioc_enum_framesizes		= v4l2_loop_enum_framesizes,
-	.vidioc_enum_frameintervals	= v4l2_loop_enum_frameintervals,
-
-	.vidioc_enum_output		= v4l2_loop_enum_output,
-	.vidioc_g_output		= v4l2_loop_g_output,
-	.vidioc_s_output		= v4l2_loop_s_output,
+/* frame rate (in 1/100 fps) out of a running average of frame intervals */
+static u32 v4l2_loop_stats_fps(u64 frame_interval_ns, u64 last_frame_ns, u64 now_ns)
+{
+	/* nothing has come for a while, so the average is not current any more */
+	if (!frame_interval_ns || !last_frame_ns ||
+		now_ns - last_frame_ns > max_t(u64, 2 * frame_interval_ns, NSEC_PER_SEC))
+		return 0;
 
-	.vidioc_enum_input		= v4l2_loop_enum_input,
-	.vidioc_g_input			= v4l2_loop_g_input,
-	.vidioc_s_input			= v4l2_loop_s_input,
+	return min_t(u64, div64_u64(100ULL * NSEC_PER_SEC, frame_interval_ns), U32_MAX);
+}
 
-	.vidioc_enum_fmt_vid_cap	= v4l2_loop_enum_fmt_cap,
-	.vidioc_s_fmt_vid_cap		= v4l2_loop_s_fmt_cap,
-	.vidioc_g_fmt_vid_cap		= v4l2_loop_g_fmt_cap,
-	.vidioc_try_fmt_vid_cap		= v4l2_loop_try_fmt_cap,
-	.vidioc_s_fmt_vid_cap_mplane	= v4l2_loop_s_fmt_cap_mplane,
-	.vidioc_g_fmt_vid_cap_mplane	= v4l2_loop_g_fmt_cap_mplane,
-	.vidioc_try_fmt_vid_cap_mplane	= v4l2_loop_try_fmt_cap_mplane,
+/*
+ * /sys/kernel/debug/v4l2-loop/videoN/stats - device wide counters followed
+ * by counters of every consumer which has requested its buffers.
+ */
+static int v4l2_loop_stats_show(struct seq_file *m, void *data)
+{
+	struct v4l2_loop_device *dev = m->private;
+	u64 now_ns = ktime_get_ns();
+	unsigned int consumers = 0;
+	struct v4l2_fh *fh;
+	unsigned long flags;
+	u32 fps;
+
+	fps = v4l2_loop_stats_fps(READ_ONCE(dev->stats.frame_interval_ns),
+		READ_ONCE(dev->stats.last_frame_ns), now_ns);
+
+	seq_printf(m, "frames_queued: %lld\n", atomic64_read(&dev->stats.frames_queued));
+	seq_printf(m, "frames_delivered: %lld\n", atomic64_read(&dev->stats.frames_delivered));
+	seq_printf(m, "frames_dropped: %lld\n", atomic64_read(&dev->stats.frames_dropped));
+	seq_printf(m, "placeholders: %lld\n", atomic64_read(&dev->stats.placeholders));
+	seq_printf(m, "bytes_mmap: %lld\n", atomic64_read(&dev->stats.bytes_mmap));
+	seq_printf(m, "bytes_userptr: %lld\n", atomic64_read(&dev->stats.bytes_userptr));
+	seq_printf(m, "bytes_dmabuf: %lld\n", atomic64_read(&dev->stats.bytes_dmabuf));
+	seq_printf(m, "dqbuf_wait_us: %llu\n",
+		div_u64(atomic64_read(&dev->stats.dqbuf_wait_ns), NSEC_PER_USEC));
+	seq_printf(m, "producer_fps: %u.%02u\n", fps / 100, fps % 100);
+
+	spin_lock_irqsave(&dev->vdev.fh_lock, flags);
+	list_for_each_entry(fh, &dev->vdev.fh_list, list) {
+		struct v4l2_loop_handle *h =
+			container_of(fh, struct v4l2_loop_handle, fh);
+		const struct v4l2_loop_consumer_stats *stats = &h->c.stats;
+
+		if (h->htype != V4L2_LOOP_HANDLE_CONSUMER || !h->c.bufs)
+			continue;
+
+		fps = v4l2_loop_stats_fps(READ_ONCE(stats->frame_interval_ns),
+			READ_ONCE(stats->last_frame_ns), now_ns);
+
+		seq_printf(m, "consumer%u: frames %llu bytes %llu dqbuf_wait_us %llu fps %u.%02u\n",
+			consumers++, READ_ONCE(stats->frames), READ_ONCE(stats->bytes),
+			div_u64(READ_ONCE(stats->dqbuf_wait_ns), NSEC_PER_USEC), fps / 100, fps % 100);
+	}
+	spin_unlock_irqrestore(&dev->vdev.fh_lock, flags);
 
-	.vidioc_enum_fmt_vid_out	= v4l2_loop_enum_fmt_out,
-	.vidioc_s_fmt_vid_out		= v4l2_loop_s_fmt_out,
-	.vidioc_g_fmt_vid_out		= v4l2_loop_g_fmt_out,
-	.vidioc_try_fmt_vid_out		= v4l2_loop_try_fmt_out,
-	.vidioc_s_fmt_vid_out_mplane	= v4l2_loop_s_fmt_out_mplane,
-	.vidioc_g_fmt_vid_out_mplane	= v4l2_loop_g_fmt_out_mplane,
-	.vidioc_try_fmt_vid_out_mplane	= v4l2_loop_try_fmt_out_mplane,
+	seq_printf(m, "consumers: %u\n", consumers);
 
-	.vidioc_g_parm			= v4l2_loop_g_parm,
-	.vidioc_s_parm			= v4l2_loop_s_parm,
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(v4l2_loop_stats);
 
-	.vidioc_reqbufs			= v4l2_loop_reqbufs,
-	.vidioc_querybuf		= v4l2_loop_querybuf,
-	.vidioc_qbuf			= v4l2_loop_qbuf,
-	.vidioc_dqbuf			= v4l2_loop_dqbuf,
-	.vidioc_expbuf			= v4l2_loop_expbuf,//vb2_ioctl_expbuf,
+/* /sys/kernel/debug/v4l2-loop/memory - memory allocated by all devices */
+static int v4l2_loop_total_memory_show(struct seq_file *m, void *data)
+{
+	seq_printf(m, "memory_bytes: %lld\n", atomic64_read(&v4l2_loop_mem_bytes));
+	seq_printf(m, "memory_peak_bytes: %lld\n", atomic64_read(&v4l2_loop_mem_peak));
+	seq_printf(m, "max_memory_mb: %u\n", READ_ONCE(v4l2_loop_max_memory));
 
-	.vidioc_streamon		= v4l2_loop_streamon,
-	.vidioc_streamoff		= v4l2_loop_streamoff,
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(v4l2_loop_total_memory);
 
-	.vidioc_subscribe_event		= v4l2_loop_subscribe_event,
-	.vidioc_unsubscribe_event	= v4l2_loop_unsubscribe_event
-};
+/*
+ * Called once the device has been removed and the last handle to it
+ * has been closed (v4l2_dev's reference count dropped to 0).
+ */
+static void v4l2_loop_release_device(struct v4l2_device *v4l2_dev)
+{
+	struct v4l2_loop_device *dev =
+		container_of(v4l2_dev, struct v4l2_loop_device, v4l2_dev);
+
+	cancel_delayed_work_sync(&dev->stall_work);
+	vb2_queue_release(&dev->vb_queue);
+	v4l2_ctrl_handler_free(&dev->ctrl_handler);
+	if (dev->placeholder)
+		v4l2_loop_placeholder_put(dev->placeholder);
+	ida_free(&v4l2_loop_ida, dev->id);
+	kfree(dev);
+}
 
-static struct v4l2_loop_device* v4l2_loop_alloc_device(int i)
+static struct v4l2_loop_device* v4l2_loop_alloc_device(const struct v4l2_loop_config *config)
 {
 	int status;
+	int x;
+	unsigned int stride_align;
 	struct v4l2_loop_device *dev;
 
 	dev = kzalloc(sizeof(*dev), GFP_KERNEL);
 	if (!dev)
 		return ERR_PTR(-ENOMEM);
 
+	dev->id = ida_alloc(&v4l2_loop_ida, GFP_KERNEL);
+	if (dev->id < 0) {
+		status = dev->id;
+		goto out_free_dev;
+	}
+
 	snprintf(dev->v4l2_dev.name, sizeof(dev->v4l2_dev.name),
-		"v4l2-loop-device-%d", i);
+		"v4l2-loop-device-%d", dev->id);
 
 	status = v4l2_device_register(NULL, &dev->v4l2_dev);
 	if (status) {
 		pr_err("v4l2_device_register() failed\n");
-		goto out_free_dev;
+		goto out_free_id;
 	}
 
+	dev->buffers = config->buffers ? config->buffers : v4l2_loop_buffers;
+	dev->max_buffers = config->max_buffers ? config->max_buffers : VB2_MAX_FRAME;
+	dev->max_buffers = max(dev->max_buffers, dev->buffers);
+	dev->max_width = config->max_width ? config->max_width : V4L2_LOOP_DEFAULT_FRMSIZE_MAX_WIDTH;
+	dev->max_height = config->max_height ? config->max_height : V4L2_LOOP_DEFAULT_FRMSIZE_MAX_HEIGHT;
+	dev->max_fps = config->max_fps ? config->max_fps : V4L2_LOOP_DEFAULT_FPS_MAX;
+	dev->max_memory = config->max_memory;
+	dev->mplane = config->mplane == V4L2_LOOP_MPLANE_DEFAULT ?
+		v4l2_loop_mplane : config->mplane == V4L2_LOOP_MPLANE_ON;
+
 	/* Init videobuf2 queue structure */
 	mutex_init(&dev->vb_queue_lock);
 	dev->vb_queue.lock = &dev->vb_queue_lock;
-	dev->vb_queue.type = v4l2_loop_mplane ?
+	dev->vb_queue.type = dev->mplane ?
 		V4L2_BUF_TYPE_VIDEO_OUTPUT_MPLANE : V4L2_BUF_TYPE_VIDEO_OUTPUT;
 	dev->vb_queue.io_modes = VB2_MMAP | VB2_USERPTR | VB2_DMABUF | VB2_WRITE;
 	dev->vb_queue.drv_priv = dev;
 	dev->vb_queue.buf_struct_size = sizeof(struct v4l2_loop_pbuf);
 	dev->vb_queue.ops = &v4l2_loop_vb2_ops;
 	dev->vb_queue.mem_ops = &vb2_vmalloc_memops;
-	dev->vb_queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
-	dev->vb_queue.min_buffers_needed = v4l2_loop_buffers;
+	/* producer's timestamps are passed to consumers */
+	dev->vb_queue.timestamp_flags = V4L2_BUF_FLAG_TIMESTAMP_COPY;
+	dev->vb_queue.min_buffers_needed = dev->buffers;
 	status = vb2_queue_init(&dev->vb_queue);
 	if (status) {
 		pr_err("vb2_queue_init() failed\n");
-		goto out_free_dev;
+		goto out_unregister_v4l2_device;
 	}
 
 	spin_lock_init(&dev->queued_bufs_lock);
@@ -2173,6 +5687,28 @@ static struct v4l2_loop_device* v4l2_loop_alloc_device(int i)
 	init_waitqueue_head(&dev->waiting_consumers);
 	dev->sequence = 0;
 
+	INIT_DELAYED_WORK(&dev->stall_work, v4l2_loop_stall_work);
+
+	INIT_WORK(&dev->source.work, v4l2_loop_source_work);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(6, 13, 0)
+	hrtimer_setup(&dev->source.timer, v4l2_loop_source_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+#else
+	hrtimer_init(&dev->source.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	dev->source.timer.function = v4l2_loop_source_timer;
+#endif
+	mutex_init(&dev->timeout_image_lock);
+
+	stride_align = config->stride_align ? config->stride_align : v4l2_loop_stride_align;
+	dev->stride_align = is_power_of_2(stride_align) &&
+		stride_align <= V4L2_LOOP_STRIDE_ALIGN_MAX ? stride_align : 1;
+
+	atomic64_set(&dev->frame_ids, 0);
+	mutex_init(&dev->xforms_lock);
+	for (x = 0; x < V4L2_LOOP_MAX_XFORMS; x++) {
+		dev->xforms[x].dev = dev;
+		mutex_init(&dev->xforms[x].lock);
+	}
+
 	dev->vdev.queue = &dev->vb_queue;
 	dev->vdev.fops = &v4l2_loop_fops;
 	dev->vdev.ioctl_ops = &v4l2_loop_ioctl_ops;
@@ -2184,7 +5720,7 @@ static struct v4l2_loop_device* v4l2_loop_alloc_device(int i)
 		V4L2_CAP_VIDEO_CAPTURE |
 		V4L2_CAP_VIDEO_OUTPUT |
 		V4L2_CAP_VIDEO_M2M;
-	if (v4l2_loop_mplane) {
+	if (dev->mplane) {
 		dev->vdev.device_caps |=
 			V4L2_CAP_VIDEO_CAPTURE_MPLANE |
 			V4L2_CAP_VIDEO_OUTPUT_MPLANE |
@@ -2194,72 +5730,302 @@ static struct v4l2_loop_device* v4l2_loop_alloc_device(int i)
 	dev->vdev.release = video_device_release_empty;
 	strscpy(dev->vdev.name, dev->v4l2_dev.name, sizeof(dev->vdev.name));
 
-	status = video_register_device(&dev->vdev, VFL_TYPE_VIDEO, -1);
+	status = v4l2_loop_init_ctrls(dev);
+	if (status) {
+		pr_err("v4l2_loop_init_ctrls() failed\n");
+		goto out_unregister_v4l2_device;
+	}
+
+	status = video_register_device(&dev->vdev, VFL_TYPE_VIDEO, config->nr);
 	if (status) {
 		pr_err("video_register_device() failed\n");
-		goto out_free_dev;
+		goto out_free_ctrl_handler;
 	}
 
+	/* from now on the device is freed by v4l2_loop_release_device() */
+	dev->v4l2_dev.release = v4l2_loop_release_device;
+
+	if (config->nr >= 0 && dev->vdev.num != config->nr) {
+		pr_err("video device number %d is already taken\n", config->nr);
+		status = -EBUSY;
+		goto out_unregister_video_device;
+	}
+
+	status = sysfs_create_group(&dev->vdev.dev.kobj, &v4l2_loop_attr_group);
+	if (status) {
+		pr_err("sysfs_create_group() failed\n");
+		goto out_unregister_video_device;
+	}
+
+	dev->debugfs_dir = debugfs_create_dir(video_device_node_name(&dev->vdev),
+		v4l2_loop_debugfs_root);
+	debugfs_create_file("stats", 0444, dev->debugfs_dir, dev, &v4l2_loop_stats_fops);
+
 	pr_info("registered new video device '%s'\n",
 		video_device_node_name(&dev->vdev));
 
 	return dev;
 
+out_unregister_video_device:
+	video_unregister_device(&dev->vdev);
+	v4l2_device_unregister(&dev->v4l2_dev);
+	v4l2_device_put(&dev->v4l2_dev);
+	return ERR_PTR(status);
+out_free_ctrl_handler:
+	v4l2_ctrl_handler_free(&dev->ctrl_handler);
+out_unregister_v4l2_device:
+	v4l2_device_unregister(&dev->v4l2_dev);
+out_free_id:
+	ida_free(&v4l2_loop_ida, dev->id);
 out_free_dev:
 	kfree(dev);
 	return ERR_PTR(status);
 }
 
+/*
+ * Device can still be opened by someone (if it was removed at runtime),
+ * in which case it is freed when the last handle to it gets closed.
+ */
 static void v4l2_loop_free_device(struct v4l2_loop_device *dev)
 {
+	pr_info("unregistering video device '%s'\n",
+		video_device_node_name(&dev->vdev));
+
+	debugfs_remove_recursive(dev->debugfs_dir);
+	sysfs_remove_group(&dev->vdev.dev.kobj, &v4l2_loop_attr_group);
+	v4l2_loop_source_stop(dev);
+	v4l2_loop_set_debug_level(&dev->debug_level, 0);
 	video_unregister_device(&dev->vdev);
 	v4l2_device_unregister(&dev->v4l2_dev);
-	kfree(dev);
+	v4l2_device_put(&dev->v4l2_dev);
+}
+
+/* must be called with 'v4l2_loop_devices_lock' held */
+static struct v4l2_loop_device *v4l2_loop_find_device(__s32 nr)
+{
+	struct v4l2_loop_device *dev;
+
+	list_for_each_entry(dev, &v4l2_loop_devices_list, node)
+		if (dev->vdev.num == nr)
+			return dev;
+
+	return NULL;
+}
+
+static int v4l2_loop_validate_config(const struct v4l2_loop_config *config)
+{
+	int i;
+
+	for (i = 0; i < ARRAY_SIZE(config->reserved); i++)
+		if (config->reserved[i])
+			return -EINVAL;
+
+	if (config->nr < -1)
+		return -EINVAL;
+
+	if (config->buffers > VB2_MAX_FRAME || config->max_buffers > VB2_MAX_FRAME)
+		return -EINVAL;
+
+	if (config->max_buffers && config->max_buffers < config->buffers)
+		return -EINVAL;
+
+	if (config->max_width &&
+		(config->max_width < V4L2_LOOP_DEFAULT_FRMSIZE_MIN_WIDTH ||
+		 config->max_width > V4L2_LOOP_DEFAULT_FRMSIZE_MAX_WIDTH))
+		return -EINVAL;
+
+	if (config->max_height &&
+		(config->max_height < V4L2_LOOP_DEFAULT_FRMSIZE_MIN_HEIGHT ||
+		 config->max_height > V4L2_LOOP_DEFAULT_FRMSIZE_MAX_HEIGHT))
+		return -EINVAL;
+
+	if (config->max_fps > V4L2_LOOP_DEFAULT_FPS_MAX)
+		return -EINVAL;
+
+	if (config->mplane > V4L2_LOOP_MPLANE_ON)
+		return -EINVAL;
+
+	if (config->stride_align &&
+		(!is_power_of_2(config->stride_align) ||
+		 config->stride_align > V4L2_LOOP_STRIDE_ALIGN_MAX))
+		return -EINVAL;
+
+	return 0;
+}
+
+static void v4l2_loop_get_config(struct v4l2_loop_device *dev, struct v4l2_loop_config *config)
+{
+	memset(config, 0, sizeof(*config));
+	config->nr = dev->vdev.num;
+	config->buffers = dev->buffers;
+	config->mplane = dev->mplane ? V4L2_LOOP_MPLANE_ON : V4L2_LOOP_MPLANE_OFF;
+	config->stride_align = READ_ONCE(dev->stride_align);
+	config->max_buffers = dev->max_buffers;
+	config->max_width = dev->max_width;
+	config->max_height = dev->max_height;
+	config->max_fps = dev->max_fps;
+	config->max_memory = READ_ONCE(dev->max_memory);
+}
+
+static long v4l2_loop_control_ioctl(struct file *file, unsigned int cmd, unsigned long arg)
+{
+	void __user *argp = (void __user *)arg;
+	struct v4l2_loop_config config;
+	struct v4l2_loop_device *dev;
+	__s32 nr;
+	int status = 0;
+
+	switch (cmd) {
+	case V4L2_LOOP_CTL_ADD:
+		if (copy_from_user(&config, argp, sizeof(config)))
+			return -EFAULT;
+
+		status = v4l2_loop_validate_config(&config);
+		if (status)
+			return status;
+
+		mutex_lock(&v4l2_loop_devices_lock);
+		dev = v4l2_loop_alloc_device(&config);
+		if (IS_ERR(dev)) {
+			status = PTR_ERR(dev);
+		} else {
+			list_add_tail(&dev->node, &v4l2_loop_devices_list);
+			v4l2_loop_get_config(dev, &config);
+		}
+		mutex_unlock(&v4l2_loop_devices_lock);
+
+		if (!status && copy_to_user(argp, &config, sizeof(config)))
+			status = -EFAULT;
+		break;
+
+	case V4L2_LOOP_CTL_REMOVE:
+		if (copy_from_user(&nr, argp, sizeof(nr)))
+			return -EFAULT;
+
+		mutex_lock(&v4l2_loop_devices_lock);
+		dev = v4l2_loop_find_device(nr);
+		if (!dev) {
+			status = -ENODEV;
+		} else
+		if (v4l2_loop_device_is_opened(dev)) {
+			status = -EBUSY;
+		} else {
+			list_del(&dev->node);
+			v4l2_loop_free_device(dev);
+		}
+		mutex_unlock(&v4l2_loop_devices_lock);
+		break;
+
+	case V4L2_LOOP_CTL_QUERY:
+		if (copy_from_user(&config, argp, sizeof(config)))
+			return -EFAULT;
+
+		mutex_lock(&v4l2_loop_devices_lock);
+		dev = v4l2_loop_find_device(config.nr);
+		if (!dev)
+			status = -ENODEV;
+		else
+			v4l2_loop_get_config(dev, &config);
+		mutex_unlock(&v4l2_loop_devices_lock);
+
+		if (!status && copy_to_user(argp, &config, sizeof(config)))
+			status = -EFAULT;
+		break;
+
+	default:
+		status = -ENOTTY;
+		break;
+	}
+
+	return status;
+}
+
+static const struct file_operations v4l2_loop_control_fops = {
+	.owner		= THIS_MODULE,
+	.unlocked_ioctl	= v4l2_loop_control_ioctl,
+	.compat_ioctl	= compat_ptr_ioctl,
+	.llseek		= noop_llseek,
+};
+
+static struct miscdevice v4l2_loop_control = {
+	.minor		= MISC_DYNAMIC_MINOR,
+	.name		= V4L2_LOOP_CONTROL_NAME,
+	.fops		= &v4l2_loop_control_fops,
+};
+
+static void v4l2_loop_free_devices(void)
+{
+	struct list_head *p, *n;
+
+	mutex_lock(&v4l2_loop_devices_lock);
+	list_for_each_safe(p, n, &v4l2_loop_devices_list) {
+		struct v4l2_loop_device *dev;
+		dev = list_entry(p, struct v4l2_loop_device, node);
+		list_del(&dev->node);
+		v4l2_loop_free_device(dev);
+	}
+	mutex_unlock(&v4l2_loop_devices_lock);
 }
 
-static int __init v4l2_loop_init(void)
+static int __init __maybe_unused v4l2_loop_init(void)
 {
+	const struct v4l2_loop_config config = {
+		.nr = -1,
+		.mplane = V4L2_LOOP_MPLANE_DEFAULT,
+	};
+	int status;
 	int i;
 
+	v4l2_loop_fmtdescs_index_init();
+
+	v4l2_loop_debugfs_root = debugfs_create_dir("v4l2-loop", NULL);
+	debugfs_create_file("memory", 0444, v4l2_loop_debugfs_root, NULL, &v4l2_loop_total_memory_fops);
+
+	mutex_lock(&v4l2_loop_devices_lock);
 	for (i = 0; i < v4l2_loop_devices; ++i) {
-		struct v4l2_loop_device *dev = v4l2_loop_alloc_device(i);
+		struct v4l2_loop_device *dev = v4l2_loop_alloc_device(&config);
 		if (IS_ERR(dev))
 			break;
 		list_add_tail(&dev->node, &v4l2_loop_devices_list);
 	}
+	mutex_unlock(&v4l2_loop_devices_lock);
 
 	if (i < v4l2_loop_devices) {
-		struct list_head *p, *n;
-
-		list_for_each_safe(p, n, &v4l2_loop_devices_list) {
-			struct v4l2_loop_device *dev;
-			dev = list_entry(p, struct v4l2_loop_device, node);
-			v4l2_loop_free_device(dev);
-		}
+		v4l2_loop_free_devices();
+		debugfs_remove_recursive(v4l2_loop_debugfs_root);
 		return -EFAULT;
 	}
 
+	status = misc_register(&v4l2_loop_control);
+	if (status) {
+		pr_err("misc_register() failed\n");
+		v4l2_loop_free_devices();
+		debugfs_remove_recursive(v4l2_loop_debugfs_root);
+		return status;
+	}
+
 	pr_info("module loaded (version: %s)\n", V4L2_LOOP_VERSION_STR);
 
 	return 0;
 }
+#ifndef V4L2_LOOP_KUNIT /* v4l2-loop-test.c includes the driver, but not its init/exit */
 module_init(v4l2_loop_init);
+#endif
 
 #ifdef MODULE
-static void __exit v4l2_loop_exit(void)
+static void __exit __maybe_unused v4l2_loop_exit(void)
 {
-	struct list_head *p, *n;
-
-	list_for_each_safe(p, n, &v4l2_loop_devices_list) {
-		struct v4l2_loop_device *dev;
-		dev = list_entry(p, struct v4l2_loop_device, node);
-		v4l2_loop_free_device(dev);
-	}
+	misc_deregister(&v4l2_loop_control);
+	v4l2_loop_free_devices();
+	debugfs_remove_recursive(v4l2_loop_debugfs_root);
+	ida_destroy(&v4l2_loop_ida);
 
 	pr_info("module removed\n");
 }
+#ifndef V4L2_LOOP_KUNIT
 module_exit(v4l2_loop_exit);
 #endif
+#endif
 
 MODULE_DESCRIPTION("v4l2 loop device with dma-buf and mplane support");
 MODULE_AUTHOR("Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>");
@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+/*
+ * v4l2-loop.h
+ *
+ * Copyright (C) 2022 Lukasz Wiecaszek <lukasz.wiecaszek(at)gmail.com>
+ *
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms and conditions of the GNU General Public License,
+ * version 2, as published by the Free Software Foundation.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License (in file COPYING) for more details.
+ */
+#ifndef V4L2_LOOP_H
+#define V4L2_LOOP_H
+
+#include <linux/types.h>
+#include <linux/videodev2.h>
+
+/*
+ * Set in v4l2_buffer.flags of consumer buffers which do not carry
+ * a new frame from the producer, but a placeholder (either repeated
+ * last frame or the 'timeout_image') delivered because producer stalled.
+ */
+#define V4L2_LOOP_BUF_FLAG_PLACEHOLDER		0x00400000
+
+/* v4l2-loop private events */
+#define V4L2_LOOP_EVENT_BASE			(V4L2_EVENT_PRIVATE_START + 0x1000)
+#define V4L2_LOOP_EVENT_STALL			(V4L2_LOOP_EVENT_BASE + 1)
+
+/* payload of V4L2_LOOP_EVENT_STALL (placed in v4l2_event.u.data) */
+struct v4l2_loop_event_stall {
+	__u32 stalled;		/* 1 - producer stalled, 0 - producer resumed */
+	__u32 timeout_ms;	/* timeout which has elapsed */
+	__u32 sequence;		/* sequence number of the next frame expected from the producer */
+};
+
+/* v4l2-loop private controls */
+#define V4L2_LOOP_CID_BASE			(V4L2_CID_USER_BASE | 0xf100)
+#define V4L2_LOOP_CID_KEEP_FORMAT		(V4L2_LOOP_CID_BASE + 0) /* producer's format and buffers survive its close */
+#define V4L2_LOOP_CID_SUSTAIN_FRAMERATE		(V4L2_LOOP_CID_BASE + 1) /* stalls are filled at producer's frame rate */
+#define V4L2_LOOP_CID_TIMEOUT			(V4L2_LOOP_CID_BASE + 2) /* stall timeout in ms, 0 - none */
+#define V4L2_LOOP_CID_MAX_BUFFERS		(V4L2_LOOP_CID_BASE + 3) /* maximum number of producer buffers */
+#define V4L2_LOOP_CID_DROP_POLICY		(V4L2_LOOP_CID_BASE + 4) /* V4L2_LOOP_DROP_* */
+
+/*
+ * values of V4L2_LOOP_CID_DROP_POLICY (and of the 'drop_policy' sysfs attribute),
+ * what happens to frames consumers do not keep up with; V4L2_LOOP_DROP_NONE
+ * cannot skip frames, so it also disables frame rate decimation of consumers
+ * (their VIDIOC_S_PARM frame rate is not applied, every frame is delivered)
+ */
+#define V4L2_LOOP_DROP_OLDEST			0	/* only the newest frame waits for consumers */
+#define V4L2_LOOP_DROP_NEWEST			1	/* new frames are dropped while one is waiting */
+#define V4L2_LOOP_DROP_NONE			2	/* lossless, all frames wait and the producer is throttled */
+
+/* consumer's delivery mode, set on its handle with V4L2_LOOP_S_CONSUMER_MODE */
+struct v4l2_loop_consumer_mode {
+	__u32 flags;		/* none defined yet, must be 0 */
+	__u32 max_age_ms;	/* older frames are never delivered (not with V4L2_LOOP_DROP_NONE), 0 - no limit */
+	__u32 reserved[6];	/* must be zeroed */
+};
+
+#define V4L2_LOOP_G_CONSUMER_MODE	_IOR('V', BASE_VIDIOC_PRIVATE + 0x20, struct v4l2_loop_consumer_mode)
+#define V4L2_LOOP_S_CONSUMER_MODE	_IOW('V', BASE_VIDIOC_PRIVATE + 0x21, struct v4l2_loop_consumer_mode)
+
+/*
+ * Control device (/dev/v4l2-loop), loop devices are added and removed
+ * at runtime with ioctls issued on it.
+ */
+#define V4L2_LOOP_CONTROL_NAME			"v4l2-loop"
+
+/* settings of a loop device, zero means the module parameter's (or driver's default) value */
+struct v4l2_loop_config {
+	__s32 nr;		/* video device number (/dev/videoN), -1 - first free one */
+	__u32 buffers;		/* minimum number of buffers needed before start streaming */
+	__u32 mplane;		/* V4L2_LOOP_MPLANE_* */
+	__u32 stride_align;	/* alignment (power of 2, in bytes) of rows of producer formats */
+	__u32 max_buffers;	/* maximum number of producer buffers (queue depth) */
+	__u32 max_width;	/* largest frame the producer can set */
+	__u32 max_height;
+	__u32 max_fps;		/* highest frame rate the producer and consumers can set */
+	__u32 max_memory;	/* limit (in MiB) of memory allocated by the device, 0 - none */
+	__u32 reserved[7];	/* must be zeroed */
+};
+
+#define V4L2_LOOP_MPLANE_DEFAULT		0	/* as the 'mplane' module parameter */
+#define V4L2_LOOP_MPLANE_OFF			1	/* single planar API */
+#define V4L2_LOOP_MPLANE_ON			2	/* multi planar API */
+
+/* creates a device, 'nr' is set to the number of the created one */
+#define V4L2_LOOP_CTL_ADD	_IOWR('V', BASE_VIDIOC_PRIVATE + 0x10, struct v4l2_loop_config)
+/* removes a device (given by its number), fails with EBUSY if it is opened */
+#define V4L2_LOOP_CTL_REMOVE	_IOW('V', BASE_VIDIOC_PRIVATE + 0x11, __s32)
+/* gets settings of a device (given by 'nr') */
+#define V4L2_LOOP_CTL_QUERY	_IOWR('V', BASE_VIDIOC_PRIVATE + 0x12, struct v4l2_loop_config)
+
+#endif /* V4L2_LOOP_H */